@@ -1,20 +1,44 @@
 /** Audio API Quick Start Guide: ALSA: Play audio from stdin
-Link with -lalsa */
-#include <alsa/asoundlib.h>
+Usage: alsa-play [-format int16|int24|int32|float32] [-rate STDIN_RATE] [-channels STDIN_CHANNELS] [-buffer MSEC] [-period MSEC] [-lowlatency] [-device ID] [-rt PRIO] [-cpu LIST] [-reader] [-planar] [-quality fast|medium|high|best] [-mix FILE[:GAIN_DB]]... [-volume DB] [-ctl]
+Link with -lalsa -lpthread -lm
+Build with -DUSE_VDEV (without -lalsa) to use the virtual device instead of ALSA: see vdev.h */
+#ifdef USE_VDEV
+	#include "vdev.h"
+#else
+	#include <alsa/asoundlib.h>
+#endif
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include "ringbuffer.h"
+#include "pcm-interleave.h"
+#include "pcm-resample.h"
+#include "mix-input.h"
+#include "pcm-gain.h"
+#include "pcm-remap.h"
+#include "audio-conf.h"
+#include "rt.h"
+#include "pcm-glitch.h"
 
 int quit;
+u_int xruns; // underruns and suspends: each one is a glitch in the audio stream
 
-snd_pcm_t* abuf_create(u_int *buf_size, u_int *frame_size)
+/** Open the device with the requested stream parameters
+conf: [in/out] the requested values;  the actual values on return */
+snd_pcm_t* abuf_create(struct audio_conf *conf, u_int *buf_size, u_int *frame_size)
 {
 	// Attach audio buffer to device
 	snd_pcm_t *pcm;
-	const char *device_id = "plughw:0,0"; // Use default device
+	const char *device_id = (conf->device != NULL) ? conf->device : "plughw:0,0"; // Use default device
 	int mode = SND_PCM_STREAM_PLAYBACK;
-	assert(0 == snd_pcm_open(&pcm, device_id, mode, 0));
+	// Disable ALSA's channel conversion: we get the closest N of channels the hardware supports and remap the data ourselves
+	assert(0 == snd_pcm_open(&pcm, device_id, mode, SND_PCM_NO_AUTO_CHANNELS));
 
 	// Get device property-set
 	snd_pcm_hw_params_t *params;
@@ -26,28 +50,71 @@ snd_pcm_t* abuf_create(u_int *buf_size, u_int *frame_size)
 	assert(0 == snd_pcm_hw_params_set_access(pcm, params, access));
 
 	// Set sample format
-	int format = SND_PCM_FORMAT_S16_LE;
-	assert(0 == snd_pcm_hw_params_set_format(pcm, params, format));
+	static const int formats[] = { SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+	assert(0 == snd_pcm_hw_params_set_format(pcm, params, formats[conf->format]));
 
 	// Set channels
-	u_int channels = 2;
+	u_int channels = conf->channels;
 	assert(0 == snd_pcm_hw_params_set_channels_near(pcm, params, &channels));
 
-	// Set sample rate
-	u_int sample_rate = 48000;
+	// Set sample rate.
+	// Disable ALSA's resampler: we get the closest rate the hardware supports and resample the data ourselves.
+	u_int sample_rate = conf->rate;
+	assert(0 == snd_pcm_hw_params_set_rate_resample(pcm, params, 0));
 	assert(0 == snd_pcm_hw_params_set_rate_near(pcm, params, &sample_rate, 0));
 
-	fprintf(stderr, "Using format int16, sample rate %u, channels %u\n", sample_rate, channels);
+	// Set the interval of hardware interrupts.
+	// Low latency: the smallest period the device supports.
+	snd_pcm_uframes_t buf_frames, period_frames;
+	if (conf->period_usec != 0) {
+		u_int period_usec = conf->period_usec;
+		assert(0 == snd_pcm_hw_params_set_period_time_near(pcm, params, &period_usec, NULL));
+	} else {
+		int dir = 0;
+		assert(0 == snd_pcm_hw_params_get_period_size_min(params, &period_frames, &dir));
+		if (period_frames < (snd_pcm_uframes_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000)
+			period_frames = (snd_pcm_uframes_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000;
+		assert(0 == snd_pcm_hw_params_set_period_size_near(pcm, params, &period_frames, NULL));
+	}
 
-	// Set audio buffer length
-	u_int buffer_length_usec = 500 * 1000;
-	assert(0 == snd_pcm_hw_params_set_buffer_time_near(pcm, params, &buffer_length_usec, NULL));
+	// Set audio buffer length.
+	// Low latency: just a few periods.
+	if (conf->buffer_usec != 0) {
+		u_int buffer_length_usec = conf->buffer_usec;
+		assert(0 == snd_pcm_hw_params_set_buffer_time_near(pcm, params, &buffer_length_usec, NULL));
+	} else {
+		assert(0 == snd_pcm_hw_params_get_period_size(params, &period_frames, NULL));
+		buf_frames = period_frames * AUDIO_CONF_LL_PERIODS;
+		assert(0 == snd_pcm_hw_params_set_buffer_size_near(pcm, params, &buf_frames));
+	}
 
 	// Apply configuration
 	assert(0 == snd_pcm_hw_params(pcm, params));
 
-	*frame_size = (16/8) * channels;
-	*buf_size = sample_rate * (16/8) * channels * buffer_length_usec / 1000000;
+	// Get the actual buffer and period sizes
+	assert(0 == snd_pcm_hw_params_get_buffer_size(params, &buf_frames));
+	assert(0 == snd_pcm_hw_params_get_period_size(params, &period_frames, NULL));
+	conf->rate = sample_rate;
+	conf->channels = channels;
+	conf->buffer_usec = (uint64_t)buf_frames * 1000000 / sample_rate;
+	conf->period_usec = (uint64_t)period_frames * 1000000 / sample_rate;
+	audio_conf_report(conf->format, sample_rate, channels, conf->buffer_usec, conf->period_usec);
+
+	// Get device property-set for the software parameters
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_sw_params_alloca(&sw_params);
+	assert(0 == snd_pcm_sw_params_current(pcm, sw_params));
+
+	// Wake us up only when at least 1 period of free space is available
+	assert(0 == snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_frames));
+
+	// Start the stream automatically as soon as the buffer is full
+	assert(0 == snd_pcm_sw_params_set_start_threshold(pcm, sw_params, buf_frames));
+
+	assert(0 == snd_pcm_sw_params(pcm, sw_params));
+
+	*frame_size = pcm_fmt_size(conf->format) * channels;
+	*buf_size = buf_frames * *frame_size;
 	return pcm;
 }
 
@@ -56,12 +123,32 @@ void on_sigint()
 	quit = 1;
 }
 
+/** Sleep until the device needs more data (avail_min frames of free space) or an error occurs.
+The error itself is returned by the next snd_pcm_avail_update(). */
+void abuf_wait(snd_pcm_t *pcm, struct pollfd *fds, u_int nfds)
+{
+	for (;;) {
+		// Interrupted by a signal, or the device is stuck: let the caller check its state
+		if (0 >= poll(fds, nfds, 1000))
+			return;
+
+		// The events on the descriptors don't map to the stream's state directly: ask ALSA
+		unsigned short revents;
+		assert(0 == snd_pcm_poll_descriptors_revents(pcm, fds, nfds, &revents));
+		if (revents & (POLLOUT | POLLERR))
+			return;
+	}
+}
+
 int abuf_handle_error(snd_pcm_t *pcm, int r)
 {
+	char ts[16];
 	switch (r) {
 
 	case -ESTRPIPE:
 		// Sound device is temporarily unavailable.  Wait until it's online.
+		fprintf(stderr, "%s: device suspended\n", pcm_glitch_time(ts));
+		xruns++;
 		while (-EAGAIN == (r = snd_pcm_resume(pcm))) {
 			int period_ms = 100;
 			usleep(period_ms*1000);
@@ -72,6 +159,10 @@ int abuf_handle_error(snd_pcm_t *pcm, int r)
 
 	case -EPIPE:
 		// Overrun or underrun occurred.  Reset buffer.
+		if (r == -EPIPE) {
+			fprintf(stderr, "%s: underrun\n", pcm_glitch_time(ts));
+			xruns++;
+		}
 		if (0 > (r = snd_pcm_prepare(pcm)))
 			return r;
 		return 0;
@@ -80,16 +171,438 @@ int abuf_handle_error(snd_pcm_t *pcm, int r)
 	return r;
 }
 
-void main()
+// Non-interleaved data block read from stdin:
+//  PLANAR_BLOCK samples of channel #0, then PLANAR_BLOCK samples of channel #1, etc.
+#define PLANAR_BLOCK  1024
+
+// Stdin reader thread: reads stdin in large chunks into a ring buffer,
+//  so a slow producer doesn't stall the device loop while it holds the mmap region
+#define READER_RING_MSEC  1000
+#define READER_CHUNK  (64*1024) // bytes
+
+struct input {
+	u_int channels, sample_size, frame_size;
+	struct mix *mix; // mix the inputs instead of reading stdin
+
+	ringbuffer *ring; // filled by the reader thread
+	pthread_t thread;
+	_Atomic int eof;
+
+	int planar;
+	char *data; // planar block
+	u_int frames, off; // number of frames in block; current position
+};
+
+// Reads stdin into the ring buffer
+void* stdin_reader(void *param)
+{
+	struct input *in = param;
+	ringbuffer *ring = in->ring;
+	size_t chunk_frames = READER_CHUNK / ring->frame_size;
+	size_t partial = 0; // bytes of an incomplete frame
+	for (;;) {
+		ringbuffer_chunk d;
+		size_t h = ringbuf_write_begin_frames(ring, chunk_frames, &d, NULL);
+		if (d.len == 0) {
+			ringbuf_wait_writable(ring, chunk_frames * ring->frame_size, 100);
+			continue;
+		}
+
+		ssize_t r = read(0, d.ptr + partial, d.len - partial);
+		if (r <= 0)
+			break; // stdin data is complete;  an incomplete frame at the end is dropped
+
+		// A pipe returns any number of bytes: commit whole frames only.
+		// The incomplete frame stays right after the committed data,
+		//  i.e. at the beginning of the next region we get.
+		size_t n = partial + r;
+		partial = n % ring->frame_size;
+		ringbuf_write_finish(ring, h - d.len + n - partial);
+	}
+	atomic_store(&in->eof, 1);
+	return NULL;
+}
+
+void reader_start(struct input *in, u_int rate)
+{
+	size_t frames = (size_t)rate * READER_RING_MSEC / 1000;
+	assert(NULL != (in->ring = ringbuf_alloc_frames(frames, in->frame_size, RINGBUF_LOCK)));
+	assert(0 == pthread_create(&in->thread, NULL, stdin_reader, in));
+}
+
+void reader_close(struct input *in)
+{
+	// The thread may still be blocked in read() if we're interrupted: it exits with the process
+	if (!atomic_load(&in->eof))
+		return;
+	pthread_join(in->thread, NULL);
+	ringbuf_free(in->ring);
+}
+
+/** Read up to 'n' bytes of stdin data: from the reader's ring buffer (whole frames only) or directly
+Return N of bytes;  0 if stdin data is complete */
+size_t stdin_read(struct input *in, void *dst, size_t n)
+{
+	if (in->ring == NULL) {
+		ssize_t r = read(0, dst, n);
+		return (r > 0) ? r : 0;
+	}
+
+	ringbuffer_chunk d;
+	size_t h;
+	for (;;) {
+		int eof = atomic_load(&in->eof);
+		h = ringbuf_read_begin_frames(in->ring, n / in->frame_size, &d, NULL);
+		if (d.len != 0 || eof)
+			break;
+		// The producer is late: the audio buffer still holds the data we've written before
+		ringbuf_wait_readable(in->ring, in->frame_size, 100);
+	}
+	if (d.len == 0)
+		return 0;
+	memcpy(dst, d.ptr, d.len);
+	ringbuf_read_finish(in->ring, h);
+	return d.len;
+}
+
+/** Read the next planar block from stdin
+Return N of frames;  0 if stdin data is complete */
+u_int planar_block_read(struct input *in)
+{
+	size_t cap = PLANAR_BLOCK * in->frame_size, n = 0;
+	if (in->data == NULL)
+		assert(NULL != (in->data = malloc(cap)));
+
+	while (n < cap) {
+		size_t r = stdin_read(in, in->data + n, cap - n);
+		if (r == 0)
+			break;
+		n += r;
+	}
+
+	// The last block may be shorter;  an incomplete frame at the end is dropped
+	n -= n % in->frame_size;
+	in->frames = n / in->frame_size;
+	in->off = 0;
+	return in->frames;
+}
+
+/** Read up to 'frames' interleaved frames from stdin
+Return N of frames;  0 if stdin data is complete */
+u_int input_read(struct input *in, void *dst, u_int frames)
+{
+	if (in->mix != NULL)
+		return mix_read(in->mix, dst, frames, 1);
+
+	if (!in->planar) {
+		// A pipe may return a part of a frame: read until the frame is complete
+		size_t n = 0, cap = frames * in->frame_size;
+		do {
+			size_t r = stdin_read(in, (char*)dst + n, cap - n);
+			if (r == 0)
+				break; // an incomplete frame at the end is dropped
+			n += r;
+		} while (n % in->frame_size != 0);
+		return n / in->frame_size;
+	}
+
+	if (in->off == in->frames)
+		planar_block_read(in);
+	if (frames > in->frames - in->off)
+		frames = in->frames - in->off;
+
+	// Each channel's data in the block follows the previous channel's data
+	const void *planes[in->channels];
+	for (u_int c = 0;  c < in->channels;  c++) {
+		planes[c] = in->data + (c * in->frames + in->off) * in->sample_size;
+	}
+	pcm_interleave(dst, planes, in->channels, frames, in->sample_size);
+	in->off += frames;
+	return frames;
+}
+
+// Channel conversion: stdin data is converted to float32, remapped to the device's channels,
+//  then converted back to the device format (with dither) directly into the audio buffer.
+// With resampling the remapped float32 data goes straight to the resampler,
+//  so it's converted to the device format (and dithered) only once, at the end.
+#define REMAP_CHUNK  1024 // frames
+
+struct remap_stage {
+	pcm_remapper rm;
+	pcm_dither dither;
+	void *data; // stdin data
+	float *in, *out;
+	u_int format, channels, frame_size; // output
+};
+
+void remap_init(struct remap_stage *s, u_int format, u_int in_channels, u_int out_channels)
+{
+	assert(0 == pcm_remap_init(&s->rm, in_channels, out_channels));
+	pcm_dither_init(&s->dither, 1);
+	s->format = format;
+	s->channels = out_channels;
+	s->frame_size = out_channels * pcm_fmt_size(format);
+	assert(NULL != (s->data = malloc(REMAP_CHUNK * in_channels * pcm_fmt_size(format))));
+	assert(NULL != (s->in = malloc(REMAP_CHUNK * in_channels * sizeof(float))));
+	assert(NULL != (s->out = malloc(REMAP_CHUNK * out_channels * sizeof(float))));
+}
+
+void remap_close(struct remap_stage *s)
+{
+	free(s->data);
+	free(s->in);
+	free(s->out);
+}
+
+/** Read up to 'frames' frames and remap them into float32 'dst'
+Return N of frames;  0 if stdin data is complete */
+u_int remap_read(struct remap_stage *s, struct input *in, float *dst, u_int frames)
 {
+	if (frames > REMAP_CHUNK)
+		frames = REMAP_CHUNK;
+	frames = input_read(in, s->data, frames);
+	pcm_convert(PCM_F32, s->in, s->format, s->data, frames * in->channels, NULL);
+	pcm_remap(&s->rm, dst, s->in, frames);
+	return frames;
+}
+
+/** Read up to 'frames' frames in the device's channel layout into 'dst'
+Return N of frames;  0 if stdin data is complete */
+u_int source_read(struct remap_stage *s, struct input *in, void *dst, u_int frames)
+{
+	if (s->channels == 0)
+		return input_read(in, dst, frames);
+
+	frames = remap_read(s, in, s->out, frames);
+	pcm_convert(s->format, dst, PCM_F32, s->out, frames * s->channels, &s->dither);
+	return frames;
+}
+
+// Sample rate conversion: stdin data is converted to float32 (or remapped), resampled,
+//  then converted to the device format (with dither) directly into the audio buffer
+struct resample_stage {
+	pcm_resampler *rs;
+	pcm_dither dither;
+	void *data; // stdin data
+	float *in, *out;
+	u_int in_cap, out_cap; // frames
+	u_int in_len, in_off; // unprocessed input
+	u_int flush; // N of silent frames to pass after stdin data is complete
+	int eof;
+	u_int format, channels, frame_size;
+};
+
+void resample_init(struct resample_stage *s, u_int format, u_int in_rate, u_int out_rate, u_int channels, u_int quality)
+{
+	assert(NULL != (s->rs = pcm_resample_create(in_rate, out_rate, channels, quality)));
+	pcm_dither_init(&s->dither, 1);
+	s->format = format;
+	s->channels = channels;
+	s->frame_size = channels * pcm_fmt_size(format);
+	s->in_cap = 1024;
+	s->out_cap = 1024;
+	assert(NULL != (s->data = malloc(s->in_cap * channels * pcm_fmt_size(format))));
+	assert(NULL != (s->in = malloc(s->in_cap * channels * sizeof(float))));
+	assert(NULL != (s->out = malloc(s->out_cap * channels * sizeof(float))));
+}
+
+void resample_close(struct resample_stage *s)
+{
+	pcm_resample_free(s->rs);
+	free(s->data);
+	free(s->in);
+	free(s->out);
+}
+
+/** Write up to 'frames' resampled frames into 'dst'
+Return N of frames;  0 if stdin data is complete */
+u_int resample_read(struct resample_stage *s, struct remap_stage *rm, struct input *in, void *dst, u_int frames)
+{
+	u_int C = s->channels, done = 0;
+	while (done < frames) {
+
+		if (s->in_off == s->in_len && !s->eof) {
+			u_int n;
+			if (rm->channels != 0) {
+				n = remap_read(rm, in, s->in, s->in_cap);
+			} else {
+				n = input_read(in, s->data, s->in_cap);
+				pcm_convert(PCM_F32, s->in, s->format, s->data, n * C, NULL);
+			}
+			if (n == 0) {
+				s->eof = 1;
+				s->flush = pcm_resample_delay(s->rs);
+			}
+			s->in_len = n;
+			s->in_off = 0;
+		}
+
+		size_t nin = (!s->eof) ? s->in_len - s->in_off : s->flush;
+		size_t nout = frames - done;
+		if (nout > s->out_cap)
+			nout = s->out_cap;
+		pcm_resample(s->rs, (!s->eof) ? s->in + s->in_off * C : NULL, &nin, s->out, &nout);
+		if (!s->eof)
+			s->in_off += nin;
+		else
+			s->flush -= nin;
+
+		pcm_convert(s->format, (char*)dst + done * s->frame_size, PCM_F32, s->out, nout * C, &s->dither);
+		done += nout;
+
+		if (s->eof && s->flush == 0 && nout == 0)
+			break; // all output is produced
+	}
+	return done;
+}
+
+// Volume control: "-ctl" starts a thread which reads commands from the terminal
+//  and publishes new gain parameters;  the audio thread picks them up before writing each chunk.
+// Commands: "+" or "-" (change volume by 3dB), "DB" (set volume), "m" (mute on/off)
+#define VOLUME_RAMP_MS  30
+
+struct volume {
+	pcm_gain_ctl ctl;
+	pcm_gain_params params; // the last published parameters
+	float db;
+};
+
+void volume_init(struct volume *v, float db)
+{
+	v->db = db;
+	v->params.gain = pow(10, db / 20);
+	v->params.mute = 0;
+	v->params.ramp_ms = VOLUME_RAMP_MS;
+	v->params.shape = PCM_RAMP_EXP;
+	pcm_gain_ctl_init(&v->ctl, &v->params);
+}
+
+void* volume_ctl(void *param)
+{
+	struct volume *v = param;
+	FILE *tty = fopen("/dev/tty", "r");
+	if (tty == NULL)
+		return NULL;
+
+	char line[64];
+	while (NULL != fgets(line, sizeof(line), tty)) {
+		char *end;
+		float db = strtod(line, &end);
+		if (line[0] == 'm') {
+			// Fade out to silence and back in linearly: an exponential ramp can't reach 0
+			v->params.mute = !v->params.mute;
+			v->params.shape = PCM_RAMP_LINEAR;
+		} else if ((line[0] == '+' || line[0] == '-') && end == line) {
+			v->db += (line[0] == '+') ? 3 : -3;
+			v->params.shape = PCM_RAMP_EXP;
+		} else if (end != line) {
+			v->db = db;
+			v->params.shape = PCM_RAMP_EXP;
+		} else {
+			continue;
+		}
+		v->params.gain = pow(10, v->db / 20);
+		pcm_gain_ctl_set(&v->ctl, &v->params);
+		fprintf(stderr, "Volume: %.1fdB%s\n", v->db, (v->params.mute) ? " (muted)" : "");
+	}
+	fclose(tty);
+	return NULL;
+}
+
+void main(int argc, char **argv)
+{
+	// "-format", "-rate", "-channels": format of stdin data (see audio-conf.h)
+	// "-buffer", "-period", "-lowlatency", "-device", "-rt", "-cpu": audio buffer parameters (see audio-conf.h)
+	// "-reader": read stdin in a separate thread
+	// "-planar": stdin provides non-interleaved data which we interleave directly into the audio buffer
+	// "-quality": resampler quality preset
+	// "-mix": mix the files (raw data in the same format as stdin) instead of reading stdin
+	// "-volume": initial volume (dB)
+	// "-ctl": change volume from the terminal while playing
+	static struct mix mx;
+	struct input in = {};
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	u_int quality = PCM_RS_HIGH;
+	float volume_db = 0;
+	int ctl = 0, reader = 0;
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i)) {
+		} else if (!strcmp(argv[i], "-reader")) {
+			reader = 1;
+		} else if (!strcmp(argv[i], "-planar")) {
+			in.planar = 1;
+		} else if (!strcmp(argv[i], "-mix") && i + 1 < argc) {
+			mix_add(&mx, argv[++i]);
+			in.mix = &mx;
+		} else if (!strcmp(argv[i], "-volume") && i + 1 < argc) {
+			volume_db = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-ctl")) {
+			ctl = 1;
+		} else if (!strcmp(argv[i], "-quality") && i + 1 < argc) {
+			i++;
+			for (quality = PCM_RS_FAST;  quality <= PCM_RS_BEST;  quality++) {
+				if (!strcmp(argv[i], pcm_rs_quality_name(quality)))
+					break;
+			}
+			if (quality > PCM_RS_BEST) {
+				fprintf(stderr, "Unknown quality %s\n", argv[i]);
+				exit(1);
+			}
+		}
+	}
+
+	audio_conf_default(&conf, PCM_S16, 48000, 2, 500);
+	u_int format = conf.format, in_rate = conf.rate, in_channels = conf.channels;
+
 	u_int buf_size, frame_size;
-	snd_pcm_t *pcm = abuf_create(&buf_size, &frame_size);
+	snd_pcm_t *pcm = abuf_create(&conf, &buf_size, &frame_size);
+	u_int rate = conf.rate, channels = conf.channels;
+	in.sample_size = pcm_fmt_size(format);
+	in.channels = in_channels;
+	in.frame_size = in.sample_size * in_channels;
+	if (in.mix != NULL)
+		mix_start(&mx, format, in.channels, in.frame_size);
+	else if (reader)
+		reader_start(&in, in_rate);
+
+	// Remap the channels if the device doesn't support the channel layout of our data
+	struct remap_stage rm = {};
+	if (channels != in_channels) {
+		remap_init(&rm, format, in_channels, channels);
+		fprintf(stderr, "Converting channels %u -> %u (%s)\n", in_channels, channels, pcm_remap_name(&rm.rm));
+	}
+
+	// Resample if the device doesn't support the rate of our data
+	struct resample_stage rs = {};
+	if (rate != in_rate) {
+		fprintf(stderr, "Resampling %u -> %u (%s quality)\n", in_rate, rate, pcm_rs_quality_name(quality));
+		resample_init(&rs, format, in_rate, rate, channels, quality);
+	}
+
+	static struct volume vol;
+	volume_init(&vol, volume_db);
+	pcm_gain gain;
+	assert(0 == pcm_gain_init(&gain, &vol.ctl, format, channels, rate));
+	if (ctl) {
+		pthread_t t;
+		assert(0 == pthread_create(&t, NULL, volume_ctl, &vol));
+		pthread_detach(t);
+	}
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	// Get the descriptors to wait on
+	struct pollfd fds[8];
+	int nfds = snd_pcm_poll_descriptors(pcm, fds, 8);
+	assert(nfds > 0);
+
+	// Real-time mode for the device loop (see rt.h): the helper threads created above stay normal
+	rt_enter(conf.rt_prio, conf.cpus);
+
 	// Read audio samples from stdin and pass them to audio buffer
 	int r = 0;
 	while (!quit) {
@@ -109,53 +622,46 @@ void main()
 			continue;
 
 		if (frames == 0) {
-			// Buffer is full
-
-			if (SND_PCM_STATE_RUNNING != snd_pcm_state(pcm)) {
-				// Stream isn't running.  Start it.
-				assert(0 == snd_pcm_start(pcm));
-			}
-
-			// Wait 100ms until some free space is available
-			int period_ms = 100;
-			usleep(period_ms*1000);
+			// Buffer is full: the stream has been started automatically (start_threshold).
+			// Sleep until the device plays 1 period (avail_min).
+			abuf_wait(pcm, fds, nfds);
 			continue;
 		}
 
 		// Read data from stdin
 		void *data = (char*)areas[0].addr + off * areas[0].step/8;
+		if (rs.rs != NULL)
+			frames = resample_read(&rs, &rm, &in, data, frames);
+		else
+			frames = source_read(&rm, &in, data, frames);
+		pcm_gain_process(&gain, data, frames);
 		u_int n = frames * frame_size;
-		n = read(0, data, n);
-		assert(n%frame_size == 0);
-		frames = n / frame_size;
 
 		// Mark the data chunk as complete
-		snd_pcm_sframes_t r = snd_pcm_mmap_commit(pcm, off, frames);
-		if (r >= 0 && (snd_pcm_uframes_t)r != frames) {
-			// Not all frames are processed
-			r = -EPIPE;
-		}
+		snd_pcm_sframes_t c = snd_pcm_mmap_commit(pcm, off, frames);
+		if (c < 0)
+			r = c;
+		else if ((snd_pcm_uframes_t)c != frames)
+			r = -EPIPE; // Not all frames are processed
 
 		if (n == 0)
 			break; // stdin data is complete
 	}
 
-	// Wait until all bufferred data is played by audio device
-	while (!quit) {
-
-		// Refresh audio buffer state
-		if (0 >= (r = snd_pcm_avail_update(pcm)))
-			break;
-
-		if (SND_PCM_STATE_RUNNING != snd_pcm_state(pcm)) {
-			// Stream isn't running.  Start it.
-			assert(0 == snd_pcm_start(pcm));
-		}
-
-		// Wait 100ms until some free space is available
-		int period_ms = 100;
-		usleep(period_ms*1000);
-	}
+	// Wait until all bufferred data is played by audio device.
+	// If there was less data than the buffer can hold, the stream isn't running yet: draining starts it.
+	if (!quit)
+		snd_pcm_drain(pcm);
 
+	fprintf(stderr, "Underruns: %u\n", xruns);
 	snd_pcm_close(pcm);
+	if (rs.rs != NULL)
+		resample_close(&rs);
+	if (rm.channels != 0)
+		remap_close(&rm);
+	if (in.mix != NULL)
+		mix_close(&mx);
+	if (in.ring != NULL)
+		reader_close(&in);
+	free(in.data);
 }
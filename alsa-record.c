@@ -1,18 +1,35 @@
 /** Audio API Quick Start Guide: ALSA: Record audio and pass to stdout
-Link with -lalsa */
-#include <alsa/asoundlib.h>
+Usage: alsa-record [-format int16|int24|int32|float32] [-rate HZ] [-channels N] [-buffer MSEC] [-period MSEC] [-lowlatency] [-device ID] [-rt PRIO] [-cpu LIST] [-timestamps FILE]
+Link with -lalsa -lpthread -lm
+Build with -DUSE_VDEV (without -lalsa) to use the virtual device instead of ALSA: see vdev.h */
+#ifdef USE_VDEV
+	#include "vdev.h"
+#else
+	#include <alsa/asoundlib.h>
+#endif
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include "pcm-meter.h"
+#include "audio-conf.h"
+#include "rt.h"
+#include "pcm-glitch.h"
 
 int quit;
+u_int xruns; // overruns and suspends: each one is a glitch in the audio stream
 
-snd_pcm_t* abuf_create(u_int *buf_size, u_int *frame_size)
+/** Open the device with the requested stream parameters
+conf: [in/out] the requested values;  the actual values on return */
+snd_pcm_t* abuf_create(struct audio_conf *conf, u_int *buf_size, u_int *frame_size)
 {
 	// Attach audio buffer to device
 	snd_pcm_t *pcm;
-	const char *device_id = "plughw:0,0"; // Use default device
+	const char *device_id = (conf->device != NULL) ? conf->device : "plughw:0,0"; // Use default device
 	int mode = SND_PCM_STREAM_CAPTURE;
 	assert(0 == snd_pcm_open(&pcm, device_id, mode, 0));
 
@@ -26,28 +43,70 @@ snd_pcm_t* abuf_create(u_int *buf_size, u_int *frame_size)
 	assert(0 == snd_pcm_hw_params_set_access(pcm, params, access));
 
 	// Set sample format
-	int format = SND_PCM_FORMAT_S16_LE;
-	assert(0 == snd_pcm_hw_params_set_format(pcm, params, format));
+	static const int formats[] = { SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_FLOAT_LE };
+	assert(0 == snd_pcm_hw_params_set_format(pcm, params, formats[conf->format]));
 
 	// Set channels
-	u_int channels = 2;
+	u_int channels = conf->channels;
 	assert(0 == snd_pcm_hw_params_set_channels_near(pcm, params, &channels));
 
 	// Set sample rate
-	u_int sample_rate = 48000;
+	u_int sample_rate = conf->rate;
 	assert(0 == snd_pcm_hw_params_set_rate_near(pcm, params, &sample_rate, 0));
 
-	fprintf(stderr, "Using format int16, sample rate %u, channels %u\n", sample_rate, channels);
+	// Set the interval of hardware interrupts: we get the data in chunks of this size.
+	// Low latency: the smallest period the device supports.
+	snd_pcm_uframes_t buf_frames, period_frames;
+	if (conf->period_usec != 0) {
+		u_int period_usec = conf->period_usec;
+		assert(0 == snd_pcm_hw_params_set_period_time_near(pcm, params, &period_usec, NULL));
+	} else {
+		int dir = 0;
+		assert(0 == snd_pcm_hw_params_get_period_size_min(params, &period_frames, &dir));
+		if (period_frames < (snd_pcm_uframes_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000)
+			period_frames = (snd_pcm_uframes_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000;
+		assert(0 == snd_pcm_hw_params_set_period_size_near(pcm, params, &period_frames, NULL));
+	}
 
-	// Set audio buffer length
-	u_int buffer_length_usec = 500 * 1000;
-	assert(0 == snd_pcm_hw_params_set_buffer_time_near(pcm, params, &buffer_length_usec, NULL));
+	// Set audio buffer length.
+	// Low latency: just a few periods.
+	if (conf->buffer_usec != 0) {
+		u_int buffer_length_usec = conf->buffer_usec;
+		assert(0 == snd_pcm_hw_params_set_buffer_time_near(pcm, params, &buffer_length_usec, NULL));
+	} else {
+		assert(0 == snd_pcm_hw_params_get_period_size(params, &period_frames, NULL));
+		buf_frames = period_frames * AUDIO_CONF_LL_PERIODS;
+		assert(0 == snd_pcm_hw_params_set_buffer_size_near(pcm, params, &buf_frames));
+	}
 
 	// Apply configuration
 	assert(0 == snd_pcm_hw_params(pcm, params));
 
-	*frame_size = (16/8) * channels;
-	*buf_size = sample_rate * (16/8) * channels * buffer_length_usec / 1000000;
+	// Get the actual buffer and period sizes
+	assert(0 == snd_pcm_hw_params_get_buffer_size(params, &buf_frames));
+	assert(0 == snd_pcm_hw_params_get_period_size(params, &period_frames, NULL));
+	conf->rate = sample_rate;
+	conf->channels = channels;
+	conf->buffer_usec = (uint64_t)buf_frames * 1000000 / sample_rate;
+	conf->period_usec = (uint64_t)period_frames * 1000000 / sample_rate;
+	audio_conf_report(conf->format, sample_rate, channels, conf->buffer_usec, conf->period_usec);
+
+	// Get device property-set for the software parameters
+	snd_pcm_sw_params_t *sw_params;
+	snd_pcm_sw_params_alloca(&sw_params);
+	assert(0 == snd_pcm_sw_params_current(pcm, sw_params));
+
+	// Wake us up as soon as 1 period is captured
+	assert(0 == snd_pcm_sw_params_set_avail_min(pcm, sw_params, period_frames));
+
+	// Timestamp every hardware pointer update with the clock we use to measure latency
+	assert(0 == snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params, SND_PCM_TSTAMP_ENABLE));
+	assert(0 == snd_pcm_sw_params_set_tstamp_type(pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC));
+
+	assert(0 == snd_pcm_sw_params(pcm, sw_params));
+
+	*frame_size = pcm_fmt_size(conf->format) * channels;
+	*buf_size = buf_frames * *frame_size;
 	return pcm;
 }
 
@@ -56,12 +115,32 @@ void on_sigint()
 	quit = 1;
 }
 
+/** Sleep until at least avail_min frames are captured or an error occurs.
+The error itself is returned by the next snd_pcm_avail_update(). */
+void abuf_wait(snd_pcm_t *pcm, struct pollfd *fds, u_int nfds)
+{
+	for (;;) {
+		// Interrupted by a signal, or the device is stuck: let the caller check its state
+		if (0 >= poll(fds, nfds, 1000))
+			return;
+
+		// The events on the descriptors don't map to the stream's state directly: ask ALSA
+		unsigned short revents;
+		assert(0 == snd_pcm_poll_descriptors_revents(pcm, fds, nfds, &revents));
+		if (revents & (POLLIN | POLLERR))
+			return;
+	}
+}
+
 int abuf_handle_error(snd_pcm_t *pcm, int r)
 {
+	char ts[16];
 	switch (r) {
 
 	case -ESTRPIPE:
 		// Sound device is temporarily unavailable.  Wait until it's online.
+		fprintf(stderr, "%s: device suspended\n", pcm_glitch_time(ts));
+		xruns++;
 		while (-EAGAIN == (r = snd_pcm_resume(pcm))) {
 			int period_ms = 100;
 			usleep(period_ms*1000);
@@ -72,6 +151,10 @@ int abuf_handle_error(snd_pcm_t *pcm, int r)
 
 	case -EPIPE:
 		// Overrun or underrun occurred.  Reset buffer.
+		if (r == -EPIPE) {
+			fprintf(stderr, "%s: overrun\n", pcm_glitch_time(ts));
+			xruns++;
+		}
 		if (0 > (r = snd_pcm_prepare(pcm)))
 			return r;
 		return 0;
@@ -80,16 +163,114 @@ int abuf_handle_error(snd_pcm_t *pcm, int r)
 	return r;
 }
 
-void main()
+// Capture -> stdout latency: the time from the moment the device has captured the data
+//  (the timestamp of the hardware pointer position) until write() to stdout returns
+#define LAT_BUCKET_USEC  50
+#define LAT_BUCKETS  2000 // up to 100ms
+
+struct latency {
+	u_int hist[LAT_BUCKETS + 1]; // the last bucket: everything above
+	u_int n;
+	double sum_usec, max_usec;
+};
+
+void latency_add(struct latency *l, double usec)
+{
+	u_int i = (usec > 0) ? usec / LAT_BUCKET_USEC : 0;
+	if (i > LAT_BUCKETS)
+		i = LAT_BUCKETS;
+	l->hist[i]++;
+	l->n++;
+	l->sum_usec += usec;
+	if (l->max_usec < usec)
+		l->max_usec = usec;
+}
+
+/** Return the upper bound (msec) of the bucket containing the percentile 'p' */
+double latency_percentile(const struct latency *l, double p)
 {
+	u_int target = l->n * p / 100, k = 0;
+	for (u_int i = 0;  i <= LAT_BUCKETS;  i++) {
+		k += l->hist[i];
+		if (k > target)
+			return (i + 1) * LAT_BUCKET_USEC / 1000.0;
+	}
+	return l->max_usec / 1000;
+}
+
+void latency_print(const struct latency *l)
+{
+	if (l->n == 0)
+		return;
+	fprintf(stderr, "Capture latency (%u periods): avg %.2fms, 50%% <%.2fms, 90%% <%.2fms, 99%% <%.2fms, 99.9%% <%.2fms, max %.2fms\n"
+		, l->n, l->sum_usec / l->n / 1000
+		, latency_percentile(l, 50), latency_percentile(l, 90), latency_percentile(l, 99), latency_percentile(l, 99.9)
+		, l->max_usec / 1000);
+}
+
+// Timestamp sidecar: a text line for every chunk written to stdout:
+//  POSITION TSTAMP DELAY
+// The frame number POSITION of the output was captured at TSTAMP - DELAY/rate seconds (CLOCK_MONOTONIC).
+// TSTAMP is the time of the last hardware pointer update, DELAY is the number of frames captured by then and not yet read.
+// The lines are buffered by stdio: it costs 1 snd_pcm_htimestamp() per chunk.
+FILE* tsfile_open(const char *fn, u_int rate)
+{
+	FILE *f = fopen(fn, "w");
+	assert(f != NULL);
+	fprintf(f, "# rate %u\n# position tstamp delay\n", rate);
+	return f;
+}
+
+void tsfile_add(FILE *f, uint64_t pos, const snd_htimestamp_t *ts, snd_pcm_uframes_t delay)
+{
+	fprintf(f, "%llu %lld.%09ld %lu\n"
+		, (unsigned long long)pos, (long long)ts->tv_sec, (long)ts->tv_nsec, (unsigned long)delay);
+}
+
+void main(int argc, char **argv)
+{
+	// "-format", "-rate", "-channels", "-buffer", "-period", "-lowlatency", "-device", "-rt", "-cpu": see audio-conf.h
+	// "-timestamps": write the capture time of every chunk to the file
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	const char *ts_fn = NULL;
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i)) {
+		} else if (!strcmp(argv[i], "-timestamps") && i + 1 < argc) {
+			ts_fn = argv[++i];
+		}
+	}
+	audio_conf_default(&conf, PCM_S16, 48000, 2, 500);
+
 	u_int buf_size, frame_size;
-	snd_pcm_t *pcm = abuf_create(&buf_size, &frame_size);
+	snd_pcm_t *pcm = abuf_create(&conf, &buf_size, &frame_size);
+
+	// Get the descriptors to wait on
+	struct pollfd fds[8];
+	int nfds = snd_pcm_poll_descriptors(pcm, fds, 8);
+	assert(nfds > 0);
+
+	FILE *ts_file = NULL;
+	uint64_t pos = 0; // frames written to stdout
+	if (ts_fn != NULL)
+		ts_file = tsfile_open(ts_fn, conf.rate);
+
+	static struct latency lat;
+	snd_pcm_uframes_t pending = 0; // frames captured by the time of 'tstamp' and not yet written
+	snd_htimestamp_t tstamp;
+
+	// Report signal level every second
+	pcm_meter meter;
+	assert(0 == pcm_meter_init(&meter, conf.format, conf.channels, conf.rate));
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	// Real-time mode for the device loop (see rt.h)
+	rt_enter(conf.rt_prio, conf.cpus);
+
 	// Start streaming
 	assert(0 == snd_pcm_start(pcm));
 
@@ -99,6 +280,7 @@ void main()
 
 		if (r < 0) {
 			assert(0 == abuf_handle_error(pcm, r));
+			pending = 0; // the buffered data is discarded
 
 			// Start streaming if necessary
 			if (SND_PCM_STATE_RUNNING != snd_pcm_state(pcm))
@@ -109,6 +291,10 @@ void main()
 		if (0 > (r = snd_pcm_avail_update(pcm)))
 			continue;
 
+		// Remember when the data we're going to write was captured
+		if (pending == 0 && 0 != snd_pcm_htimestamp(pcm, &pending, &tstamp))
+			pending = 0;
+
 		// Get audio data region available for reading
 		const snd_pcm_channel_area_t *areas;
 		snd_pcm_uframes_t off;
@@ -117,16 +303,38 @@ void main()
 			continue;
 
 		if (frames == 0) {
-			// Buffer is empty. Wait 100ms until some new data is available
-			int period_ms = 100;
-			usleep(period_ms*1000);
+			// Buffer is empty.  Sleep until the device captures 1 period (avail_min).
+			abuf_wait(pcm, fds, nfds);
 			continue;
 		}
 
+		// Get the capture time of the chunk
+		if (ts_file != NULL) {
+			snd_pcm_uframes_t avail;
+			snd_htimestamp_t ts;
+			if (0 == snd_pcm_htimestamp(pcm, &avail, &ts))
+				tsfile_add(ts_file, pos, &ts, avail);
+		}
+
 		// Write to stdout
 		const void *data = (char*)areas[0].addr + off * areas[0].step/8;
 		u_int n = frames * frame_size;
 		write(1, data, n);
+		pos += frames;
+
+		// Measure signal level
+		if (pcm_meter_update(&meter, data, frames))
+			pcm_meter_print(&meter, stderr);
+
+		// All data captured by the time of 'tstamp' is in stdout now
+		if (pending != 0) {
+			pending = (pending > frames) ? pending - frames : 0;
+			if (pending == 0 && (tstamp.tv_sec | tstamp.tv_nsec) != 0) {
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				latency_add(&lat, (now.tv_sec - tstamp.tv_sec) * 1e6 + (now.tv_nsec - tstamp.tv_nsec) / 1e3);
+			}
+		}
 
 		// Mark the data chunk as read
 		r = snd_pcm_mmap_commit(pcm, off, frames);
@@ -136,5 +344,9 @@ void main()
 		}
 	}
 
+	latency_print(&lat);
+	fprintf(stderr, "Overruns: %u\n", xruns);
+	if (ts_file != NULL)
+		fclose(ts_file);
 	snd_pcm_close(pcm);
 }
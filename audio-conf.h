@@ -0,0 +1,141 @@
+/** Audio API Quick Start Guide: Audio stream configuration from the command line (for sample code only)
+Options:
+ -format int16|int24|int32|float32, -rate HZ, -channels N: format of the data we exchange with the device
+ -buffer MSEC: audio buffer length
+ -period MSEC: how often the device notifies us (period/fragment size)
+ -lowlatency: negotiate the smallest buffer and period the device supports
+  (buffer or period set explicitly takes precedence)
+ -device ID: ALSA PCM name, PulseAudio sink/source name or OSS device file (other APIs: the default device only)
+ -rt PRIO: real-time mode for the thread servicing the device: SCHED_FIFO priority PRIO (1..99), locked memory (see rt.h)
+ -cpu LIST: pin the thread to the CPUs, e.g. "2,3" or "0-3"
+ (-rt and -cpu: Linux and FreeBSD tools only)
+An invalid value is fatal: the tool prints an error and exits.
+The device may not support the requested values: every tool reports the values it has actually got. */
+
+#pragma once
+#include "pcm-convert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// With -lowlatency: the period is never shorter than this,
+//  and the buffer has this many periods.
+// A shorter period is not stable on a system without real-time scheduling.
+#define AUDIO_CONF_MIN_PERIOD_USEC  1000
+#define AUDIO_CONF_LL_PERIODS  3
+
+struct audio_conf {
+	int format; // enum PCM_FMT;  -1: not set
+	unsigned rate, channels; // 0: not set
+	unsigned buffer_usec, period_usec; // 0: not set, or as small as possible with -lowlatency
+	int low_latency;
+	const char *device; // NULL: default device
+	int rt_prio; // 0: normal scheduling
+	const char *cpus; // NULL: any CPU
+};
+
+static inline void audio_conf_init(struct audio_conf *c)
+{
+	memset(c, 0, sizeof(*c));
+	c->format = -1;
+}
+
+/** Exit on invalid option value:
+ continuing with a default value would silently produce garbage (e.g. stdin data in another format) */
+static inline void _audio_conf_bad(const char *opt, const char *val)
+{
+	fprintf(stderr, "Invalid value for %s: %s\n", opt, val);
+	exit(1);
+}
+
+/** Parse positive integer value */
+static inline unsigned _audio_conf_uint(const char *opt, const char *val)
+{
+	char *end;
+	unsigned long v = strtoul(val, &end, 10);
+	if (end == val || *end != '\0' || v == 0 || v > 0xffffffff)
+		_audio_conf_bad(opt, val);
+	return v;
+}
+
+/** Parse non-negative value in msec
+Return usec */
+static inline unsigned _audio_conf_msec(const char *opt, const char *val)
+{
+	char *end;
+	double v = strtod(val, &end);
+	if (end == val || *end != '\0' || !(v >= 0 && v < 0xffffffff / 1000))
+		_audio_conf_bad(opt, val);
+	return v * 1000;
+}
+
+/** Parse the option at argv[*i] (and its value).
+Exit on invalid value.
+Return 1 if it's ours */
+static inline int audio_conf_arg(struct audio_conf *c, int argc, char **argv, int *i)
+{
+	const char *opt = argv[*i];
+	if (!strcmp(opt, "-lowlatency")) {
+		c->low_latency = 1;
+		return 1;
+	}
+
+	if (*i + 1 >= argc)
+		return 0;
+	const char *val = argv[*i + 1];
+
+	if (!strcmp(opt, "-device")) {
+		c->device = val;
+	} else if (!strcmp(opt, "-format")) {
+		unsigned f;
+		for (f = PCM_S16;  f <= PCM_F32;  f++) {
+			if (!strcmp(val, pcm_fmt_name(f)))
+				break;
+		}
+		if (f > PCM_F32)
+			_audio_conf_bad(opt, val);
+		c->format = f;
+	} else if (!strcmp(opt, "-rate")) {
+		c->rate = _audio_conf_uint(opt, val);
+	} else if (!strcmp(opt, "-channels")) {
+		c->channels = _audio_conf_uint(opt, val);
+	} else if (!strcmp(opt, "-buffer")) {
+		c->buffer_usec = _audio_conf_msec(opt, val);
+	} else if (!strcmp(opt, "-period")) {
+		c->period_usec = _audio_conf_msec(opt, val);
+	} else if (!strcmp(opt, "-rt")) {
+		c->rt_prio = atoi(val);
+	} else if (!strcmp(opt, "-cpu")) {
+		c->cpus = val;
+	} else {
+		return 0;
+	}
+
+	(*i)++;
+	return 1;
+}
+
+/** Fill the values not set by the user.
+With -lowlatency the buffer and period stay unset: the backend asks the device for the smallest values. */
+static inline void audio_conf_default(struct audio_conf *c, unsigned format, unsigned rate, unsigned channels, unsigned buffer_msec)
+{
+	if (c->format < 0)
+		c->format = format;
+	if (c->rate == 0)
+		c->rate = rate;
+	if (c->channels == 0)
+		c->channels = channels;
+	if (c->low_latency)
+		return;
+	if (c->buffer_usec == 0)
+		c->buffer_usec = buffer_msec * 1000;
+	if (c->period_usec == 0)
+		c->period_usec = c->buffer_usec / 4;
+}
+
+/** Print the actual stream parameters */
+static inline void audio_conf_report(unsigned format, unsigned rate, unsigned channels, unsigned buffer_usec, unsigned period_usec)
+{
+	fprintf(stderr, "Using format %s, sample rate %u, channels %u, buffer %.2fms, period %.2fms\n"
+		, pcm_fmt_name(format), rate, channels, buffer_usec / 1000.0, period_usec / 1000.0);
+}
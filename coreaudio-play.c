@@ -1,4 +1,5 @@
 /** Audio API Quick Start Guide: CoreAudio: Play audio from stdin
+Usage: coreaudio-play [-format int16|int24|int32|float32] [-buffer MSEC] [-period MSEC] [-lowlatency] [-volume DB] [-ctl]
 Link with -framework CoreFoundation -framework CoreAudio */
 #include <CoreAudio/CoreAudio.h>
 #include <CoreFoundation/CFString.h>
@@ -7,15 +8,22 @@ Link with -framework CoreFoundation -framework CoreAudio */
 #include <stdio.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
+#include <pthread.h>
 #include "ringbuffer.h"
+#include "pcm-gain.h"
+#include "audio-conf.h"
 
 int quit;
 ringbuffer *ring_buf;
+pcm_gain gain; // used by the I/O callback only
 
 const AudioObjectPropertyAddress prop_odev_default = { kAudioHardwarePropertyDefaultOutputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
 const AudioObjectPropertyAddress prop_idev_default = { kAudioHardwarePropertyDefaultInputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
 const AudioObjectPropertyAddress prop_odev_fmt = { kAudioDevicePropertyStreamFormat, kAudioDevicePropertyScopeOutput, kAudioObjectPropertyElementMaster };
 const AudioObjectPropertyAddress prop_idev_fmt = { kAudioDevicePropertyStreamFormat, kAudioDevicePropertyScopeInput, kAudioObjectPropertyElementMaster };
+const AudioObjectPropertyAddress prop_dev_period = { kAudioDevicePropertyBufferFrameSize, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+const AudioObjectPropertyAddress prop_dev_period_range = { kAudioDevicePropertyBufferFrameSizeRange, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
 
 OSStatus on_playback(AudioDeviceID device, const AudioTimeStamp *now,
 	const AudioBufferList *indata, const AudioTimeStamp *intime,
@@ -25,29 +33,29 @@ OSStatus on_playback(AudioDeviceID device, const AudioTimeStamp *now,
 	float *d = outdata->mBuffers[0].mData;
 	size_t n = outdata->mBuffers[0].mDataByteSize;
 
-	ringbuf *ring = udata;
+	ringbuffer *ring = udata;
 	ringbuffer_chunk buf;
 
+	// The buffer is mirrored, so a single region covers all the data we can get
 	size_t h = ringbuf_read_begin(ring, n, &buf, NULL);
-	memcpy(buf.ptr, d, buf.len);
+	memcpy(d, buf.ptr, buf.len);
 	ringbuf_read_finish(ring, h);
 	d = (char*)d + buf.len;
 	n -= buf.len;
 
-	if (n != 0) {
-		h = ringbuf_read_begin(ring, n, &buf, NULL);
-		memcpy(buf.ptr, d, buf.len);
-		ringbuf_read_finish(ring, h);
-		d = (char*)d + buf.len;
-		n -= buf.len;
-	}
-
 	if (n != 0)
 		memset(d, 0, n);
+
+	// Apply the current volume;  new parameters from the control thread are picked up here, once per callback
+	pcm_gain_process(&gain, outdata->mBuffers[0].mData, outdata->mBuffers[0].mDataByteSize / ring->frame_size);
 	return 0;
 }
 
-void* abuf_create(int playback, void *proc, int *dev_id)
+/** Open the device and allocate the ring buffer
+conf: [in/out] the requested values;  the actual values on return.
+  The device works with float32 data at its own sample rate and channels:
+  the format is converted by the caller, the requested rate and channels are ignored. */
+void* abuf_create(int playback, void *proc, struct audio_conf *conf, int *dev_id)
 {
 	AudioObjectID device_id;
 	if (1) {
@@ -62,14 +70,37 @@ void* abuf_create(int playback, void *proc, int *dev_id)
 	u_int size = sizeof(asbd);
 	const AudioObjectPropertyAddress *a = (playback) ? &prop_odev_fmt : &prop_idev_fmt;
 	assert(0 == AudioObjectGetPropertyData(device_id, a, 0, NULL, &size, &asbd));
-	fprintf(stderr, "Using format float32, sample rate %u, channels %u\n", (int)asbd.mSampleRate, (int)asbd.mChannelsPerFrame);
+	int sample_rate = asbd.mSampleRate;
+	int channels = asbd.mChannelsPerFrame;
+
+	// Set the N of frames the I/O callback processes at once.
+	// Low latency: the smallest value the device supports.
+	AudioValueRange range = {};
+	size = sizeof(range);
+	assert(0 == AudioObjectGetPropertyData(device_id, &prop_dev_period_range, 0, NULL, &size, &range));
+	u_int period_frames = (uint64_t)conf->period_usec * sample_rate / 1000000;
+	if (conf->period_usec == 0 && period_frames < (uint64_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000)
+		period_frames = (uint64_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000;
+	if (period_frames < range.mMinimum)
+		period_frames = range.mMinimum;
+	else if (period_frames > range.mMaximum)
+		period_frames = range.mMaximum;
+	size = sizeof(period_frames);
+	assert(0 == AudioObjectSetPropertyData(device_id, &prop_dev_period, 0, NULL, size, &period_frames));
+	assert(0 == AudioObjectGetPropertyData(device_id, &prop_dev_period, 0, NULL, &size, &period_frames));
 
-	// Get buffer size
-	int buffer_length_msec = 500;
-	int buf_size = 32/8 * sample_rate * channels * buffer_length_msec / 1000;
+	// Get buffer size.
+	// Low latency: just a few periods.
+	int frame_size = 32/8 * channels;
+	int buf_frames = (conf->buffer_usec != 0) ? (uint64_t)conf->buffer_usec * sample_rate / 1000000 : period_frames * AUDIO_CONF_LL_PERIODS;
+	if (buf_frames < (int)period_frames * 2)
+		buf_frames = period_frames * 2;
 
-	// Allocate buffer
-	ring_buf = ringbuf_alloc(buf_size);
+	// Allocate buffer.  Mirrored memory allows us to always get a contiguous region of whole audio frames.
+	// Lock it in RAM so that the I/O callback never waits for a page fault.
+	assert(NULL != (ring_buf = ringbuf_alloc_frames(buf_frames, frame_size, RINGBUF_LOCK)));
+	if (!(ring_buf->flags & RINGBUF_LOCK))
+		fprintf(stderr, "Couldn't lock ring buffer in RAM\n");
 
 	// Register I/O callback
 	void *io_proc_id = NULL;
@@ -77,6 +108,11 @@ void* abuf_create(int playback, void *proc, int *dev_id)
 	assert(0 == AudioDeviceCreateIOProcID(device_id, proc, udata, (AudioDeviceIOProcID*)&io_proc_id)
 		&& io_proc_id != NULL);
 
+	conf->rate = sample_rate;
+	conf->channels = channels;
+	conf->buffer_usec = (uint64_t)buf_frames * 1000000 / sample_rate;
+	conf->period_usec = (uint64_t)period_frames * 1000000 / sample_rate;
+	audio_conf_report(PCM_F32, sample_rate, channels, conf->buffer_usec, conf->period_usec);
 	*dev_id = device_id;
 	return io_proc_id;
 }
@@ -86,21 +122,123 @@ void on_sigint()
 	quit = 1;
 }
 
-void main()
+// Volume control: "-ctl" starts a thread which reads commands from the terminal
+//  and publishes new gain parameters for the I/O callback.
+// Commands: "+" or "-" (change volume by 3dB), "DB" (set volume), "m" (mute on/off)
+#define VOLUME_RAMP_MS  30
+
+struct volume {
+	pcm_gain_ctl ctl;
+	pcm_gain_params params; // the last published parameters
+	float db;
+};
+
+void volume_init(struct volume *v, float db)
+{
+	v->db = db;
+	v->params.gain = pow(10, db / 20);
+	v->params.mute = 0;
+	v->params.ramp_ms = VOLUME_RAMP_MS;
+	v->params.shape = PCM_RAMP_EXP;
+	pcm_gain_ctl_init(&v->ctl, &v->params);
+}
+
+void* volume_ctl(void *param)
+{
+	struct volume *v = param;
+	FILE *tty = fopen("/dev/tty", "r");
+	if (tty == NULL)
+		return NULL;
+
+	char line[64];
+	while (NULL != fgets(line, sizeof(line), tty)) {
+		char *end;
+		float db = strtod(line, &end);
+		if (line[0] == 'm') {
+			// Fade out to silence and back in linearly: an exponential ramp can't reach 0
+			v->params.mute = !v->params.mute;
+			v->params.shape = PCM_RAMP_LINEAR;
+		} else if ((line[0] == '+' || line[0] == '-') && end == line) {
+			v->db += (line[0] == '+') ? 3 : -3;
+			v->params.shape = PCM_RAMP_EXP;
+		} else if (end != line) {
+			v->db = db;
+			v->params.shape = PCM_RAMP_EXP;
+		} else {
+			continue;
+		}
+		v->params.gain = pow(10, v->db / 20);
+		pcm_gain_ctl_set(&v->ctl, &v->params);
+		fprintf(stderr, "Volume: %.1fdB%s\n", v->db, (v->params.mute) ? " (muted)" : "");
+	}
+	fclose(tty);
+	return NULL;
+}
+
+void main(int argc, char **argv)
 {
+	// "-format": format of stdin data (see audio-conf.h)
+	// "-buffer", "-period", "-lowlatency": audio buffer parameters (see audio-conf.h)
+	// "-volume": initial volume (dB)
+	// "-ctl": change volume from the terminal while playing
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	float volume_db = 0;
+	int ctl = 0;
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i)) {
+		} else if (!strcmp(argv[i], "-volume") && i + 1 < argc) {
+			volume_db = strtod(argv[++i], NULL);
+		} else if (!strcmp(argv[i], "-ctl")) {
+			ctl = 1;
+		}
+	}
+
+	static struct volume vol;
+	volume_init(&vol, volume_db);
+
+	audio_conf_default(&conf, PCM_F32, 48000, 2, 500);
+	u_int in_format = conf.format;
 	int dev;
-	void *io_proc_id = abuf_create(1, on_playback, &dev);
+	void *io_proc_id = abuf_create(1, on_playback, &conf, &dev);
+
+	// stdin data is converted to float32 which the device uses
+	void *in_buf = NULL;
+	if (in_format != PCM_F32) {
+		fprintf(stderr, "Converting %s -> %s\n", pcm_fmt_name(in_format), pcm_fmt_name(PCM_F32));
+		assert(NULL != (in_buf = malloc(ring_buf->cap)));
+	}
+
+	// The gain stage must be ready before the device is started
+	assert(0 == pcm_gain_init(&gain, &vol.ctl, PCM_F32, conf.channels, conf.rate));
+	if (ctl) {
+		pthread_t t;
+		assert(0 == pthread_create(&t, NULL, volume_ctl, &vol));
+		pthread_detach(t);
+	}
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	// The ring may be larger than the requested buffer (its size is a multiple of the page size):
+	//  keep at most 'buffer' frames in it so that the latency is as requested
+	size_t buf_frames = (uint64_t)conf.buffer_usec * conf.rate / 1000000;
+	size_t reserve_frames = ring_buf->cap / ring_buf->frame_size - buf_frames;
+	size_t chunk_frames = (uint64_t)conf.period_usec * conf.rate / 1000000;
 	int started = 0;
+	size_t in_frame_size = pcm_fmt_size(in_format) * conf.channels;
+	size_t partial = 0; // bytes of an incomplete frame
 	while (!quit) {
 
 		ringbuffer_chunk buf;
-		size_t h = ringbuf_write_begin(ring_buf, 16*1024, &buf, NULL);
+		size_t free_frames;
+		ringbuf_write_begin_frames(ring_buf, 0, &buf, &free_frames);
+		size_t frames = (free_frames > reserve_frames) ? free_frames - reserve_frames : 0;
+		if (frames > chunk_frames)
+			frames = chunk_frames;
+		size_t h = ringbuf_write_begin_frames(ring_buf, frames, &buf, NULL);
 
 		if (buf.len == 0) {
 			if (!started) {
@@ -108,19 +246,29 @@ void main()
 				started = 1;
 			}
 
-			// Buffer is full. Wait.
-			int period_ms = 100;
-			usleep(period_ms*1000);
+			// Buffer is full. Sleep until the I/O callback frees enough space for the next chunk.
+			ringbuf_wait_writable(ring_buf, (reserve_frames + chunk_frames) * ring_buf->frame_size, 100);
 			continue;
 		}
 
-		// Read data from stdin
-		int n = read(0, buf.ptr, buf.len);
-
-		ringbuf_write_finish(ring_buf, h);
+		// Read data from stdin (directly into the ring buffer if no conversion is needed).
+		// A pipe returns any number of bytes: commit whole frames only.
+		// An incomplete frame stays at the beginning of the next read:
+		//  right after the committed data in the ring buffer, or moved to the beginning of 'in_buf'.
+		char *dst = (in_buf != NULL) ? in_buf : buf.ptr;
+		size_t frames_max = buf.len / ring_buf->frame_size;
+		ssize_t n = read(0, dst + partial, frames_max * in_frame_size - partial);
+		if (n <= 0)
+			break; // stdin data is complete (an incomplete frame at the end is dropped), or interrupted
 
-		if (n == 0)
-			break; // stdin data is complete
+		size_t total = partial + n;
+		frames = total / in_frame_size;
+		partial = total % in_frame_size;
+		if (in_buf != NULL) {
+			pcm_convert(PCM_F32, buf.ptr, in_format, in_buf, frames * conf.channels, NULL);
+			memmove(in_buf, (char*)in_buf + frames * in_frame_size, partial);
+		}
+		ringbuf_write_finish(ring_buf, h - buf.len + frames * ring_buf->frame_size);
 	}
 
 	// Wait until all bufferred data is played by audio device
@@ -140,11 +288,19 @@ void main()
 			started = 1;
 		}
 
-		// Buffer isn't empty. Wait.
-		int period_ms = 100;
-		usleep(period_ms*1000);
+		// Buffer isn't empty. Sleep until the I/O callback reads everything.
+		ringbuf_wait_writable(ring_buf, ring_buf->cap, 100);
 	}
 
 	AudioDeviceDestroyIOProcID(dev, io_proc_id);
+
+#ifdef RINGBUF_STATS
+	ringbuffer_stats st;
+	ringbuf_stats(ring_buf, &st);
+	fprintf(stderr, "Ring buffer: written %zu, read %zu, full %zu, short reads %zu, fill level %zu..%zu of %zu\n"
+		, st.written, st.read, st.full, st.short_reads, st.low, st.high, ring_buf->cap);
+#endif
+
 	ringbuf_free(ring_buf);
+	free(in_buf);
 }
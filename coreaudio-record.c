@@ -1,4 +1,5 @@
 /** Audio API Quick Start Guide: CoreAudio: Record audio and pass to stdout
+Usage: coreaudio-record [-format int16|int24|int32|float32] [-buffer MSEC] [-period MSEC] [-lowlatency]
 Link with -framework CoreFoundation -framework CoreAudio */
 #include <CoreAudio/CoreAudio.h>
 #include <CoreFoundation/CFString.h>
@@ -8,6 +9,7 @@ Link with -framework CoreFoundation -framework CoreAudio */
 #include <signal.h>
 #include <unistd.h>
 #include "ringbuffer.h"
+#include "audio-conf.h"
 
 int quit;
 ringbuffer *ring_buf;
@@ -16,6 +18,8 @@ const AudioObjectPropertyAddress prop_odev_default = { kAudioHardwarePropertyDef
 const AudioObjectPropertyAddress prop_idev_default = { kAudioHardwarePropertyDefaultInputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
 const AudioObjectPropertyAddress prop_odev_fmt = { kAudioDevicePropertyStreamFormat, kAudioDevicePropertyScopeOutput, kAudioObjectPropertyElementMaster };
 const AudioObjectPropertyAddress prop_idev_fmt = { kAudioDevicePropertyStreamFormat, kAudioDevicePropertyScopeInput, kAudioObjectPropertyElementMaster };
+const AudioObjectPropertyAddress prop_dev_period = { kAudioDevicePropertyBufferFrameSize, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
+const AudioObjectPropertyAddress prop_dev_period_range = { kAudioDevicePropertyBufferFrameSizeRange, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMaster };
 
 OSStatus on_capture(AudioDeviceID device, const AudioTimeStamp *now,
 	const AudioBufferList *indata, const AudioTimeStamp *intime,
@@ -25,12 +29,16 @@ OSStatus on_capture(AudioDeviceID device, const AudioTimeStamp *now,
 	const float *d = indata->mBuffers[0].mData;
 	size_t n = indata->mBuffers[0].mDataByteSize;
 
-	ringbuf *ring = udata;
+	ringbuffer *ring = udata;
 	ringbuf_write(ring, d, n);
 	return 0;
 }
 
-void* abuf_create(int playback, void *proc, int *dev_id)
+/** Open the device and allocate the ring buffer
+conf: [in/out] the requested values;  the actual values on return.
+  The device works with float32 data at its own sample rate and channels:
+  the format is converted by the caller, the requested rate and channels are ignored. */
+void* abuf_create(int playback, void *proc, struct audio_conf *conf, int *dev_id)
 {
 	AudioObjectID device_id;
 	if (1) {
@@ -45,14 +53,37 @@ void* abuf_create(int playback, void *proc, int *dev_id)
 	u_int size = sizeof(asbd);
 	const AudioObjectPropertyAddress *a = (playback) ? &prop_odev_fmt : &prop_idev_fmt;
 	assert(0 == AudioObjectGetPropertyData(device_id, a, 0, NULL, &size, &asbd));
-	fprintf(stderr, "Using format float32, sample rate %u, channels %u\n", (int)asbd.mSampleRate, (int)asbd.mChannelsPerFrame);
-
-	// Get buffer size
-	int buffer_length_msec = 500;
-	int buf_size = 32/8 * sample_rate * channels * buffer_length_msec / 1000;
-
-	// Allocate buffer
-	ring_buf = ringbuf_alloc(buf_size);
+	int sample_rate = asbd.mSampleRate;
+	int channels = asbd.mChannelsPerFrame;
+
+	// Set the N of frames the I/O callback processes at once.
+	// Low latency: the smallest value the device supports.
+	AudioValueRange range = {};
+	size = sizeof(range);
+	assert(0 == AudioObjectGetPropertyData(device_id, &prop_dev_period_range, 0, NULL, &size, &range));
+	u_int period_frames = (uint64_t)conf->period_usec * sample_rate / 1000000;
+	if (conf->period_usec == 0 && period_frames < (uint64_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000)
+		period_frames = (uint64_t)sample_rate * AUDIO_CONF_MIN_PERIOD_USEC / 1000000;
+	if (period_frames < range.mMinimum)
+		period_frames = range.mMinimum;
+	else if (period_frames > range.mMaximum)
+		period_frames = range.mMaximum;
+	size = sizeof(period_frames);
+	assert(0 == AudioObjectSetPropertyData(device_id, &prop_dev_period, 0, NULL, size, &period_frames));
+	assert(0 == AudioObjectGetPropertyData(device_id, &prop_dev_period, 0, NULL, &size, &period_frames));
+
+	// Get buffer size.
+	// Low latency: just a few periods.
+	int frame_size = 32/8 * channels;
+	int buf_frames = (conf->buffer_usec != 0) ? (uint64_t)conf->buffer_usec * sample_rate / 1000000 : period_frames * AUDIO_CONF_LL_PERIODS;
+	if (buf_frames < (int)period_frames * 2)
+		buf_frames = period_frames * 2;
+
+	// Allocate buffer.  Mirrored memory allows us to always get a contiguous region of whole audio frames.
+	// Lock it in RAM so that the I/O callback never waits for a page fault.
+	assert(NULL != (ring_buf = ringbuf_alloc_frames(buf_frames, frame_size, RINGBUF_LOCK)));
+	if (!(ring_buf->flags & RINGBUF_LOCK))
+		fprintf(stderr, "Couldn't lock ring buffer in RAM\n");
 
 	// Register I/O callback
 	void *io_proc_id = NULL;
@@ -60,6 +91,12 @@ void* abuf_create(int playback, void *proc, int *dev_id)
 	assert(0 == AudioDeviceCreateIOProcID(device_id, proc, udata, (AudioDeviceIOProcID*)&io_proc_id)
 		&& io_proc_id != NULL);
 
+	// The ring's size is a multiple of the page size: it may be larger than requested
+	conf->rate = sample_rate;
+	conf->channels = channels;
+	conf->buffer_usec = (uint64_t)(ring_buf->cap / frame_size) * 1000000 / sample_rate;
+	conf->period_usec = (uint64_t)period_frames * 1000000 / sample_rate;
+	audio_conf_report(PCM_F32, sample_rate, channels, conf->buffer_usec, conf->period_usec);
 	*dev_id = device_id;
 	return io_proc_id;
 }
@@ -69,10 +106,29 @@ void on_sigint()
 	quit = 1;
 }
 
-void main()
+void main(int argc, char **argv)
 {
+	// "-format": format of stdout data (see audio-conf.h)
+	// "-buffer", "-period", "-lowlatency": audio buffer parameters (see audio-conf.h)
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	for (int i = 1;  i < argc;  i++) {
+		audio_conf_arg(&conf, argc, argv, &i);
+	}
+	audio_conf_default(&conf, PCM_F32, 48000, 2, 500);
+	u_int out_format = conf.format;
+
 	int dev;
-	void *io_proc_id = abuf_create(0, on_capture, &dev);
+	void *io_proc_id = abuf_create(0, on_capture, &conf, &dev);
+
+	// Captured float32 data is converted to the requested format
+	void *out_buf = NULL;
+	pcm_dither dither;
+	if (out_format != PCM_F32) {
+		fprintf(stderr, "Converting %s -> %s\n", pcm_fmt_name(PCM_F32), pcm_fmt_name(out_format));
+		assert(NULL != (out_buf = malloc(ring_buf->cap)));
+		pcm_dither_init(&dither, 1);
+	}
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
@@ -82,24 +138,45 @@ void main()
 	// Start streaming
 	assert(0 == AudioDeviceStart(dev, io_proc_id));
 
+	// The I/O callback adds 1 period at a time: read by periods,
+	//  so with RINGBUF_STATS the short reads show how often less than that was available.
+	// Rounded up: 'period_usec' was rounded down from the device's N of frames.
+	size_t period_frames = ((uint64_t)conf.period_usec * conf.rate + 999999) / 1000000;
+	if (period_frames == 0)
+		period_frames = 1;
+
 	while (!quit) {
 
 		ringbuffer_chunk buf;
-		size_t h = ringbuf_read_begin(ring_buf, -1, &buf, NULL);
+		size_t h = ringbuf_read_begin_frames(ring_buf, period_frames, &buf, NULL);
 
 		if (buf.len == 0) {
-			// Buffer is empty. Wait 100ms until some new data is available
-			int period_ms = 100;
-			usleep(period_ms*1000);
+			// Buffer is empty. Sleep until the I/O callback adds some new data.
+			ringbuf_wait_readable(ring_buf, 1, 100);
 			continue;
 		}
 
 		// Write to stdout
-		write(1, buf.ptr, buf.len);
+		if (out_buf == NULL) {
+			write(1, buf.ptr, buf.len);
+		} else {
+			size_t samples = buf.len / sizeof(float);
+			pcm_convert(out_format, out_buf, PCM_F32, buf.ptr, samples, &dither);
+			write(1, out_buf, samples * pcm_fmt_size(out_format));
+		}
 
 		ringbuf_read_finish(ring_buf, h);
 	}
 
 	AudioDeviceDestroyIOProcID(dev, io_proc_id);
+
+#ifdef RINGBUF_STATS
+	ringbuffer_stats st;
+	ringbuf_stats(ring_buf, &st);
+	fprintf(stderr, "Ring buffer: written %zu, read %zu, full %zu, short reads %zu, fill level %zu..%zu of %zu\n"
+		, st.written, st.read, st.full, st.short_reads, st.low, st.high, ring_buf->cap);
+#endif
+
 	ringbuf_free(ring_buf);
+	free(out_buf);
 }
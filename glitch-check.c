@@ -0,0 +1,120 @@
+/** Audio API Quick Start Guide: Glitch detector
+Generates the test signal (a frame counter, see pcm-glitch.h) or checks it after it has passed through the audio device,
+ reporting every glitch with a timestamp.
+Usage:
+ glitch-check -gen [-duration SEC] [-rate HZ] [-channels N] | ./alsa-play
+ ./alsa-record | glitch-check [-rate HZ] [-channels N]
+ -duration: length of the signal (default: endless)
+The tools must use int16 format with the same rate and channels on both sides, e.g. over a loopback device:
+ glitch-check -gen | ./alsa-play -device plughw:Loopback,0  &  ./alsa-record -device plughw:Loopback,1 | glitch-check
+The checker prints the totals on end of input or on Ctrl+C;
+ exit status is 1 if there were glitches (for soak test scripts). */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include "pcm-glitch.h"
+#include "audio-conf.h"
+
+#define CHUNK_FRAMES  4096
+
+int quit;
+
+void on_sigint()
+{
+	quit = 1;
+}
+
+void generate(const struct audio_conf *conf, double duration)
+{
+	uint64_t total = (uint64_t)(duration * conf->rate);
+	u_int frame_size = conf->channels * 2;
+	int16_t *buf = malloc(CHUNK_FRAMES * frame_size);
+	assert(buf != NULL);
+
+	uint32_t counter = 0;
+	uint64_t pos = 0;
+	while (!quit && (total == 0 || pos < total)) {
+		size_t n = CHUNK_FRAMES;
+		if (total != 0 && n > total - pos)
+			n = total - pos;
+		counter = pcm_glitch_fill(buf, n, conf->channels, counter);
+		pos += n;
+
+		size_t off = 0;
+		while (off < n * frame_size) {
+			ssize_t r = write(1, (char*)buf + off, n * frame_size - off);
+			if (r <= 0) {
+				quit = 1;
+				break;
+			}
+			off += r;
+		}
+	}
+
+	free(buf);
+}
+
+int check(const struct audio_conf *conf)
+{
+	pcm_glitch_check g;
+	assert(0 == pcm_glitch_check_init(&g, conf->channels, conf->rate, stdout));
+
+	u_int frame_size = conf->channels * 2;
+	int16_t *buf = malloc(CHUNK_FRAMES * frame_size);
+	assert(buf != NULL);
+
+	// The reads may return partial frames: keep the remainder for the next read
+	size_t have = 0;
+	while (!quit) {
+		ssize_t r = read(0, (char*)buf + have, CHUNK_FRAMES * frame_size - have);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		have += r;
+
+		size_t frames = have / frame_size;
+		pcm_glitch_check_update(&g, buf, frames);
+		have -= frames * frame_size;
+		memmove(buf, (char*)buf + frames * frame_size, have);
+		fflush(stdout);
+	}
+
+	free(buf);
+	return (pcm_glitch_check_print(&g, stdout) != 0) ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	// "-rate", "-channels": see audio-conf.h
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	int gen = 0;
+	double duration = 0;
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i))
+			continue;
+		if (!strcmp(argv[i], "-gen"))
+			gen = 1;
+		else if (!strcmp(argv[i], "-duration") && i + 1 < argc)
+			duration = strtod(argv[++i], NULL);
+	}
+	audio_conf_default(&conf, PCM_S16, 48000, 2, 500);
+	assert(conf.format == PCM_S16);
+	assert(conf.channels >= 2);
+
+	// Properly handle SIGINT from user: the checker still prints the totals
+	struct sigaction sa = {};
+	sa.sa_handler = on_sigint;
+	sigaction(SIGINT, &sa, NULL);
+
+	if (gen) {
+		generate(&conf, duration);
+		return 0;
+	}
+	return check(&conf);
+}
@@ -0,0 +1,370 @@
+/** Audio API Quick Start Guide: Round-trip latency benchmark
+Runs a playback tool and a recording tool connected through a loopback device,
+ feeds the player with a train of MLS bursts in real time and finds them in the recorder's output by cross-correlation.
+The latency of a burst is the time from the moment we've written it to the player's stdin
+ until the moment we've read it from the recorder's stdout, i.e. what a user of the tools actually gets.
+Prints the latency percentiles for every buffer length.
+Usage: latency-bench [-backend alsa|pulseaudio] [-play CMD -record CMD] [-buffers MSEC[,MSEC]...] [-count N] [-rate HZ] [-v]
+ -backend: use the loopback device:
+   alsa: 'snd-aloop' kernel module (modprobe snd-aloop): ./alsa-play -device plughw:Loopback,0 | ./alsa-record -device plughw:Loopback,1
+   pulseaudio: null sink (pactl load-module module-null-sink sink_name=latency_bench):
+     ./pulseaudio-play -device latency_bench | ./pulseaudio-record -device latency_bench.monitor
+ -play, -record: any other commands;  "-buffer MSEC -rate HZ -channels 2 -format int16" is appended to them
+ -v: show the tools' output
+Link with -lpthread -lm */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define MLS_BITS  8
+#define MLS_LEN  ((1 << MLS_BITS) - 1)
+#define MLS_AMP  16384
+#define BURST_INTERVAL_MSEC  200
+#define LEADIN_MSEC  500 // silence before the first burst: the tools are starting
+#define CORR_THRESHOLD  0.6 // normalized correlation
+
+#define CHANNELS  2
+#define FRAME_SIZE  (CHANNELS * sizeof(short))
+
+static double now_sec()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/** Maximum length sequence (+1/-1) from a linear feedback shift register: x^8 + x^6 + x^5 + x^4 + 1 */
+static void mls_gen(float *m)
+{
+	unsigned r = 1;
+	for (unsigned i = 0;  i < MLS_LEN;  i++) {
+		m[i] = (r & 1) ? 1 : -1;
+		unsigned bit = ((r >> 7) ^ (r >> 5) ^ (r >> 4) ^ (r >> 3)) & 1;
+		r = ((r << 1) | bit) & 0xff;
+	}
+}
+
+/** Start 'cmd' with its stdin (to_child) or stdout (!to_child) connected to a pipe
+Return PID */
+static pid_t spawn(const char *cmd, int to_child, int *fd, int verbose)
+{
+	int p[2];
+	assert(0 == pipe(p));
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		dup2(p[to_child ? 0 : 1], to_child ? 0 : 1);
+		close(p[0]);
+		close(p[1]);
+		if (!verbose) {
+			int null = open("/dev/null", O_WRONLY);
+			dup2(null, 2);
+		}
+		execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+		_exit(127);
+	}
+	close(p[to_child ? 0 : 1]);
+	*fd = p[to_child ? 1 : 0];
+	return pid;
+}
+
+// Recorder's output: the data and the time when every chunk has arrived
+struct capture {
+	int fd;
+	short *data;
+	size_t len, cap; // bytes
+	struct {
+		size_t end; // bytes
+		double time;
+	} *reads;
+	size_t nreads, reads_cap;
+};
+
+static void* capture_thread(void *param)
+{
+	struct capture *c = param;
+	for (;;) {
+		if (c->cap - c->len < 64*1024) {
+			c->cap = c->cap * 2 + 64*1024;
+			assert(NULL != (c->data = realloc(c->data, c->cap)));
+		}
+		ssize_t r = read(c->fd, (char*)c->data + c->len, c->cap - c->len);
+		double t = now_sec();
+		if (r <= 0)
+			break;
+		c->len += r;
+
+		if (c->nreads == c->reads_cap) {
+			c->reads_cap = c->reads_cap * 2 + 1024;
+			assert(NULL != (c->reads = realloc(c->reads, c->reads_cap * sizeof(*c->reads))));
+		}
+		c->reads[c->nreads].end = c->len;
+		c->reads[c->nreads].time = t;
+		c->nreads++;
+	}
+	return NULL;
+}
+
+/** Return the time when the frame #'frame' was read */
+static double capture_time(const struct capture *c, size_t frame)
+{
+	size_t off = (frame + 1) * FRAME_SIZE;
+	size_t lo = 0, hi = c->nreads;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (c->reads[mid].end < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < c->nreads) ? c->reads[lo].time : -1;
+}
+
+/** Find MLS bursts in channel #0
+Return N of bursts;  'pos': frame offsets of the bursts */
+static size_t detect(const short *data, size_t frames, const float *mls, size_t *pos, size_t max, size_t min_gap)
+{
+	size_t n = 0;
+	double energy = 0;
+	for (size_t i = 0;  i < MLS_LEN && i < frames;  i++)
+		energy += (double)data[i * CHANNELS] * data[i * CHANNELS];
+
+	for (size_t i = 0;  i + MLS_LEN < frames && n < max;  i++) {
+		if (energy > MLS_LEN) { // not silence
+			double c = 0;
+			for (size_t k = 0;  k < MLS_LEN;  k++)
+				c += mls[k] * data[(i + k) * CHANNELS];
+			double rho = c / sqrt(energy * MLS_LEN);
+
+			if (rho > CORR_THRESHOLD) {
+				// Take the peak within the burst
+				size_t best = i;
+				double best_c = c;
+				for (size_t j = i + 1;  j < i + MLS_LEN && j + MLS_LEN < frames;  j++) {
+					double cj = 0;
+					for (size_t k = 0;  k < MLS_LEN;  k++)
+						cj += mls[k] * data[(j + k) * CHANNELS];
+					if (best_c < cj) {
+						best_c = cj;
+						best = j;
+					}
+				}
+				pos[n++] = best;
+
+				// Skip the rest of the burst
+				size_t next = best + min_gap;
+				for (;  i < next && i + MLS_LEN < frames;  i++) {
+					energy += (double)data[(i + MLS_LEN) * CHANNELS] * data[(i + MLS_LEN) * CHANNELS]
+						- (double)data[i * CHANNELS] * data[i * CHANNELS];
+				}
+				i--;
+				continue;
+			}
+		}
+		energy += (double)data[(i + MLS_LEN) * CHANNELS] * data[(i + MLS_LEN) * CHANNELS]
+			- (double)data[i * CHANNELS] * data[i * CHANNELS];
+	}
+	return n;
+}
+
+/** Burst #k is written at frame offset k*interval + jitter(k):
+ the irregular intervals let us tell which burst is which even if some are lost */
+static size_t burst_offset(size_t k, unsigned rate)
+{
+	return (LEADIN_MSEC + k * BURST_INTERVAL_MSEC + (k * 7) % 11) * rate / 1000;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(double*)a, y = *(double*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(const double *v, size_t n, double p)
+{
+	size_t i = n * p / 100;
+	return v[(i < n) ? i : n - 1];
+}
+
+/** Run 1 measurement */
+static void run(const char *play, const char *record, unsigned buffer_msec, unsigned rate, unsigned count, int verbose)
+{
+	char pcmd[1024], rcmd[1024], args[128];
+	snprintf(args, sizeof(args), " -buffer %u -rate %u -channels %u -format int16", buffer_msec, rate, CHANNELS);
+	snprintf(pcmd, sizeof(pcmd), "%s%s", play, args);
+	snprintf(rcmd, sizeof(rcmd), "%s%s", record, args);
+
+	float mls[MLS_LEN];
+	mls_gen(mls);
+
+	// Start the recorder first, so it doesn't miss the first burst
+	struct capture cap = {};
+	pid_t rpid = spawn(rcmd, 0, &cap.fd, verbose);
+	pthread_t t;
+	assert(0 == pthread_create(&t, NULL, capture_thread, &cap));
+	usleep(300*1000);
+
+	int pfd;
+	pid_t ppid = spawn(pcmd, 1, &pfd, verbose);
+
+	// Feed the player in real time, 1ms at a time: the data doesn't pile up in the pipe
+	size_t total = burst_offset(count, rate) + rate; // + 1 sec of silence
+	size_t chunk = rate / 1000;
+	double *wtime = calloc(count, sizeof(double)); // the time when the burst's last frame was written
+	short *buf = calloc(chunk, FRAME_SIZE);
+	size_t next_burst = 0;
+	double start = now_sec();
+	for (size_t off = 0;  off < total;  off += chunk) {
+		memset(buf, 0, chunk * FRAME_SIZE);
+		for (size_t i = 0;  i < chunk;  i++) {
+			for (size_t k = (next_burst > 0) ? next_burst - 1 : 0;  k <= next_burst && k < count;  k++) {
+				size_t b = burst_offset(k, rate);
+				if (off + i >= b && off + i < b + MLS_LEN) {
+					for (unsigned c = 0;  c < CHANNELS;  c++)
+						buf[i * CHANNELS + c] = mls[off + i - b] * MLS_AMP;
+				}
+			}
+		}
+
+		if (write(pfd, buf, chunk * FRAME_SIZE) != (ssize_t)(chunk * FRAME_SIZE))
+			break; // the player has exited
+		double tw = now_sec();
+		while (next_burst < count && off + chunk >= burst_offset(next_burst, rate) + MLS_LEN) {
+			wtime[next_burst] = tw;
+			next_burst++;
+		}
+
+		double tnext = start + (double)(off + chunk) / rate;
+		double dt = tnext - now_sec();
+		if (dt > 0) {
+			struct timespec ts = { (time_t)dt, (long)((dt - (time_t)dt) * 1e9) };
+			nanosleep(&ts, NULL);
+		}
+	}
+	close(pfd);
+	waitpid(ppid, NULL, 0);
+
+	// Let the recorder get the tail, then stop it
+	usleep(500*1000);
+	kill(rpid, SIGINT);
+	pthread_join(t, NULL);
+	close(cap.fd);
+	waitpid(rpid, NULL, 0);
+
+	// Find the bursts in the recording
+	size_t frames = cap.len / FRAME_SIZE;
+	size_t *pos = calloc(count * 2, sizeof(size_t));
+	size_t n = detect(cap.data, frames, mls, pos, count * 2, (size_t)BURST_INTERVAL_MSEC * rate / 1000 / 2);
+
+	// Which burst is the first one we've found: the one whose following intervals match best
+	size_t first = 0;
+	double best_err = -1;
+	for (size_t k = 0;  k < count && n != 0;  k++) {
+		double err = 0;
+		for (size_t j = 1;  j < n && j < 8 && k + j < count;  j++) {
+			err += fabs((double)(pos[j] - pos[0]) - (double)(burst_offset(k + j, rate) - burst_offset(k, rate)));
+		}
+		if (best_err < 0 || err < best_err) {
+			best_err = err;
+			first = k;
+		}
+	}
+
+	// Match every detected burst with the nearest expected position
+	double *lat = calloc(count, sizeof(double));
+	size_t nlat = 0;
+	for (size_t j = 0;  j < n;  j++) {
+		size_t k = first;
+		double d = pos[j] - pos[0];
+		while (k + 1 < count
+			&& fabs(d - (double)(burst_offset(k + 1, rate) - burst_offset(first, rate)))
+				< fabs(d - (double)(burst_offset(k, rate) - burst_offset(first, rate)))) {
+			k++;
+		}
+		double tr = capture_time(&cap, pos[j] + MLS_LEN - 1);
+		if (k >= next_burst || tr < 0)
+			continue;
+		lat[nlat++] = (tr - wtime[k]) * 1000;
+	}
+
+	printf("%-8u %5zu/%-5u", buffer_msec, nlat, count);
+	if (nlat != 0) {
+		qsort(lat, nlat, sizeof(double), cmp_double);
+		printf(" %8.2f %8.2f %8.2f %8.2f %8.2f"
+			, lat[0], percentile(lat, nlat, 50), percentile(lat, nlat, 90), percentile(lat, nlat, 99), lat[nlat - 1]);
+	} else {
+		printf("  no bursts found: is the loopback device set up?");
+	}
+	printf("\n");
+
+	free(lat);
+	free(pos);
+	free(buf);
+	free(wtime);
+	free(cap.data);
+	free(cap.reads);
+}
+
+int main(int argc, char **argv)
+{
+	const char *play = NULL, *record = NULL, *backend = "alsa", *buffers = "10,20,50,100";
+	unsigned rate = 48000, count = 50;
+	int verbose = 0;
+	for (int i = 1;  i < argc;  i++) {
+		if (!strcmp(argv[i], "-backend") && i + 1 < argc) {
+			backend = argv[++i];
+		} else if (!strcmp(argv[i], "-play") && i + 1 < argc) {
+			play = argv[++i];
+		} else if (!strcmp(argv[i], "-record") && i + 1 < argc) {
+			record = argv[++i];
+		} else if (!strcmp(argv[i], "-buffers") && i + 1 < argc) {
+			buffers = argv[++i];
+		} else if (!strcmp(argv[i], "-count") && i + 1 < argc) {
+			count = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-rate") && i + 1 < argc) {
+			rate = strtoul(argv[++i], NULL, 10);
+		} else if (!strcmp(argv[i], "-v")) {
+			verbose = 1;
+		}
+	}
+
+	if (play == NULL || record == NULL) {
+		if (!strcmp(backend, "alsa")) {
+			play = "./alsa-play -device plughw:Loopback,0";
+			record = "./alsa-record -device plughw:Loopback,1";
+		} else if (!strcmp(backend, "pulseaudio")) {
+			play = "./pulseaudio-play -device latency_bench";
+			record = "./pulseaudio-record -device latency_bench.monitor";
+		} else {
+			fprintf(stderr, "Unknown backend %s\n", backend);
+			return 1;
+		}
+	} else {
+		backend = "custom";
+	}
+
+	// The player exits when we close its stdin;  don't die if it exits earlier
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%s: round-trip latency (ms), %u bursts every %ums\n", backend, count, BURST_INTERVAL_MSEC);
+	printf("%-8s %11s %8s %8s %8s %8s %8s\n", "buffer", "found", "min", "50%", "90%", "99%", "max");
+	for (const char *s = buffers;  *s != '\0';  ) {
+		unsigned b = strtoul(s, (char**)&s, 10);
+		if (b != 0)
+			run(play, record, b, rate, count, verbose);
+		if (*s == ',')
+			s++;
+		else if (*s != '\0')
+			break;
+	}
+	return 0;
+}
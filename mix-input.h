@@ -0,0 +1,166 @@
+/** Audio API Quick Start Guide: Mixer inputs: "-mix FILE" options of the play tools (for sample code only)
+Every input file is read by its own thread into its own ring buffer;
+ mix_read() mixes the data from all rings (see pcm-mix.h) directly into the audio buffer.
+The reader threads aren't time-critical: they leave the real-time mode (see rt.h).
+Link with -lpthread -lm */
+
+#pragma once
+#include "ringbuffer.h"
+#include "pcm-mix.h"
+#include "rt.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define MIX_MAX_INPUTS  256
+#define MIX_CHUNK  1024 // frames
+
+struct mix_input {
+	int fd;
+	float gain;
+	ringbuffer *ring;
+	pthread_t thread;
+	_Atomic int eof, stop;
+	int done;
+};
+
+struct mix {
+	struct mix_input in[MIX_MAX_INPUTS];
+	u_int n;
+	u_int format, channels, frame_size;
+	pcm_mixer mixer;
+	pcm_dither dither;
+};
+
+/** Add input "FILE[:GAIN_DB]" */
+static inline void mix_add(struct mix *mx, const char *arg)
+{
+	assert(mx->n < MIX_MAX_INPUTS);
+	struct mix_input *mi = &mx->in[mx->n++];
+	char fn[1024];
+	snprintf(fn, sizeof(fn), "%s", arg);
+	mi->gain = 1;
+	char *colon = strrchr(fn, ':');
+	if (colon != NULL) {
+		*colon = '\0';
+		mi->gain = pow(10, strtod(colon + 1, NULL) / 20);
+	}
+	assert(0 <= (mi->fd = open(fn, O_RDONLY)));
+}
+
+// Reads input file into its ring buffer
+static inline void* mix_reader(void *param)
+{
+	struct mix_input *mi = param;
+	size_t frame_size = mi->ring->frame_size;
+	// File reading isn't time-critical: don't compete with the real-time threads (-rt)
+	rt_leave();
+	while (!atomic_load(&mi->stop)) {
+		ringbuffer_chunk d;
+		size_t h = ringbuf_write_begin_frames(mi->ring, MIX_CHUNK, &d, NULL);
+		if (d.len == 0) {
+			ringbuf_wait_writable(mi->ring, MIX_CHUNK * frame_size, 100);
+			continue;
+		}
+
+		size_t n = 0;
+		while (n < d.len) {
+			ssize_t r = read(mi->fd, d.ptr + n, d.len - n);
+			if (r <= 0)
+				break;
+			n += r;
+		}
+		n -= n % frame_size;
+		ringbuf_write_finish(mi->ring, h - d.len + n);
+		if (n < d.len)
+			break; // input data is complete
+	}
+	atomic_store(&mi->eof, 1);
+	return NULL;
+}
+
+/** Allocate all buffers and start reader threads */
+static inline void mix_start(struct mix *mx, u_int format, u_int channels, u_int frame_size)
+{
+	mx->format = format;
+	mx->channels = channels;
+	mx->frame_size = frame_size;
+	assert(0 == pcm_mixer_init(&mx->mixer, MIX_CHUNK * channels));
+	pcm_dither_init(&mx->dither, 1);
+	for (u_int i = 0;  i < mx->n;  i++) {
+		struct mix_input *mi = &mx->in[i];
+		assert(NULL != (mi->ring = ringbuf_alloc_frames(4 * MIX_CHUNK, frame_size, 0)));
+		assert(0 == pthread_create(&mi->thread, NULL, mix_reader, mi));
+	}
+}
+
+static inline void mix_close(struct mix *mx)
+{
+	for (u_int i = 0;  i < mx->n;  i++) {
+		struct mix_input *mi = &mx->in[i];
+		atomic_store(&mi->stop, 1);
+		pthread_join(mi->thread, NULL);
+		ringbuf_free(mi->ring);
+		close(mi->fd);
+	}
+	pcm_mixer_close(&mx->mixer);
+}
+
+/** Mix up to 'frames' frames from all inputs into 'dst'
+wait: 1: wait until every input has the data, so that the inputs stay in sync;
+  0: never block (e.g. while holding a lock the audio thread needs): an input that has less data is padded with silence
+Return N of frames;  0 if all inputs are complete */
+static inline u_int mix_read(struct mix *mx, void *dst, u_int frames, int wait)
+{
+	if (frames > MIX_CHUNK)
+		frames = MIX_CHUNK;
+
+	ringbuffer_chunk d[MIX_MAX_INPUTS];
+	size_t h[MIX_MAX_INPUTS];
+	u_int mixed = 0;
+	for (u_int i = 0;  i < mx->n;  i++) {
+		struct mix_input *mi = &mx->in[i];
+		d[i].len = 0;
+		if (mi->done)
+			continue;
+
+		// Wait for the input, so that the inputs stay in sync
+		int eof = atomic_load(&mi->eof);
+		while (wait && !eof && 0 != ringbuf_wait_readable(mi->ring, frames * mx->frame_size, 100)) {
+			eof = atomic_load(&mi->eof);
+		}
+
+		h[i] = ringbuf_read_begin_frames(mi->ring, frames, &d[i], NULL);
+		if (d[i].len == 0 && eof) {
+			mi->done = 1;
+			continue;
+		}
+		if (!wait)
+			mixed = frames; // the input isn't complete: the data it doesn't have yet is silence
+		else if (mixed < d[i].len / mx->frame_size)
+			mixed = d[i].len / mx->frame_size;
+	}
+
+	if (mixed != 0) {
+		// Inputs with less data (i.e. those which are complete or late) are silent at the end
+		pcm_mix_begin(&mx->mixer, mixed * mx->channels);
+		for (u_int i = 0;  i < mx->n;  i++) {
+			if (d[i].len != 0)
+				pcm_mix_add(&mx->mixer, mx->format, d[i].ptr, d[i].len / pcm_fmt_size(mx->format), mx->in[i].gain);
+		}
+		pcm_mix_end(&mx->mixer, mx->format, dst, &mx->dither);
+	}
+
+	for (u_int i = 0;  i < mx->n;  i++) {
+		if (d[i].len != 0)
+			ringbuf_read_finish(mx->in[i].ring, h[i]);
+	}
+	return mixed;
+}
@@ -1,5 +1,6 @@
 /** Audio API Quick Start Guide: OSS: Play audio from stdin
-Link with -lm */
+Usage: oss-play [-format int16|int24|int32|float32] [-rate HZ] [-channels N] [-buffer MSEC] [-period MSEC] [-lowlatency] [-device ID] [-rt PRIO] [-cpu LIST]
+Link with -lpthread -lm */
 #include <sys/soundcard.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -9,55 +10,84 @@ Link with -lm */
 #include <string.h>
 #include <math.h>
 #include <assert.h>
+#include "audio-conf.h"
+#include "rt.h"
 
 int quit;
 
-int abuf_create(int playback, void **data, int *buf_size, int *frame_size)
+/** Map enum PCM_FMT to OSS format */
+int oss_format(u_int format)
+{
+	switch (format) {
+	case PCM_S16: return AFMT_S16_LE;
+#ifdef AFMT_S24_PACKED
+	case PCM_S24: return AFMT_S24_PACKED;
+#endif
+#ifdef AFMT_S32_LE
+	case PCM_S32: return AFMT_S32_LE;
+#endif
+#ifdef AFMT_F32_LE
+	case PCM_F32: return AFMT_F32_LE;
+#endif
+	}
+	return -1;
+}
+
+/** Open the device with the requested stream parameters
+conf: [in/out] the requested values;  the actual values on return */
+int abuf_create(int playback, struct audio_conf *conf, void **data, int *buf_size, int *frame_size)
 {
 	// Open device
 	int dsp;
-	const char *device_id = NULL;
+	const char *device_id = conf->device;
 	if (device_id == NULL)
 		device_id = "/dev/dsp";
 	int flags = (playback) ? O_WRONLY : O_RDONLY;
 	assert(0 < (dsp = open(device_id, flags | O_EXCL, 0)));
 
-	// Set sample format
-	int format = AFMT_S16_LE;
+	// Set sample format.
+	// The device must accept our format: we don't convert the data.
+	int format = oss_format(conf->format);
+	assert(format != -1);
 	assert(0 <= ioctl(dsp, SNDCTL_DSP_SETFMT, &format));
+	assert(format == oss_format(conf->format));
 
 	// Set channels
-	int channels = 2;
+	int channels = conf->channels;
 	assert(0 <= ioctl(dsp, SNDCTL_DSP_CHANNELS, &channels));
 
 	// Set sample rate
-	int sample_rate = 44100;
+	int sample_rate = conf->rate;
 	assert(0 <= ioctl(dsp, SNDCTL_DSP_SPEED, &sample_rate));
 
-	fprintf(stderr, "Using format %u, sample rate %u, channels %u\n", format, sample_rate, channels);
-
-	audio_buf_info info = {};
-
-	// Set buffer length
-	if (playback)
-		assert(0 <= ioctl(dsp, SNDCTL_DSP_GETOSPACE, &info));
-	else
-		assert(0 <= ioctl(dsp, SNDCTL_DSP_GETISPACE, &info));
-
-	int buffer_length_msec = 500;
-	int frag_num = 16/8 * sample_rate * channels * buffer_length_msec / 1000 / info.fragsize;
-	int fr = (frag_num << 16) | (int)log2(info.fragsize); // buf_size = frag_num * 2^n
+	// Set buffer length and fragment (period) size:
+	//  buf_size = frag_num * 2^n
+	// Low latency: a few small fragments.
+	int bytes_per_sec = pcm_fmt_size(conf->format) * sample_rate * channels;
+	u_int period_usec = (conf->period_usec != 0) ? conf->period_usec : AUDIO_CONF_MIN_PERIOD_USEC;
+	u_int buffer_usec = (conf->buffer_usec != 0) ? conf->buffer_usec : period_usec * AUDIO_CONF_LL_PERIODS;
+	int frag_log = (int)log2((double)bytes_per_sec * period_usec / 1000000);
+	if (frag_log < 4)
+		frag_log = 4; // 16 bytes minimum
+	int frag_num = (int)((double)bytes_per_sec * buffer_usec / 1000000) >> frag_log;
+	if (frag_num < 2)
+		frag_num = 2;
+	int fr = (frag_num << 16) | frag_log;
 	assert(0 <= ioctl(dsp, SNDCTL_DSP_SETFRAGMENT, &fr));
 
 	// Get buffer length
-	memset(&info, 0, sizeof(info));
+	audio_buf_info info = {};
 	if (playback)
 		assert(0 <= ioctl(dsp, SNDCTL_DSP_GETOSPACE, &info));
 	else
 		assert(0 <= ioctl(dsp, SNDCTL_DSP_GETISPACE, &info));
-	buffer_length_msec = info.fragstotal * info.fragsize * 1000 / (16/8 * sample_rate * channels);
+	conf->rate = sample_rate;
+	conf->channels = channels;
+	conf->buffer_usec = (uint64_t)info.fragstotal * info.fragsize * 1000000 / bytes_per_sec;
+	conf->period_usec = (uint64_t)info.fragsize * 1000000 / bytes_per_sec;
+	audio_conf_report(conf->format, sample_rate, channels, conf->buffer_usec, conf->period_usec);
 	*buf_size = info.fragstotal * info.fragsize;
-	*frame_size = 16/8 * channels;
+	*frame_size = pcm_fmt_size(conf->format) * channels;
 
 	// Create buffer for audio data
 	*data = malloc(*buf_size);
@@ -70,17 +100,29 @@ void on_sigint()
 	quit = 1;
 }
 
-void main()
+void main(int argc, char **argv)
 {
+	// "-format", "-rate", "-channels": format of stdin data (see audio-conf.h)
+	// "-buffer", "-period", "-lowlatency", "-device", "-rt", "-cpu": audio buffer parameters (see audio-conf.h)
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	for (int i = 1;  i < argc;  i++) {
+		audio_conf_arg(&conf, argc, argv, &i);
+	}
+	audio_conf_default(&conf, PCM_S16, 44100, 2, 500);
+
 	void *buf;
 	int buf_size, frame_size;
-	int dsp = abuf_create(1, &buf, &buf_size, &frame_size);
+	int dsp = abuf_create(1, &conf, &buf, &buf_size, &frame_size);
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	// Real-time mode for the device loop (see rt.h)
+	rt_enter(conf.rt_prio, conf.cpus);
+
 	while (!quit) {
 		// Read data from stdin
 		int n = read(0, buf, buf_size);
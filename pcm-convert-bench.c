@@ -0,0 +1,124 @@
+/** Audio API Quick Start Guide: Sample format conversion benchmark
+Checks that SIMD kernels produce exactly the same data as the scalar code,
+ then measures the throughput of every conversion for every instruction set supported by CPU.
+Usage: pcm-convert-bench [SAMPLES] [ITERATIONS]
+Link with -lm */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "pcm-convert.h"
+
+static const char isa_names[][8] = { "", "scalar", "sse2", "avx2" };
+
+static void fill_random(unsigned fmt, void *buf, size_t n)
+{
+	uint32_t x = 1;
+	for (size_t i = 0;  i < n;  i++) {
+		x = x * 1664525 + 1013904223;
+		if (fmt == PCM_F32) {
+			// Include out-of-range values to check saturation
+			((float*)buf)[i] = ((int32_t)x) * (1.25f / 2147483648.f);
+		} else {
+			_pcm_store_i32(buf, i, (int32_t)x, PCM_S32);
+		}
+	}
+	if (fmt != PCM_F32)
+		pcm_convert(fmt, buf, PCM_S32, buf, n, NULL);
+}
+
+/** Convert with every supported instruction set and compare the output with the scalar code */
+static void check(unsigned ofmt, unsigned ifmt, const void *in, size_t n, int dither)
+{
+	size_t size = n * pcm_fmt_size(ofmt);
+	char *ref = malloc(size), *out = malloc(size);
+	pcm_dither dref, dout;
+	pcm_dither_init(&dref, 1);
+
+	pcm_convert_isa(PCM_ISA_SCALAR);
+	pcm_convert(ofmt, ref, ifmt, in, n, (dither) ? &dref : NULL);
+
+	for (unsigned isa = PCM_ISA_SSE2;  isa <= PCM_ISA_AVX2;  isa++) {
+		if (isa != pcm_convert_isa(isa))
+			continue;
+		pcm_dither_init(&dout, 1);
+		memset(out, 0xee, size);
+		pcm_convert(ofmt, out, ifmt, in, n, (dither) ? &dout : NULL);
+		if (memcmp(ref, out, size) || memcmp(&dref, &dout, sizeof(dref))) {
+			printf("MISMATCH: %s -> %s (%s, dither:%d, %zu samples)\n"
+				, pcm_fmt_name(ifmt), pcm_fmt_name(ofmt), isa_names[isa], dither, n);
+			exit(1);
+		}
+	}
+
+	free(ref);
+	free(out);
+}
+
+static double bench(unsigned isa, unsigned ofmt, unsigned ifmt, const void *in, void *out, size_t n, unsigned iterations, int dither)
+{
+	pcm_dither d;
+	pcm_dither_init(&d, 1);
+	pcm_convert_isa(isa);
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned i = 0;  i < iterations;  i++) {
+		pcm_convert(ofmt, out, ifmt, in, n, (dither) ? &d : NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	return (double)n * iterations / sec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = (argc > 1) ? strtoul(argv[1], NULL, 10) : 4096;
+	unsigned iterations = (argc > 2) ? strtoul(argv[2], NULL, 10) : 10000;
+	unsigned best = pcm_convert_isa(PCM_ISA_AUTO);
+
+	void *in = malloc(n * 4 + 64), *out = malloc(n * 4 + 64);
+
+	// Bit-exactness: odd lengths exercise the scalar tail code
+	static const size_t lengths[] = { 1, 7, 8, 9, 10, 17, 31, 1000, 4099 };
+	for (unsigned ifmt = PCM_S16;  ifmt <= PCM_F32;  ifmt++) {
+		for (unsigned ofmt = PCM_S16;  ofmt <= PCM_F32;  ofmt++) {
+			for (unsigned k = 0;  k < sizeof(lengths) / sizeof(*lengths);  k++) {
+				void *buf = malloc(lengths[k] * 4);
+				fill_random(ifmt, buf, lengths[k]);
+				check(ofmt, ifmt, buf, lengths[k], 0);
+				check(ofmt, ifmt, buf, lengths[k], 1);
+				free(buf);
+			}
+		}
+	}
+	printf("SIMD output is bit-exact with scalar code (best: %s)\n\n", isa_names[best]);
+
+	printf("Msamples/sec, %zu samples x %u\n", n, iterations);
+	printf("%-26s", "");
+	for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+		printf("%10s", isa_names[isa]);
+	}
+	printf("\n");
+
+	for (unsigned ifmt = PCM_S16;  ifmt <= PCM_F32;  ifmt++) {
+		fill_random(ifmt, in, n);
+		for (unsigned ofmt = PCM_S16;  ofmt <= PCM_F32;  ofmt++) {
+			int ndither = (ifmt == PCM_F32 && (ofmt == PCM_S16 || ofmt == PCM_S24)) ? 2 : 1;
+			for (int dither = 0;  dither < ndither;  dither++) {
+				char name[64];
+				snprintf(name, sizeof(name), "%s -> %s%s", pcm_fmt_name(ifmt), pcm_fmt_name(ofmt), (dither) ? " +dither" : "");
+				printf("%-26s", name);
+				for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+					printf("%10.0f", bench(isa, ofmt, ifmt, in, out, n, iterations, dither));
+				}
+				printf("\n");
+			}
+		}
+	}
+
+	free(in);
+	free(out);
+	return 0;
+}
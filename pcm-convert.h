@@ -0,0 +1,496 @@
+/** Audio API Quick Start Guide: Sample format conversion (for sample code only)
+Converts interleaved or planar sample data between int16, packed int24, int32 and float32.
+The data is processed 8 samples at a time with SSE2 or AVX2 instructions (selected at runtime from CPU features),
+ the remaining samples and non-x86 CPUs use the scalar code which produces bit-exact results.
+Float -> integer conversion saturates and rounds to nearest.
+Optional TPDF dither (+/-1 LSB) may be applied when converting float to int16 or int24. */
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#if defined __x86_64__ || defined __i386__
+	#define PCM_X86
+	#include <immintrin.h>
+#endif
+
+enum PCM_FMT {
+	PCM_S16,
+	PCM_S24, // packed: 3 bytes, little endian
+	PCM_S32,
+	PCM_F32,
+};
+
+/** Sample size in bytes */
+static inline unsigned pcm_fmt_size(unsigned fmt)
+{
+	static const unsigned char sizes[] = { 2, 3, 4, 4 };
+	return sizes[fmt];
+}
+
+static inline const char* pcm_fmt_name(unsigned fmt)
+{
+	static const char names[][8] = { "int16", "int24", "int32", "float32" };
+	return names[fmt];
+}
+
+enum PCM_ISA {
+	PCM_ISA_AUTO,
+	PCM_ISA_SCALAR,
+	PCM_ISA_SSE2,
+	PCM_ISA_AVX2,
+};
+
+/** TPDF dither generator: 8 xorshift32 lanes, sample #i of every call uses lane #(i%8) */
+typedef struct {
+	uint32_t lane[8];
+} pcm_dither;
+
+static inline void pcm_dither_init(pcm_dither *d, uint32_t seed)
+{
+	for (unsigned i = 0;  i < 8;  i++) {
+		seed = seed * 1664525 + 1013904223;
+		d->lane[i] = seed | 1;
+	}
+}
+
+
+/* Scalar code */
+
+static inline uint32_t _pcm_xorshift(uint32_t x)
+{
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+/** Triangular noise in range (-1.0, 1.0) from a random 32-bit value */
+static inline float _pcm_tpdf(uint32_t x)
+{
+	return (float)((int32_t)(x >> 16) - (int32_t)(x & 0xffff)) * (1.f / 65536);
+}
+
+/** Load sample as left-justified int32 */
+static inline __attribute__((always_inline)) int32_t _pcm_load_i32(const void *src, size_t i, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16:
+		return (int32_t)((uint32_t)((const int16_t*)src)[i] << 16);
+	case PCM_S24: {
+		const uint8_t *p = (const uint8_t*)src + i * 3;
+		return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24));
+	}
+	default:
+		return ((const int32_t*)src)[i];
+	}
+}
+
+/** Store left-justified int32 sample */
+static inline __attribute__((always_inline)) void _pcm_store_i32(void *dst, size_t i, int32_t v, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16:
+		((int16_t*)dst)[i] = v >> 16;
+		break;
+	case PCM_S24: {
+		uint8_t *p = (uint8_t*)dst + i * 3;
+		p[0] = (uint32_t)v >> 8;
+		p[1] = (uint32_t)v >> 16;
+		p[2] = (uint32_t)v >> 24;
+		break;
+	}
+	default:
+		((int32_t*)dst)[i] = v;
+	}
+}
+
+/** Float -> left-justified int32 with saturation */
+static inline __attribute__((always_inline)) int32_t _pcm_f32_to_i32(float f, uint32_t *dither, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16:
+	case PCM_S24: {
+		float scale = (fmt == PCM_S16) ? 32768.f : 8388608.f;
+		float v = f * scale;
+		if (dither != NULL) {
+			*dither = _pcm_xorshift(*dither);
+			v = v + _pcm_tpdf(*dither);
+		}
+		if (v < -scale)
+			v = -scale;
+		else if (v > scale - 1)
+			v = scale - 1;
+		int32_t i = lrintf(v);
+		return (int32_t)((uint32_t)i << ((fmt == PCM_S16) ? 16 : 8));
+	}
+	default: {
+		float v = f * 2147483648.f;
+		if (v >= 2147483648.f)
+			return INT32_MAX;
+		else if (v <= -2147483648.f)
+			return INT32_MIN;
+		return lrintf(v);
+	}
+	}
+}
+
+static inline __attribute__((always_inline)) void _pcm_conv_scalar(void *dst, const void *src, size_t n, pcm_dither *dither, const unsigned ofmt, const unsigned ifmt)
+{
+	for (size_t i = 0;  i < n;  i++) {
+		if (ifmt == PCM_F32 && ofmt == PCM_F32) {
+			((float*)dst)[i] = ((const float*)src)[i];
+
+		} else if (ifmt == PCM_F32) {
+			uint32_t *d = (dither != NULL && ofmt != PCM_S32) ? &dither->lane[i % 8] : NULL;
+			_pcm_store_i32(dst, i, _pcm_f32_to_i32(((const float*)src)[i], d, ofmt), ofmt);
+
+		} else if (ofmt == PCM_F32) {
+			((float*)dst)[i] = (float)_pcm_load_i32(src, i, ifmt) * (1.f / 2147483648.f);
+
+		} else {
+			_pcm_store_i32(dst, i, _pcm_load_i32(src, i, ifmt), ofmt);
+		}
+	}
+}
+
+
+#ifdef PCM_X86
+
+/* SSE2 code: 8 samples in 2 registers */
+
+#define _PCM_SSE2  __attribute__((always_inline, target("sse2")))
+
+typedef struct { __m128i a, b; } _pcm_i32x8_sse2;
+
+static inline _PCM_SSE2 _pcm_i32x8_sse2 _pcm_load_i32_sse2(const void *src, size_t i, const unsigned fmt)
+{
+	_pcm_i32x8_sse2 v;
+	switch (fmt) {
+	case PCM_S16: {
+		__m128i x = _mm_loadu_si128((const __m128i*)((const int16_t*)src + i));
+		v.a = _mm_unpacklo_epi16(_mm_setzero_si128(), x);
+		v.b = _mm_unpackhi_epi16(_mm_setzero_si128(), x);
+		break;
+	}
+	case PCM_S24: {
+		// No byte shuffle in SSE2
+		v.a = _mm_setr_epi32(_pcm_load_i32(src, i, PCM_S24), _pcm_load_i32(src, i + 1, PCM_S24)
+			, _pcm_load_i32(src, i + 2, PCM_S24), _pcm_load_i32(src, i + 3, PCM_S24));
+		v.b = _mm_setr_epi32(_pcm_load_i32(src, i + 4, PCM_S24), _pcm_load_i32(src, i + 5, PCM_S24)
+			, _pcm_load_i32(src, i + 6, PCM_S24), _pcm_load_i32(src, i + 7, PCM_S24));
+		break;
+	}
+	default:
+		v.a = _mm_loadu_si128((const __m128i*)((const int32_t*)src + i));
+		v.b = _mm_loadu_si128((const __m128i*)((const int32_t*)src + i + 4));
+	}
+	return v;
+}
+
+static inline _PCM_SSE2 void _pcm_store_i32_sse2(void *dst, size_t i, _pcm_i32x8_sse2 v, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16: {
+		__m128i x = _mm_packs_epi32(_mm_srai_epi32(v.a, 16), _mm_srai_epi32(v.b, 16));
+		_mm_storeu_si128((__m128i*)((int16_t*)dst + i), x);
+		break;
+	}
+	case PCM_S24: {
+		for (unsigned k = 0;  k < 4;  k++) {
+			_pcm_store_i32(dst, i + k, _mm_cvtsi128_si32(v.a), PCM_S24);
+			_pcm_store_i32(dst, i + 4 + k, _mm_cvtsi128_si32(v.b), PCM_S24);
+			v.a = _mm_srli_si128(v.a, 4);
+			v.b = _mm_srli_si128(v.b, 4);
+		}
+		break;
+	}
+	default:
+		_mm_storeu_si128((__m128i*)((int32_t*)dst + i), v.a);
+		_mm_storeu_si128((__m128i*)((int32_t*)dst + i + 4), v.b);
+	}
+}
+
+static inline _PCM_SSE2 __m128i _pcm_xorshift_sse2(__m128i x)
+{
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+	return x;
+}
+
+static inline _PCM_SSE2 __m128 _pcm_tpdf_sse2(__m128i x)
+{
+	__m128i d = _mm_sub_epi32(_mm_srli_epi32(x, 16), _mm_and_si128(x, _mm_set1_epi32(0xffff)));
+	return _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.f / 65536));
+}
+
+static inline _PCM_SSE2 __m128i _pcm_f32_to_i32_sse2(__m128 f, __m128i *dither, const unsigned fmt)
+{
+	if (fmt == PCM_S32) {
+		__m128 v = _mm_mul_ps(f, _mm_set1_ps(2147483648.f));
+		// Overflow produces 0x80000000: flip it to 0x7fffffff for positive values
+		__m128i over = _mm_castps_si128(_mm_cmpge_ps(v, _mm_set1_ps(2147483648.f)));
+		return _mm_xor_si128(_mm_cvtps_epi32(v), over);
+	}
+
+	float scale = (fmt == PCM_S16) ? 32768.f : 8388608.f;
+	__m128 v = _mm_mul_ps(f, _mm_set1_ps(scale));
+	if (dither != NULL) {
+		*dither = _pcm_xorshift_sse2(*dither);
+		v = _mm_add_ps(v, _pcm_tpdf_sse2(*dither));
+	}
+	v = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(-scale)), _mm_set1_ps(scale - 1));
+	__m128i i = _mm_cvtps_epi32(v);
+	return (fmt == PCM_S16) ? _mm_slli_epi32(i, 16) : _mm_slli_epi32(i, 8);
+}
+
+static inline _PCM_SSE2 void _pcm_conv_sse2(void *dst, const void *src, size_t n, pcm_dither *dither, const unsigned ofmt, const unsigned ifmt)
+{
+	__m128i d0 = _mm_setzero_si128(), d1 = d0;
+	int dith = (dither != NULL && ifmt == PCM_F32 && ofmt != PCM_S32 && ofmt != PCM_F32);
+	if (dith) {
+		d0 = _mm_loadu_si128((__m128i*)dither->lane);
+		d1 = _mm_loadu_si128((__m128i*)(dither->lane + 4));
+	}
+
+	size_t i = 0;
+	for (;  i + 8 <= n;  i += 8) {
+		if (ifmt == PCM_F32) {
+			__m128 a = _mm_loadu_ps((const float*)src + i);
+			__m128 b = _mm_loadu_ps((const float*)src + i + 4);
+			if (ofmt == PCM_F32) {
+				_mm_storeu_ps((float*)dst + i, a);
+				_mm_storeu_ps((float*)dst + i + 4, b);
+				continue;
+			}
+			_pcm_i32x8_sse2 v;
+			v.a = _pcm_f32_to_i32_sse2(a, (dith) ? &d0 : NULL, ofmt);
+			v.b = _pcm_f32_to_i32_sse2(b, (dith) ? &d1 : NULL, ofmt);
+			_pcm_store_i32_sse2(dst, i, v, ofmt);
+
+		} else {
+			_pcm_i32x8_sse2 v = _pcm_load_i32_sse2(src, i, ifmt);
+			if (ofmt == PCM_F32) {
+				__m128 k = _mm_set1_ps(1.f / 2147483648.f);
+				_mm_storeu_ps((float*)dst + i, _mm_mul_ps(_mm_cvtepi32_ps(v.a), k));
+				_mm_storeu_ps((float*)dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(v.b), k));
+				continue;
+			}
+			_pcm_store_i32_sse2(dst, i, v, ofmt);
+		}
+	}
+
+	if (dith) {
+		_mm_storeu_si128((__m128i*)dither->lane, d0);
+		_mm_storeu_si128((__m128i*)(dither->lane + 4), d1);
+	}
+
+	// Tail starts at lane #0
+	_pcm_conv_scalar((char*)dst + i * pcm_fmt_size(ofmt), (const char*)src + i * pcm_fmt_size(ifmt), n - i, dither, ofmt, ifmt);
+}
+
+
+/* AVX2 code: 8 samples in 1 register */
+
+#define _PCM_AVX2  __attribute__((always_inline, target("avx2")))
+
+static inline _PCM_AVX2 __m256i _pcm_load_i32_avx2(const void *src, size_t i, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16: {
+		__m128i x = _mm_loadu_si128((const __m128i*)((const int16_t*)src + i));
+		return _mm256_slli_epi32(_mm256_cvtepi16_epi32(x), 16);
+	}
+	case PCM_S24: {
+		// Reads 4 bytes past the 8th sample: the caller guarantees they exist
+		const __m128i shuf = _mm_setr_epi8(-1,0,1,2, -1,3,4,5, -1,6,7,8, -1,9,10,11);
+		const char *p = (const char*)src + i * 3;
+		__m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), shuf);
+		__m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuf);
+		return _mm256_set_m128i(hi, lo);
+	}
+	default:
+		return _mm256_loadu_si256((const __m256i*)((const int32_t*)src + i));
+	}
+}
+
+static inline _PCM_AVX2 void _pcm_store_i32_avx2(void *dst, size_t i, __m256i v, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16: {
+		v = _mm256_srai_epi32(v, 16);
+		__m128i x = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		_mm_storeu_si128((__m128i*)((int16_t*)dst + i), x);
+		break;
+	}
+	case PCM_S24: {
+		// Pack the upper 3 bytes of each sample into the lower 12 bytes, then store exactly 24 bytes
+		const __m256i shuf = _mm256_setr_epi8(1,2,3, 5,6,7, 9,10,11, 13,14,15, -1,-1,-1,-1
+			, 1,2,3, 5,6,7, 9,10,11, 13,14,15, -1,-1,-1,-1);
+		v = _mm256_shuffle_epi8(v, shuf);
+		__m128i lo = _mm256_castsi256_si128(v);
+		__m128i hi = _mm256_extracti128_si256(v, 1);
+		char *p = (char*)dst + i * 3;
+		_mm_storel_epi64((__m128i*)p, lo);
+		*(uint32_t*)(p + 8) = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+		_mm_storel_epi64((__m128i*)(p + 12), hi);
+		*(uint32_t*)(p + 20) = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+		break;
+	}
+	default:
+		_mm256_storeu_si256((__m256i*)((int32_t*)dst + i), v);
+	}
+}
+
+static inline _PCM_AVX2 __m256i _pcm_f32_to_i32_avx2(__m256 f, __m256i *dither, const unsigned fmt)
+{
+	if (fmt == PCM_S32) {
+		__m256 v = _mm256_mul_ps(f, _mm256_set1_ps(2147483648.f));
+		__m256i over = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_set1_ps(2147483648.f), _CMP_GE_OQ));
+		return _mm256_xor_si256(_mm256_cvtps_epi32(v), over);
+	}
+
+	float scale = (fmt == PCM_S16) ? 32768.f : 8388608.f;
+	__m256 v = _mm256_mul_ps(f, _mm256_set1_ps(scale));
+	if (dither != NULL) {
+		__m256i x = *dither;
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+		x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+		x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+		*dither = x;
+		__m256i d = _mm256_sub_epi32(_mm256_srli_epi32(x, 16), _mm256_and_si256(x, _mm256_set1_epi32(0xffff)));
+		v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_cvtepi32_ps(d), _mm256_set1_ps(1.f / 65536)));
+	}
+	v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-scale)), _mm256_set1_ps(scale - 1));
+	__m256i i = _mm256_cvtps_epi32(v);
+	return (fmt == PCM_S16) ? _mm256_slli_epi32(i, 16) : _mm256_slli_epi32(i, 8);
+}
+
+static inline _PCM_AVX2 void _pcm_conv_avx2(void *dst, const void *src, size_t n, pcm_dither *dither, const unsigned ofmt, const unsigned ifmt)
+{
+	__m256i d = _mm256_setzero_si256();
+	int dith = (dither != NULL && ifmt == PCM_F32 && ofmt != PCM_S32 && ofmt != PCM_F32);
+	if (dith)
+		d = _mm256_loadu_si256((__m256i*)dither->lane);
+
+	// Packed int24 loader reads 4 extra bytes
+	size_t end = (ifmt == PCM_S24 && n >= 2) ? n - 2 : n;
+
+	size_t i = 0;
+	for (;  i + 8 <= end;  i += 8) {
+		if (ifmt == PCM_F32) {
+			__m256 f = _mm256_loadu_ps((const float*)src + i);
+			if (ofmt == PCM_F32) {
+				_mm256_storeu_ps((float*)dst + i, f);
+				continue;
+			}
+			_pcm_store_i32_avx2(dst, i, _pcm_f32_to_i32_avx2(f, (dith) ? &d : NULL, ofmt), ofmt);
+
+		} else {
+			__m256i v = _pcm_load_i32_avx2(src, i, ifmt);
+			if (ofmt == PCM_F32) {
+				_mm256_storeu_ps((float*)dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.f / 2147483648.f)));
+				continue;
+			}
+			_pcm_store_i32_avx2(dst, i, v, ofmt);
+		}
+	}
+
+	if (dith)
+		_mm256_storeu_si256((__m256i*)dither->lane, d);
+
+	_pcm_conv_scalar((char*)dst + i * pcm_fmt_size(ofmt), (const char*)src + i * pcm_fmt_size(ifmt), n - i, dither, ofmt, ifmt);
+}
+
+#endif // PCM_X86
+
+
+/* Kernel table */
+
+typedef void (*_pcm_conv_func)(void *dst, const void *src, size_t n, pcm_dither *dither);
+
+#define _PCM_KERNEL(isa, target, O, I) \
+	static target void _pcm_##isa##_##O##_##I(void *dst, const void *src, size_t n, pcm_dither *dither) \
+	{ \
+		_pcm_conv_##isa(dst, src, n, dither, O, I); \
+	}
+
+#define _PCM_KERNELS(isa, target) \
+	_PCM_KERNEL(isa, target, PCM_S16, PCM_S16) \
+	_PCM_KERNEL(isa, target, PCM_S16, PCM_S24) \
+	_PCM_KERNEL(isa, target, PCM_S16, PCM_S32) \
+	_PCM_KERNEL(isa, target, PCM_S16, PCM_F32) \
+	_PCM_KERNEL(isa, target, PCM_S24, PCM_S16) \
+	_PCM_KERNEL(isa, target, PCM_S24, PCM_S24) \
+	_PCM_KERNEL(isa, target, PCM_S24, PCM_S32) \
+	_PCM_KERNEL(isa, target, PCM_S24, PCM_F32) \
+	_PCM_KERNEL(isa, target, PCM_S32, PCM_S16) \
+	_PCM_KERNEL(isa, target, PCM_S32, PCM_S24) \
+	_PCM_KERNEL(isa, target, PCM_S32, PCM_S32) \
+	_PCM_KERNEL(isa, target, PCM_S32, PCM_F32) \
+	_PCM_KERNEL(isa, target, PCM_F32, PCM_S16) \
+	_PCM_KERNEL(isa, target, PCM_F32, PCM_S24) \
+	_PCM_KERNEL(isa, target, PCM_F32, PCM_S32) \
+	_PCM_KERNEL(isa, target, PCM_F32, PCM_F32)
+
+#define _PCM_TABLE(isa) { \
+	{ _pcm_##isa##_PCM_S16_PCM_S16, _pcm_##isa##_PCM_S16_PCM_S24, _pcm_##isa##_PCM_S16_PCM_S32, _pcm_##isa##_PCM_S16_PCM_F32 }, \
+	{ _pcm_##isa##_PCM_S24_PCM_S16, _pcm_##isa##_PCM_S24_PCM_S24, _pcm_##isa##_PCM_S24_PCM_S32, _pcm_##isa##_PCM_S24_PCM_F32 }, \
+	{ _pcm_##isa##_PCM_S32_PCM_S16, _pcm_##isa##_PCM_S32_PCM_S24, _pcm_##isa##_PCM_S32_PCM_S32, _pcm_##isa##_PCM_S32_PCM_F32 }, \
+	{ _pcm_##isa##_PCM_F32_PCM_S16, _pcm_##isa##_PCM_F32_PCM_S24, _pcm_##isa##_PCM_F32_PCM_S32, _pcm_##isa##_PCM_F32_PCM_F32 }, \
+}
+
+_PCM_KERNELS(scalar, )
+static const _pcm_conv_func _pcm_conv_scalar_table[4][4] = _PCM_TABLE(scalar);
+
+#ifdef PCM_X86
+_PCM_KERNELS(sse2, __attribute__((target("sse2"))))
+_PCM_KERNELS(avx2, __attribute__((target("avx2"))))
+static const _pcm_conv_func _pcm_conv_sse2_table[4][4] = _PCM_TABLE(sse2);
+static const _pcm_conv_func _pcm_conv_avx2_table[4][4] = _PCM_TABLE(avx2);
+#endif
+
+static unsigned _pcm_isa;
+
+/** Select the instruction set: enum PCM_ISA.
+PCM_ISA_AUTO: the best one supported by CPU
+Return the selected instruction set;
+ PCM_ISA_SCALAR if the requested one isn't supported */
+static inline unsigned pcm_convert_isa(unsigned isa)
+{
+	unsigned best = PCM_ISA_SCALAR;
+#ifdef PCM_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		best = PCM_ISA_AVX2;
+	else if (__builtin_cpu_supports("sse2"))
+		best = PCM_ISA_SSE2;
+#endif
+	if (isa == PCM_ISA_AUTO || isa > best)
+		isa = (isa == PCM_ISA_AUTO) ? best : PCM_ISA_SCALAR;
+	_pcm_isa = isa;
+	return isa;
+}
+
+/** Convert samples.
+samples: N of samples (frames * channels)
+dither: (optional) apply TPDF dither when converting float to int16/int24
+Return 0 on success */
+static inline int pcm_convert(unsigned ofmt, void *dst, unsigned ifmt, const void *src, size_t samples, pcm_dither *dither)
+{
+	if (ofmt > PCM_F32 || ifmt > PCM_F32)
+		return -1;
+	if (_pcm_isa == PCM_ISA_AUTO)
+		pcm_convert_isa(PCM_ISA_AUTO);
+
+	const _pcm_conv_func (*table)[4] = _pcm_conv_scalar_table;
+#ifdef PCM_X86
+	if (_pcm_isa == PCM_ISA_AVX2)
+		table = _pcm_conv_avx2_table;
+	else if (_pcm_isa == PCM_ISA_SSE2)
+		table = _pcm_conv_sse2_table;
+#endif
+	table[ofmt][ifmt](dst, src, samples, dither);
+	return 0;
+}
@@ -0,0 +1,284 @@
+/** Audio API Quick Start Guide: Click-free volume and mute (for sample code only)
+A control thread changes the parameters (gain, mute, ramp length and shape) at any time by publishing them into pcm_gain_ctl;
+ the audio thread checks for new parameters once per period (pcm_gain_process())
+ and moves from the current gain to the new one with a per-sample ramp, so there are no clicks or zipper noise.
+pcm_gain_ctl is a seqlock: the writer never waits for the reader, and the reader never waits for the writer -
+ if it sees an update in progress it keeps the old parameters until the next period.
+A ramp is either linear (good for fading in and out of silence)
+ or exponential (equal steps in dB: sounds smooth for volume changes).
+As in pcm-meter.h, interleaved samples are processed in blocks of 4 frames:
+ within a block each vector position has a fixed frame offset, so the gains for a vector
+ are computed with one operation from the block's gain and a per-position table.
+int16 and float32 data is processed with SSE2 instructions, int24 and int32 data with scalar code. */
+
+#pragma once
+#include "pcm-convert.h"
+#include <stdatomic.h>
+#ifdef __SSE2__
+	#define PCM_GAIN_SSE2
+#endif
+
+#define PCM_GAIN_MAXCH  32
+#define PCM_GAIN_MAX  16.f // +24dB
+#define PCM_GAIN_FLOOR  0.0001f // -80dB: start/end of an exponential ramp from/to silence
+
+enum PCM_RAMP {
+	PCM_RAMP_LINEAR,
+	PCM_RAMP_EXP,
+};
+
+typedef struct {
+	float gain; // linear gain (1.0: no change)
+	int mute;
+	unsigned ramp_ms; // time to reach the new gain
+	unsigned shape; // enum PCM_RAMP
+} pcm_gain_params;
+
+/** Parameters slot shared between the control thread (the only writer) and the audio thread */
+typedef struct {
+	_Atomic unsigned seq; // odd while an update is in progress
+	_Atomic float gain;
+	_Atomic int mute;
+	_Atomic unsigned ramp_ms, shape;
+} pcm_gain_ctl;
+
+/** Publish new parameters.  Must be called from one thread only. */
+static inline void pcm_gain_ctl_set(pcm_gain_ctl *c, const pcm_gain_params *p)
+{
+	unsigned seq = atomic_load_explicit(&c->seq, memory_order_relaxed);
+	atomic_store_explicit(&c->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	float gain = p->gain;
+	if (gain > PCM_GAIN_MAX)
+		gain = PCM_GAIN_MAX;
+	else if (!(gain >= 0))
+		gain = 0;
+	atomic_store_explicit(&c->gain, gain, memory_order_relaxed);
+	atomic_store_explicit(&c->mute, p->mute, memory_order_relaxed);
+	atomic_store_explicit(&c->ramp_ms, p->ramp_ms, memory_order_relaxed);
+	atomic_store_explicit(&c->shape, p->shape, memory_order_relaxed);
+
+	atomic_store_explicit(&c->seq, seq + 2, memory_order_release);
+}
+
+static inline void pcm_gain_ctl_init(pcm_gain_ctl *c, const pcm_gain_params *p)
+{
+	atomic_init(&c->seq, 0);
+	pcm_gain_ctl_set(c, p);
+}
+
+/** Read the parameters without waiting.
+seq: [output] version of the parameters
+Return 0 on success;  -1 if an update is in progress */
+static inline int pcm_gain_ctl_get(pcm_gain_ctl *c, pcm_gain_params *p, unsigned *seq)
+{
+	unsigned s = atomic_load_explicit(&c->seq, memory_order_acquire);
+	if (s & 1)
+		return -1;
+
+	p->gain = atomic_load_explicit(&c->gain, memory_order_relaxed);
+	p->mute = atomic_load_explicit(&c->mute, memory_order_relaxed);
+	p->ramp_ms = atomic_load_explicit(&c->ramp_ms, memory_order_relaxed);
+	p->shape = atomic_load_explicit(&c->shape, memory_order_relaxed);
+
+	// The writer has started another update while we were reading
+	atomic_thread_fence(memory_order_acquire);
+	if (s != atomic_load_explicit(&c->seq, memory_order_relaxed))
+		return -1;
+
+	*seq = s;
+	return 0;
+}
+
+
+/** Gain stage state: used by the audio thread only */
+typedef struct {
+	pcm_gain_ctl *ctl;
+	unsigned seq; // version of the applied parameters
+	unsigned fmt, channels, rate;
+
+	float cur; // gain of the next frame
+	float target;
+	size_t remain; // frames until the target is reached;  0: constant gain
+	unsigned shape;
+	float step; // linear: gain increment per frame;  exponential: gain factor per frame
+	float block_step; // the same per block of 4 frames
+
+	// Gain of each vector position within a block of 4 frames, relative to the gain of the block:
+	//  linear: cur + voff[k][j];  exponential: cur * voff[k][j]
+	float voff[PCM_GAIN_MAXCH][4];
+} pcm_gain;
+
+/** Start a ramp from the current gain to the new target */
+static inline void _pcm_gain_ramp(pcm_gain *g, const pcm_gain_params *p)
+{
+	g->target = (p->mute) ? 0 : p->gain;
+	g->shape = p->shape;
+	g->remain = (size_t)p->ramp_ms * g->rate / 1000;
+	if (g->remain == 0 || g->cur == g->target) {
+		g->cur = g->target;
+		g->remain = 0;
+		return;
+	}
+
+	float pos[4]; // step applied N times
+	if (g->shape == PCM_RAMP_EXP) {
+		float from = (g->cur > PCM_GAIN_FLOOR) ? g->cur : PCM_GAIN_FLOOR;
+		float to = (g->target > PCM_GAIN_FLOOR) ? g->target : PCM_GAIN_FLOOR;
+		g->cur = from;
+		g->step = expf(logf(to / from) / g->remain);
+		pos[0] = 1;
+		for (unsigned i = 1;  i < 4;  i++)
+			pos[i] = pos[i - 1] * g->step;
+		g->block_step = pos[3] * g->step;
+	} else {
+		g->step = (g->target - g->cur) / g->remain;
+		for (unsigned i = 0;  i < 4;  i++)
+			pos[i] = g->step * i;
+		g->block_step = g->step * 4;
+	}
+
+	// Sample #j of vector #k within a block belongs to frame #((k*4 + j) / C)
+	for (unsigned k = 0;  k < g->channels;  k++) {
+		for (unsigned j = 0;  j < 4;  j++) {
+			g->voff[k][j] = pos[(k * 4 + j) / g->channels];
+		}
+	}
+}
+
+/**
+ctl: parameters slot;  the initial gain is applied immediately, without a ramp
+fmt: enum PCM_FMT
+Return 0 on success */
+static inline int pcm_gain_init(pcm_gain *g, pcm_gain_ctl *ctl, unsigned fmt, unsigned channels, unsigned rate)
+{
+	if (channels == 0 || channels > PCM_GAIN_MAXCH || fmt > PCM_F32)
+		return -1;
+	g->ctl = ctl;
+	g->fmt = fmt;
+	g->channels = channels;
+	g->rate = rate;
+	g->cur = 1;
+
+	pcm_gain_params p;
+	while (0 != pcm_gain_ctl_get(ctl, &p, &g->seq)) {
+	}
+	p.ramp_ms = 0;
+	_pcm_gain_ramp(g, &p);
+	return 0;
+}
+
+static inline __attribute__((always_inline)) void _pcm_gain_sample(void *data, size_t i, float gain, const unsigned fmt)
+{
+	if (fmt == PCM_F32) {
+		((float*)data)[i] *= gain;
+		return;
+	}
+	float v = (float)_pcm_load_i32(data, i, fmt) * (1.f / 2147483648.f) * gain;
+	_pcm_store_i32(data, i, _pcm_f32_to_i32(v, NULL, fmt), fmt);
+}
+
+#ifdef PCM_GAIN_SSE2
+
+/** Multiply 4 samples by 4 gains.  int16 result saturates. */
+static inline __attribute__((always_inline)) void _pcm_gain_vec_sse2(void *data, size_t i, __m128 gain, const unsigned fmt)
+{
+	if (fmt == PCM_S16) {
+		__m128i *p = (__m128i*)((int16_t*)data + i);
+		__m128i x = _mm_loadl_epi64(p);
+		x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		x = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(x), gain));
+		_mm_storel_epi64(p, _mm_packs_epi32(x, x));
+		return;
+	}
+	float *p = (float*)data + i;
+	_mm_storeu_ps(p, _mm_mul_ps(_mm_loadu_ps(p), gain));
+}
+
+/** Apply the ramp to whole blocks of 4 frames.
+Return N of frames processed */
+static inline __attribute__((always_inline)) size_t _pcm_gain_ramp_sse2(pcm_gain *g, void *data, size_t frames, const unsigned fmt)
+{
+	const unsigned C = g->channels;
+	size_t blocks = frames / 4;
+	float cur = g->cur;
+	for (size_t b = 0;  b < blocks;  b++) {
+		__m128 c = _mm_set1_ps(cur);
+		for (unsigned k = 0;  k < C;  k++) {
+			__m128 off = _mm_loadu_ps(g->voff[k]);
+			__m128 gain = (g->shape == PCM_RAMP_EXP) ? _mm_mul_ps(c, off) : _mm_add_ps(c, off);
+			_pcm_gain_vec_sse2(data, (b * C + k) * 4, gain, fmt);
+		}
+		cur = (g->shape == PCM_RAMP_EXP) ? cur * g->block_step : cur + g->block_step;
+	}
+	g->cur = cur;
+	return blocks * 4;
+}
+
+#endif
+
+static inline __attribute__((always_inline)) void _pcm_gain_process(pcm_gain *g, void *data, size_t frames, const unsigned fmt)
+{
+	const unsigned C = g->channels;
+	size_t i = 0;
+
+	if (g->remain != 0) {
+		size_t n = (frames < g->remain) ? frames : g->remain;
+#ifdef PCM_GAIN_SSE2
+		if (fmt == PCM_S16 || fmt == PCM_F32)
+			i = _pcm_gain_ramp_sse2(g, data, n, fmt);
+#endif
+		for (;  i < n;  i++) {
+			for (unsigned c = 0;  c < C;  c++) {
+				_pcm_gain_sample(data, i * C + c, g->cur, fmt);
+			}
+			g->cur = (g->shape == PCM_RAMP_EXP) ? g->cur * g->step : g->cur + g->step;
+		}
+
+		g->remain -= n;
+		if (g->remain == 0)
+			g->cur = g->target; // remove the accumulated rounding error
+	}
+
+	if (i == frames || g->cur == 1)
+		return;
+
+	// Constant gain: the frame layout doesn't matter
+	size_t s = i * C, n = frames * C;
+#ifdef PCM_GAIN_SSE2
+	if (fmt == PCM_S16 || fmt == PCM_F32) {
+		__m128 gain = _mm_set1_ps(g->cur);
+		for (;  s + 4 <= n;  s += 4) {
+			_pcm_gain_vec_sse2(data, s, gain, fmt);
+		}
+	}
+#endif
+	for (;  s < n;  s++) {
+		_pcm_gain_sample(data, s, g->cur, fmt);
+	}
+}
+
+/** Apply gain to interleaved audio data in place.
+Picks up new parameters published by the control thread:
+ call once per period so that a parameter change takes effect at most 1 period later. */
+static inline void pcm_gain_process(pcm_gain *g, void *data, size_t frames)
+{
+	// Fast path: a single atomic load if nothing has changed
+	if (atomic_load_explicit(&g->ctl->seq, memory_order_relaxed) != g->seq) {
+		pcm_gain_params p;
+		if (0 == pcm_gain_ctl_get(g->ctl, &p, &g->seq))
+			_pcm_gain_ramp(g, &p);
+	}
+
+	switch (g->fmt) {
+	case PCM_S16:
+		_pcm_gain_process(g, data, frames, PCM_S16); break;
+	case PCM_S24:
+		_pcm_gain_process(g, data, frames, PCM_S24); break;
+	case PCM_S32:
+		_pcm_gain_process(g, data, frames, PCM_S32); break;
+	case PCM_F32:
+		_pcm_gain_process(g, data, frames, PCM_F32); break;
+	}
+}
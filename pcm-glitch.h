@@ -0,0 +1,203 @@
+/** Audio API Quick Start Guide: Glitch detector (for sample code only)
+The test signal is a frame counter embedded in int16 samples (at least 2 channels):
+ channel 0 holds bits 0..15 of the counter, channel 1 holds bits 16..23 and an 8-bit check value,
+ the other channels are silent.
+The checker follows the counter and reports every discontinuity:
+ missing frames (the counter jumps forward), repeated frames (it jumps back)
+ and invalid frames (silence or noise inserted into the stream, e.g. after an underrun).
+The check value is only 8 bits, so 1 in 256 noise frames looks valid:
+ a jump is accepted only after PCM_GLITCH_CONFIRM valid frames with consecutive counter values,
+ otherwise these frames are just invalid data.
+The signal is not for listening: it's a full-scale sawtooth. */
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PCM_GLITCH_BITS  24
+#define PCM_GLITCH_MASK  ((1U << PCM_GLITCH_BITS) - 1)
+#define PCM_GLITCH_CONFIRM  4
+
+/** Local time "HH:MM:SS.mmm" for the log messages,
+ so the events reported by the different processes can be matched with each other.
+buf: at least 16 bytes */
+static inline const char* pcm_glitch_time(char *buf)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct tm tm;
+	localtime_r(&ts.tv_sec, &tm);
+	snprintf(buf, 16, "%02u:%02u:%02u.%03u"
+		, tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned)(ts.tv_nsec / 1000000));
+	return buf;
+}
+
+static inline unsigned _pcm_glitch_check_value(uint32_t counter)
+{
+	return (counter ^ (counter >> 8) ^ (counter >> 16) ^ 0xa5) & 0xff;
+}
+
+/** Generate test signal
+counter: the counter value of the first frame
+Return the counter value of the next frame */
+static inline uint32_t pcm_glitch_fill(int16_t *dst, size_t frames, unsigned channels, uint32_t counter)
+{
+	for (size_t i = 0;  i < frames;  i++) {
+		counter &= PCM_GLITCH_MASK;
+		dst[0] = (int16_t)(counter & 0xffff);
+		dst[1] = (int16_t)(((counter >> 16) << 8) | _pcm_glitch_check_value(counter));
+		for (unsigned c = 2;  c < channels;  c++) {
+			dst[c] = 0;
+		}
+		dst += channels;
+		counter++;
+	}
+	return counter;
+}
+
+typedef struct {
+	unsigned channels, rate;
+	FILE *log;
+
+	int locked; // the signal has been found
+	uint32_t expect; // the counter value of the next frame
+	uint64_t pos; // frames processed
+	uint64_t bad_pos, bad; // the current run of invalid frames
+	uint32_t cand, cand_next; // the counter value at which the signal may have resumed;  the next expected value
+	uint64_t cand_pos, cand_n; // frames since then (not confirmed yet)
+
+	// Totals
+	unsigned glitches;
+	uint64_t frames_ok, missing, repeated, invalid;
+} pcm_glitch_check;
+
+/**
+rate: only for the stream positions in the messages
+log: where to print the events
+Return 0 on success */
+static inline int pcm_glitch_check_init(pcm_glitch_check *g, unsigned channels, unsigned rate, FILE *log)
+{
+	if (channels < 2 || rate == 0)
+		return -1;
+	memset(g, 0, sizeof(*g));
+	g->channels = channels;
+	g->rate = rate;
+	g->log = log;
+	return 0;
+}
+
+static inline void _pcm_glitch_event(pcm_glitch_check *g, uint64_t pos, const char *msg, uint64_t frames)
+{
+	char ts[16];
+	fprintf(g->log, "%s: stream %.3fs: %s: %llu frames\n"
+		, pcm_glitch_time(ts), (double)pos / g->rate, msg, (unsigned long long)frames);
+}
+
+/** Add 'n' frames starting at 'pos' to the current run of invalid frames */
+static inline void _pcm_glitch_bad(pcm_glitch_check *g, uint64_t pos, uint64_t n)
+{
+	// Before the signal is found, it's just the leading silence
+	if (!g->locked || n == 0)
+		return;
+	if (g->bad == 0)
+		g->bad_pos = pos;
+	g->bad += n;
+}
+
+/** The unconfirmed frames turned out to be invalid data */
+static inline void _pcm_glitch_cand_drop(pcm_glitch_check *g)
+{
+	_pcm_glitch_bad(g, g->cand_pos, g->cand_n);
+	g->cand_n = 0;
+}
+
+/** The signal has resumed after some silence or noise */
+static inline void _pcm_glitch_resume(pcm_glitch_check *g)
+{
+	if (g->bad != 0) {
+		_pcm_glitch_event(g, g->bad_pos, "invalid data", g->bad);
+		g->glitches++;
+		g->invalid += g->bad;
+		g->bad = 0;
+	}
+}
+
+/** Check the next block of interleaved int16 data and print the glitches found in it */
+static inline void pcm_glitch_check_update(pcm_glitch_check *g, const int16_t *data, size_t frames)
+{
+	for (size_t i = 0;  i < frames;  i++, data += g->channels) {
+		uint32_t lo = (uint16_t)data[0], hi = (uint16_t)data[1];
+		uint32_t counter = lo | ((hi >> 8) << 16);
+		uint64_t pos = g->pos++;
+
+		if ((hi & 0xff) != _pcm_glitch_check_value(counter)) {
+			_pcm_glitch_cand_drop(g);
+			_pcm_glitch_bad(g, pos, 1);
+			continue;
+		}
+
+		// Not the value we expect: the signal may have started or jumped, or it's noise that looks valid.
+		// A candidate is followed first: after a short repeat it reaches the expected value again.
+		if (g->cand_n != 0 && counter == g->cand_next) {
+			g->cand_n++;
+		} else if (g->locked && counter == g->expect) {
+			_pcm_glitch_cand_drop(g);
+			_pcm_glitch_resume(g);
+			g->frames_ok++;
+			g->expect = (counter + 1) & PCM_GLITCH_MASK;
+			continue;
+		} else {
+			_pcm_glitch_cand_drop(g);
+			g->cand = counter;
+			g->cand_pos = pos;
+			g->cand_n = 1;
+		}
+		g->cand_next = (counter + 1) & PCM_GLITCH_MASK;
+		if (g->cand_n < PCM_GLITCH_CONFIRM)
+			continue;
+
+		// Confirmed
+		g->frames_ok += g->cand_n;
+		g->cand_n = 0;
+		uint32_t expect = g->expect;
+		g->expect = g->cand_next;
+
+		if (!g->locked) {
+			g->locked = 1;
+			_pcm_glitch_event(g, g->cand_pos, "signal found after", g->cand_pos);
+			continue;
+		}
+
+		_pcm_glitch_resume(g);
+		uint32_t d = (g->cand - expect) & PCM_GLITCH_MASK;
+		if (d < PCM_GLITCH_MASK / 2) {
+			_pcm_glitch_event(g, g->cand_pos, "missing", d);
+			g->glitches++;
+			g->missing += d;
+
+		} else {
+			d = (expect - g->cand) & PCM_GLITCH_MASK;
+			_pcm_glitch_event(g, g->cand_pos, "repeated", d);
+			g->glitches++;
+			g->repeated += d;
+		}
+	}
+}
+
+/** Print the totals.
+The invalid data after the last valid frame is the end of the signal and isn't a glitch.
+Return the number of glitches */
+static inline unsigned pcm_glitch_check_print(const pcm_glitch_check *g, FILE *f)
+{
+	if (!g->locked) {
+		fprintf(f, "No test signal found in %llu frames\n", (unsigned long long)g->pos);
+		return g->glitches;
+	}
+	fprintf(f, "Glitches: %u;  frames: %llu valid, %llu missing, %llu repeated, %llu invalid\n"
+		, g->glitches
+		, (unsigned long long)g->frames_ok, (unsigned long long)g->missing
+		, (unsigned long long)g->repeated, (unsigned long long)g->invalid);
+	return g->glitches;
+}
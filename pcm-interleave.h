@@ -0,0 +1,261 @@
+/** Audio API Quick Start Guide: Interleave/deinterleave audio data (for sample code only)
+Converts between non-interleaved (planar: one buffer per channel) and interleaved audio data.
+The interleaved side may be a device buffer (e.g. ALSA mmap area), so no intermediate buffer is needed.
+16-bit and 32-bit samples are processed 4 frames at a time with SSE2:
+ channels are split into groups of 4 (4x4 transpose), then a pair (2x4) and a single channel.
+Other sample sizes and non-x86 CPUs use the scalar code. */
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+	#include <emmintrin.h>
+	#define PCM_INTERLEAVE_SSE2
+#endif
+
+static inline __attribute__((always_inline)) void _pcm_copy_sample(void *dst, const void *src, const unsigned sample_size)
+{
+	switch (sample_size) {
+	case 2:
+		*(uint16_t*)dst = *(const uint16_t*)src; break;
+	case 4:
+		*(uint32_t*)dst = *(const uint32_t*)src; break;
+	default:
+		memcpy(dst, src, sample_size);
+	}
+}
+
+/** Scalar code for frames [i..n) */
+static inline __attribute__((always_inline)) void _pcm_interleave_scalar(void *dst, const void *const *src, unsigned channels, size_t i, size_t n, const unsigned sample_size)
+{
+	char *d = (char*)dst + i * channels * sample_size;
+	for (;  i < n;  i++) {
+		for (unsigned c = 0;  c < channels;  c++) {
+			_pcm_copy_sample(d, (const char*)src[c] + i * sample_size, sample_size);
+			d += sample_size;
+		}
+	}
+}
+
+static inline __attribute__((always_inline)) void _pcm_deinterleave_scalar(void *const *dst, const void *src, unsigned channels, size_t i, size_t n, const unsigned sample_size)
+{
+	const char *s = (const char*)src + i * channels * sample_size;
+	for (;  i < n;  i++) {
+		for (unsigned c = 0;  c < channels;  c++) {
+			_pcm_copy_sample((char*)dst[c] + i * sample_size, s, sample_size);
+			s += sample_size;
+		}
+	}
+}
+
+#ifdef PCM_INTERLEAVE_SSE2
+
+/** 4 frames of 32-bit samples */
+static inline void _pcm_interleave32_sse2(char *d, const void *const *src, unsigned channels, size_t i)
+{
+	size_t stride = channels * 4;
+	unsigned c = 0;
+	for (;  c + 4 <= channels;  c += 4) {
+		__m128 a = _mm_loadu_ps((const float*)src[c] + i);
+		__m128 b = _mm_loadu_ps((const float*)src[c + 1] + i);
+		__m128 e = _mm_loadu_ps((const float*)src[c + 2] + i);
+		__m128 f = _mm_loadu_ps((const float*)src[c + 3] + i);
+		_MM_TRANSPOSE4_PS(a, b, e, f);
+		_mm_storeu_ps((float*)(d + c * 4), a);
+		_mm_storeu_ps((float*)(d + stride + c * 4), b);
+		_mm_storeu_ps((float*)(d + stride * 2 + c * 4), e);
+		_mm_storeu_ps((float*)(d + stride * 3 + c * 4), f);
+	}
+	if (c + 2 <= channels) {
+		__m128 a = _mm_loadu_ps((const float*)src[c] + i);
+		__m128 b = _mm_loadu_ps((const float*)src[c + 1] + i);
+		__m128 lo = _mm_unpacklo_ps(a, b), hi = _mm_unpackhi_ps(a, b);
+		_mm_storel_pi((__m64*)(d + c * 4), lo);
+		_mm_storeh_pi((__m64*)(d + stride + c * 4), lo);
+		_mm_storel_pi((__m64*)(d + stride * 2 + c * 4), hi);
+		_mm_storeh_pi((__m64*)(d + stride * 3 + c * 4), hi);
+		c += 2;
+	}
+	if (c < channels) {
+		const uint32_t *s = (const uint32_t*)src[c] + i;
+		for (unsigned k = 0;  k < 4;  k++) {
+			*(uint32_t*)(d + stride * k + c * 4) = s[k];
+		}
+	}
+}
+
+static inline void _pcm_deinterleave32_sse2(void *const *dst, const char *s, unsigned channels, size_t i)
+{
+	size_t stride = channels * 4;
+	unsigned c = 0;
+	for (;  c + 4 <= channels;  c += 4) {
+		__m128 a = _mm_loadu_ps((const float*)(s + c * 4));
+		__m128 b = _mm_loadu_ps((const float*)(s + stride + c * 4));
+		__m128 e = _mm_loadu_ps((const float*)(s + stride * 2 + c * 4));
+		__m128 f = _mm_loadu_ps((const float*)(s + stride * 3 + c * 4));
+		_MM_TRANSPOSE4_PS(a, b, e, f);
+		_mm_storeu_ps((float*)dst[c] + i, a);
+		_mm_storeu_ps((float*)dst[c + 1] + i, b);
+		_mm_storeu_ps((float*)dst[c + 2] + i, e);
+		_mm_storeu_ps((float*)dst[c + 3] + i, f);
+	}
+	if (c + 2 <= channels) {
+		// a: L0 R0 L1 R1;  b: L2 R2 L3 R3
+		__m128 a = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(s + c * 4)), (const __m64*)(s + stride + c * 4));
+		__m128 b = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(s + stride * 2 + c * 4)), (const __m64*)(s + stride * 3 + c * 4));
+		_mm_storeu_ps((float*)dst[c] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps((float*)dst[c + 1] + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+		c += 2;
+	}
+	if (c < channels) {
+		uint32_t *d = (uint32_t*)dst[c] + i;
+		for (unsigned k = 0;  k < 4;  k++) {
+			d[k] = *(const uint32_t*)(s + stride * k + c * 4);
+		}
+	}
+}
+
+/** 4 frames of 16-bit samples */
+static inline void _pcm_interleave16_sse2(char *d, const void *const *src, unsigned channels, size_t i)
+{
+	size_t stride = channels * 2;
+	unsigned c = 0;
+	for (;  c + 4 <= channels;  c += 4) {
+		__m128i a = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c] + i));
+		__m128i b = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c + 1] + i));
+		__m128i e = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c + 2] + i));
+		__m128i f = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c + 3] + i));
+		__m128i ab = _mm_unpacklo_epi16(a, b), ef = _mm_unpacklo_epi16(e, f);
+		__m128i lo = _mm_unpacklo_epi32(ab, ef), hi = _mm_unpackhi_epi32(ab, ef);
+		_mm_storel_epi64((__m128i*)(d + c * 2), lo);
+		_mm_storel_epi64((__m128i*)(d + stride + c * 2), _mm_srli_si128(lo, 8));
+		_mm_storel_epi64((__m128i*)(d + stride * 2 + c * 2), hi);
+		_mm_storel_epi64((__m128i*)(d + stride * 3 + c * 2), _mm_srli_si128(hi, 8));
+	}
+	if (c + 2 <= channels) {
+		__m128i a = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c] + i));
+		__m128i b = _mm_loadl_epi64((const __m128i*)((const int16_t*)src[c + 1] + i));
+		__m128i ab = _mm_unpacklo_epi16(a, b);
+		for (unsigned k = 0;  k < 4;  k++) {
+			*(uint32_t*)(d + stride * k + c * 2) = _mm_cvtsi128_si32(ab);
+			ab = _mm_srli_si128(ab, 4);
+		}
+		c += 2;
+	}
+	if (c < channels) {
+		const uint16_t *s = (const uint16_t*)src[c] + i;
+		for (unsigned k = 0;  k < 4;  k++) {
+			*(uint16_t*)(d + stride * k + c * 2) = s[k];
+		}
+	}
+}
+
+static inline void _pcm_deinterleave16_sse2(void *const *dst, const char *s, unsigned channels, size_t i)
+{
+	size_t stride = channels * 2;
+	unsigned c = 0;
+	for (;  c + 4 <= channels;  c += 4) {
+		// Gather 4 frames x 4 channels, then transpose
+		__m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(s + c * 2))
+			, _mm_loadl_epi64((const __m128i*)(s + stride + c * 2)));
+		__m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(s + stride * 2 + c * 2))
+			, _mm_loadl_epi64((const __m128i*)(s + stride * 3 + c * 2)));
+		// lo: a0 b0 e0 f0 a1 b1 e1 f1;  hi: a2 b2 e2 f2 a3 b3 e3 f3
+		__m128i t0 = _mm_unpacklo_epi16(lo, hi); // a0 a2 b0 b2 e0 e2 f0 f2
+		__m128i t1 = _mm_unpackhi_epi16(lo, hi); // a1 a3 b1 b3 e1 e3 f1 f3
+		__m128i u0 = _mm_unpacklo_epi16(t0, t1); // a0 a1 a2 a3 b0 b1 b2 b3
+		__m128i u1 = _mm_unpackhi_epi16(t0, t1); // e0 e1 e2 e3 f0 f1 f2 f3
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c] + i), u0);
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c + 1] + i), _mm_srli_si128(u0, 8));
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c + 2] + i), u1);
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c + 3] + i), _mm_srli_si128(u1, 8));
+	}
+	if (c + 2 <= channels) {
+		__m128i x = _mm_setr_epi32(*(const int32_t*)(s + c * 2), *(const int32_t*)(s + stride + c * 2)
+			, *(const int32_t*)(s + stride * 2 + c * 2), *(const int32_t*)(s + stride * 3 + c * 2));
+		// x: a0 b0 a1 b1 a2 b2 a3 b3
+		x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+		x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+		x = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 1, 2, 0));
+		// x: a0 a1 a2 a3 b0 b1 b2 b3
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c] + i), x);
+		_mm_storel_epi64((__m128i*)((int16_t*)dst[c + 1] + i), _mm_srli_si128(x, 8));
+		c += 2;
+	}
+	if (c < channels) {
+		uint16_t *d = (uint16_t*)dst[c] + i;
+		for (unsigned k = 0;  k < 4;  k++) {
+			d[k] = *(const uint16_t*)(s + stride * k + c * 2);
+		}
+	}
+}
+
+#endif
+
+/** Interleave audio data.
+dst: interleaved buffer, e.g. device buffer region
+src: array of 'channels' pointers to planar buffers
+sample_size: sample size in bytes (sample width / 8) */
+static inline void pcm_interleave(void *dst, const void *const *src, unsigned channels, size_t frames, unsigned sample_size)
+{
+	if (channels == 1) {
+		memcpy(dst, src[0], frames * sample_size);
+		return;
+	}
+
+	size_t i = 0;
+#ifdef PCM_INTERLEAVE_SSE2
+	if (sample_size == 4) {
+		for (;  i + 4 <= frames;  i += 4) {
+			_pcm_interleave32_sse2((char*)dst + i * channels * 4, src, channels, i);
+		}
+	} else if (sample_size == 2) {
+		for (;  i + 4 <= frames;  i += 4) {
+			_pcm_interleave16_sse2((char*)dst + i * channels * 2, src, channels, i);
+		}
+	}
+#endif
+
+	switch (sample_size) {
+	case 2:
+		_pcm_interleave_scalar(dst, src, channels, i, frames, 2); break;
+	case 4:
+		_pcm_interleave_scalar(dst, src, channels, i, frames, 4); break;
+	default:
+		_pcm_interleave_scalar(dst, src, channels, i, frames, sample_size);
+	}
+}
+
+/** Deinterleave audio data.
+dst: array of 'channels' pointers to planar buffers
+src: interleaved buffer, e.g. device buffer region
+sample_size: sample size in bytes (sample width / 8) */
+static inline void pcm_deinterleave(void *const *dst, const void *src, unsigned channels, size_t frames, unsigned sample_size)
+{
+	if (channels == 1) {
+		memcpy(dst[0], src, frames * sample_size);
+		return;
+	}
+
+	size_t i = 0;
+#ifdef PCM_INTERLEAVE_SSE2
+	if (sample_size == 4) {
+		for (;  i + 4 <= frames;  i += 4) {
+			_pcm_deinterleave32_sse2(dst, (const char*)src + i * channels * 4, channels, i);
+		}
+	} else if (sample_size == 2) {
+		for (;  i + 4 <= frames;  i += 4) {
+			_pcm_deinterleave16_sse2(dst, (const char*)src + i * channels * 2, channels, i);
+		}
+	}
+#endif
+
+	switch (sample_size) {
+	case 2:
+		_pcm_deinterleave_scalar(dst, src, channels, i, frames, 2); break;
+	case 4:
+		_pcm_deinterleave_scalar(dst, src, channels, i, frames, 4); break;
+	default:
+		_pcm_deinterleave_scalar(dst, src, channels, i, frames, sample_size);
+	}
+}
@@ -0,0 +1,105 @@
+/** Audio API Quick Start Guide: Peak/RMS level meter benchmark
+Checks the meter against straightforward code using log10(),
+ then measures CPU load of metering a real-time stream.
+Usage: pcm-meter-bench [CHANNELS] [SAMPLE_RATE] [SECONDS]
+Link with -lm */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "pcm-meter.h"
+
+static void fill(unsigned fmt, void *buf, size_t frames, unsigned channels)
+{
+	uint32_t x = 1;
+	for (size_t i = 0;  i < frames;  i++) {
+		for (unsigned c = 0;  c < channels;  c++) {
+			x = x * 1664525 + 1013904223;
+			// Each channel has its own level
+			float v = (int32_t)x * (1.f / 2147483648.f) / (1 << c);
+			size_t k = i * channels + c;
+			if (fmt == PCM_F32)
+				((float*)buf)[k] = v;
+			else
+				_pcm_store_i32(buf, k, (int32_t)(v * 2147483647.f), fmt);
+		}
+	}
+}
+
+static void check(unsigned fmt, unsigned channels, size_t frames)
+{
+	void *buf = malloc(frames * channels * 4);
+	fill(fmt, buf, frames, channels);
+
+	pcm_meter m;
+	assert(0 == pcm_meter_init(&m, fmt, channels, frames));
+	// Feed the data in chunks of different sizes
+	for (size_t i = 0, n = 1;  i < frames;  i += n, n = n * 3 + 1) {
+		if (n > frames - i)
+			n = frames - i;
+		pcm_meter_update(&m, (char*)buf + i * channels * pcm_fmt_size(fmt), n);
+	}
+
+	float peak[PCM_METER_MAXCH], rms[PCM_METER_MAXCH];
+	pcm_meter_get(&m, peak, rms);
+
+	for (unsigned c = 0;  c < channels;  c++) {
+		double p = 0, sum = 0;
+		for (size_t i = 0;  i < frames;  i++) {
+			double v = _pcm_meter_sample(buf, i * channels + c, fmt);
+			if (p < fabs(v))
+				p = fabs(v);
+			sum += v * v;
+		}
+		double peak_db = 20 * log10(p), rms_db = 20 * log10(sqrt(sum / frames));
+		if (fabs(peak_db - peak[c]) > 0.01 || fabs(rms_db - rms[c]) > 0.01) {
+			printf("MISMATCH: %s, %u channels, %zu frames, channel #%u: peak %f/%f  rms %f/%f\n"
+				, pcm_fmt_name(fmt), channels, frames, c, peak[c], peak_db, rms[c], rms_db);
+			exit(1);
+		}
+	}
+	free(buf);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned channels = (argc > 1) ? strtoul(argv[1], NULL, 10) : 8;
+	unsigned rate = (argc > 2) ? strtoul(argv[2], NULL, 10) : 192000;
+	unsigned seconds = (argc > 3) ? strtoul(argv[3], NULL, 10) : 60;
+	assert(channels != 0 && channels <= PCM_METER_MAXCH);
+
+	for (unsigned fmt = PCM_S16;  fmt <= PCM_F32;  fmt++) {
+		for (unsigned ch = 1;  ch <= 9;  ch++) {
+			check(fmt, ch, 1);
+			check(fmt, ch, 1001);
+			check(fmt, ch, 48000);
+		}
+	}
+	printf("Meter values match log10() within 0.01dB\n\n");
+
+	// 10ms chunks, like a capture loop receives them
+	size_t chunk = rate / 100;
+	printf("CPU load for %u channels @ %uHz, %u seconds of audio:\n", channels, rate, seconds);
+	for (unsigned fmt = PCM_S16;  fmt <= PCM_F32;  fmt++) {
+		void *buf = malloc(chunk * channels * 4);
+		fill(fmt, buf, chunk, channels);
+		pcm_meter m;
+		pcm_meter_init(&m, fmt, channels, rate);
+
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (size_t i = 0;  i < (size_t)seconds * 100;  i++) {
+			if (pcm_meter_update(&m, buf, chunk)) {
+				float peak[PCM_METER_MAXCH], rms[PCM_METER_MAXCH];
+				pcm_meter_get(&m, peak, rms);
+				pcm_meter_reset(&m);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+		printf("%-8s %.3f%%\n", pcm_fmt_name(fmt), sec / seconds * 100);
+		free(buf);
+	}
+	return 0;
+}
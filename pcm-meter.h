@@ -0,0 +1,227 @@
+/** Audio API Quick Start Guide: Peak/RMS level meter (for sample code only)
+Accumulates per-channel peak and RMS values of interleaved audio data as it passes through.
+Samples are processed in blocks of 4 frames: with 4-sample vectors every vector position within a block
+ always holds the same channels, so each position has its own accumulators
+ and they are folded into per-channel values only when the meter is read.
+dB values are computed once per report with an approximation of log10. */
+
+#pragma once
+#include "pcm-convert.h"
+#include <stdio.h>
+#ifdef __SSE2__
+	#define PCM_METER_SSE2
+#endif
+
+#define PCM_METER_MAXCH  32
+
+typedef struct {
+	unsigned fmt, channels;
+	size_t interval, frames; // report interval; frames processed since the last report
+
+	// Accumulators for each vector position within a block of 4 frames
+	float vpeak[PCM_METER_MAXCH][4];
+	double vsum[PCM_METER_MAXCH][4];
+
+	// Scalar accumulators for the frames not filling a whole block
+	float peak[PCM_METER_MAXCH];
+	double sum[PCM_METER_MAXCH];
+} pcm_meter;
+
+/** Fast log10(x), x > 0.  Max error is about 0.0002 (0.004dB). */
+static inline float pcm_log10f_fast(float x)
+{
+	union { float f; uint32_t i; } u = { x };
+	int e = (int)((u.i >> 23) & 0xff) - 127;
+	u.i = (u.i & 0x007fffff) | 0x3f800000; // mantissa: [1.0..2.0)
+	float m = u.f - 1;
+	float log2m = 0.00064184f + m * (1.41884813f + m * (-0.57708784f + m * 0.15824058f));
+	return (e + log2m) * 0.30103f;
+}
+
+/** Convert gain (0.0..1.0) to dB.
+Return -140.0 for silence. */
+static inline float pcm_gain_db(float gain)
+{
+	if (gain < 1e-7f)
+		return -140;
+	return 20 * pcm_log10f_fast(gain);
+}
+
+/** Reset accumulated values */
+static inline void pcm_meter_reset(pcm_meter *m)
+{
+	m->frames = 0;
+	memset(m->vpeak, 0, sizeof(m->vpeak));
+	memset(m->vsum, 0, sizeof(m->vsum));
+	memset(m->peak, 0, sizeof(m->peak));
+	memset(m->sum, 0, sizeof(m->sum));
+}
+
+/**
+fmt: enum PCM_FMT
+interval: report interval in frames (e.g. sample rate for 1 second)
+Return 0 on success */
+static inline int pcm_meter_init(pcm_meter *m, unsigned fmt, unsigned channels, size_t interval)
+{
+	if (channels == 0 || channels > PCM_METER_MAXCH || fmt > PCM_F32)
+		return -1;
+	m->fmt = fmt;
+	m->channels = channels;
+	m->interval = interval;
+	pcm_meter_reset(m);
+	return 0;
+}
+
+/** Normalized sample value */
+static inline __attribute__((always_inline)) float _pcm_meter_sample(const void *data, size_t i, const unsigned fmt)
+{
+	if (fmt == PCM_F32)
+		return ((const float*)data)[i];
+	return (float)_pcm_load_i32(data, i, fmt) * (1.f / 2147483648.f);
+}
+
+// Float sums are flushed into double accumulators after this number of blocks
+//  so that small values are not lost when adding them to a large sum
+#define _PCM_METER_FLUSH  256
+
+#ifdef PCM_METER_SSE2
+
+/** 4 normalized samples (int16, int32, float32) */
+static inline __attribute__((always_inline)) __m128 _pcm_meter_load_sse2(const void *data, size_t i, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16: {
+		__m128i x = _mm_loadl_epi64((const __m128i*)((const int16_t*)data + i));
+		x = _mm_unpacklo_epi16(_mm_setzero_si128(), x); // left-justify to int32
+		return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.f / 2147483648.f));
+	}
+	case PCM_S32: {
+		__m128i x = _mm_loadu_si128((const __m128i*)((const int32_t*)data + i));
+		return _mm_mul_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(1.f / 2147483648.f));
+	}
+	}
+	return _mm_loadu_ps((const float*)data + i);
+}
+
+/** Process whole blocks of 4 frames.
+Return N of frames processed */
+static inline __attribute__((always_inline)) size_t _pcm_meter_blocks_sse2(pcm_meter *m, const void *data, size_t frames, const unsigned fmt)
+{
+	const unsigned C = m->channels;
+	size_t blocks = frames / 4;
+	const __m128 sign = _mm_set1_ps(-0.f);
+
+	for (unsigned k = 0;  k < C;  k++) {
+		// Each vector position is processed separately so that only 2 accumulators are live
+		__m128 peak = _mm_loadu_ps(m->vpeak[k]);
+		__m128 sum = _mm_setzero_ps();
+		double dsum[4] = {};
+		unsigned nflush = 0;
+
+		for (size_t b = 0;  b < blocks;  b++) {
+			__m128 v = _pcm_meter_load_sse2(data, (b * C + k) * 4, fmt);
+			peak = _mm_max_ps(peak, _mm_andnot_ps(sign, v));
+			sum = _mm_add_ps(sum, _mm_mul_ps(v, v));
+			if (++nflush == _PCM_METER_FLUSH) {
+				float f[4];
+				_mm_storeu_ps(f, sum);
+				for (unsigned j = 0;  j < 4;  j++)
+					dsum[j] += f[j];
+				sum = _mm_setzero_ps();
+				nflush = 0;
+			}
+		}
+
+		float f[4];
+		_mm_storeu_ps(f, sum);
+		for (unsigned j = 0;  j < 4;  j++)
+			m->vsum[k][j] += dsum[j] + f[j];
+		_mm_storeu_ps(m->vpeak[k], peak);
+	}
+
+	return blocks * 4;
+}
+
+#endif
+
+static inline __attribute__((always_inline)) void _pcm_meter_update(pcm_meter *m, const void *data, size_t frames, const unsigned fmt)
+{
+	const unsigned C = m->channels;
+	size_t i = 0;
+#ifdef PCM_METER_SSE2
+	if (fmt != PCM_S24)
+		i = _pcm_meter_blocks_sse2(m, data, frames, fmt);
+#endif
+
+	for (;  i < frames;  i++) {
+		for (unsigned c = 0;  c < C;  c++) {
+			float v = _pcm_meter_sample(data, i * C + c, fmt);
+			float a = fabsf(v);
+			if (m->peak[c] < a)
+				m->peak[c] = a;
+			m->sum[c] += v * v;
+		}
+	}
+}
+
+/** Process interleaved audio data.
+Return 1 if the report interval has elapsed */
+static inline int pcm_meter_update(pcm_meter *m, const void *data, size_t frames)
+{
+	switch (m->fmt) {
+	case PCM_S16:
+		_pcm_meter_update(m, data, frames, PCM_S16); break;
+	case PCM_S24:
+		_pcm_meter_update(m, data, frames, PCM_S24); break;
+	case PCM_S32:
+		_pcm_meter_update(m, data, frames, PCM_S32); break;
+	case PCM_F32:
+		_pcm_meter_update(m, data, frames, PCM_F32); break;
+	}
+	m->frames += frames;
+	return (m->frames >= m->interval);
+}
+
+/** Get per-channel peak and RMS values (in dB) accumulated since the last reset.
+peak_db, rms_db: arrays of 'channels' elements */
+static inline void pcm_meter_get(const pcm_meter *m, float *peak_db, float *rms_db)
+{
+	const unsigned C = m->channels;
+	float peak[PCM_METER_MAXCH];
+	double sum[PCM_METER_MAXCH];
+	for (unsigned c = 0;  c < C;  c++) {
+		peak[c] = m->peak[c];
+		sum[c] = m->sum[c];
+	}
+
+	// Sample #j of vector #k within a block belongs to channel #((k*4 + j) % C)
+	for (unsigned k = 0;  k < C;  k++) {
+		for (unsigned j = 0;  j < 4;  j++) {
+			unsigned c = (k * 4 + j) % C;
+			if (peak[c] < m->vpeak[k][j])
+				peak[c] = m->vpeak[k][j];
+			sum[c] += m->vsum[k][j];
+		}
+	}
+
+	for (unsigned c = 0;  c < C;  c++) {
+		peak_db[c] = pcm_gain_db(peak[c]);
+		rms_db[c] = (m->frames != 0) ? pcm_gain_db(sqrt(sum[c] / m->frames)) : -140;
+	}
+}
+
+/** Print per-channel peak/RMS values and reset the meter */
+static inline void pcm_meter_print(pcm_meter *m, FILE *f)
+{
+	float peak[PCM_METER_MAXCH], rms[PCM_METER_MAXCH];
+	pcm_meter_get(m, peak, rms);
+
+	char buf[PCM_METER_MAXCH * 48];
+	size_t n = 0;
+	for (unsigned c = 0;  c < m->channels;  c++) {
+		n += snprintf(buf + n, sizeof(buf) - n, "%s#%u peak:%.1fdB rms:%.1fdB"
+			, (c != 0) ? "  " : "", c, peak[c], rms[c]);
+	}
+	fprintf(f, "%s\n", buf);
+	pcm_meter_reset(m);
+}
@@ -0,0 +1,121 @@
+/** Audio API Quick Start Guide: Mixer benchmark
+Checks that SIMD kernels produce the same sums as the scalar code (within float rounding: AVX2 uses fused multiply-add),
+ then mixes 1..MAX_INPUTS inputs in chunks of CHUNK_FRAMES stereo frames
+ and prints the cost per input sample, which should stay the same as the number of inputs grows.
+Usage: pcm-mix-bench [MAX_INPUTS] [CHUNK_FRAMES] [ITERATIONS]
+Link with -lm */
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "pcm-mix.h"
+
+static const char isa_names[][8] = { "", "scalar", "sse2", "avx2" };
+
+/** Mix with every supported instruction set and compare the sums with the scalar code */
+static void check(unsigned fmt, void **inputs, unsigned n_inputs, size_t samples)
+{
+	pcm_mixer m;
+	assert(0 == pcm_mixer_init(&m, samples));
+	float *ref = malloc(samples * sizeof(float));
+
+	for (unsigned isa = PCM_ISA_SCALAR;  isa <= PCM_ISA_AVX2;  isa++) {
+		if (isa != pcm_convert_isa(isa))
+			continue;
+		pcm_mix_begin(&m, samples);
+		for (unsigned i = 0;  i < n_inputs;  i++) {
+			pcm_mix_add(&m, fmt, inputs[i], samples, 1.f / n_inputs);
+		}
+		if (isa == PCM_ISA_SCALAR) {
+			memcpy(ref, m.acc, samples * sizeof(float));
+			continue;
+		}
+		for (size_t k = 0;  k < samples;  k++) {
+			if (!(fabsf(m.acc[k] - ref[k]) <= 1e-5f)) {
+				printf("MISMATCH: %s inputs (%s, %u inputs, %zu samples): sample %zu: %f != %f\n"
+					, pcm_fmt_name(fmt), isa_names[isa], n_inputs, samples, k, m.acc[k], ref[k]);
+				exit(1);
+			}
+		}
+	}
+
+	free(ref);
+	pcm_mixer_close(&m);
+}
+
+/** Return nanoseconds per input sample */
+static double bench(unsigned fmt, void **inputs, unsigned n_inputs, size_t samples, unsigned iterations, void *out)
+{
+	pcm_mixer m;
+	assert(0 == pcm_mixer_init(&m, samples));
+	pcm_dither d;
+	pcm_dither_init(&d, 1);
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned it = 0;  it < iterations;  it++) {
+		pcm_mix_begin(&m, samples);
+		for (unsigned i = 0;  i < n_inputs;  i++) {
+			pcm_mix_add(&m, fmt, inputs[i], samples, 1.f / n_inputs);
+		}
+		pcm_mix_end(&m, PCM_S16, out, &d);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	pcm_mixer_close(&m);
+
+	double ns = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+	return ns / ((double)n_inputs * samples * iterations);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned max_inputs = (argc > 1) ? strtoul(argv[1], NULL, 10) : 128;
+	size_t frames = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1024;
+	unsigned iterations = (argc > 3) ? strtoul(argv[3], NULL, 10) : 1000;
+	size_t samples = frames * 2;
+	unsigned best = pcm_convert_isa(PCM_ISA_AUTO);
+
+	// Every input has its own buffer, as if it was read from its own ring buffer
+	void **inputs = malloc(max_inputs * sizeof(void*));
+	for (unsigned i = 0;  i < max_inputs;  i++) {
+		inputs[i] = malloc(samples * 4);
+		for (size_t k = 0;  k < samples;  k++) {
+			((float*)inputs[i])[k] = (float)rand() / RAND_MAX - 0.5f;
+		}
+	}
+	void *out = malloc(samples * 4);
+
+	// Also a size that isn't a multiple of the vector width: the tail is processed by the scalar code
+	for (unsigned fmt = PCM_S16;  fmt <= PCM_F32;  fmt += 3) {
+		for (unsigned n = 1;  n <= max_inputs;  n *= 2) {
+			check(fmt, inputs, n, samples);
+			check(fmt, inputs, n, (samples > 13) ? samples - 13 : 3);
+		}
+	}
+
+	printf("ns per input sample, %zu stereo frames x %u\n", frames, iterations);
+	for (unsigned fmt = PCM_S16;  fmt <= PCM_F32;  fmt += 3) {
+		printf("%s inputs:\n%10s", pcm_fmt_name(fmt), "inputs");
+		for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+			printf("%10s", isa_names[isa]);
+		}
+		printf("\n");
+
+		for (unsigned n = 1;  n <= max_inputs;  n *= 2) {
+			printf("%10u", n);
+			for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+				pcm_convert_isa(isa);
+				printf("%10.3f", bench(fmt, inputs, n, samples, iterations, out));
+			}
+			printf("\n");
+		}
+	}
+
+	for (unsigned i = 0;  i < max_inputs;  i++) {
+		free(inputs[i]);
+	}
+	free(inputs);
+	free(out);
+	return 0;
+}
@@ -0,0 +1,174 @@
+/** Audio API Quick Start Guide: N-input mixer (for sample code only)
+Sums any number of inputs, each with its own gain, into a float32 accumulator,
+ then converts the sum into the output buffer (e.g. device buffer region) with saturation.
+The accumulator is allocated once for the largest chunk, so mixing never allocates memory;
+ it stays in L1 cache (1024 stereo frames = 8KB) and every input sample costs one multiply-add.
+int16, int32 and float32 inputs are added 8 samples at a time with SSE2 or AVX2 instructions
+ (selected by pcm_convert_isa()), int24 inputs and non-x86 CPUs use the scalar code. */
+
+#pragma once
+#include "pcm-convert.h"
+#include <stdlib.h>
+
+typedef struct {
+	float *acc;
+	size_t cap; // max samples per chunk
+	size_t n; // samples in the current chunk
+} pcm_mixer;
+
+/**
+max_samples: max chunk size (frames * channels)
+Return 0 on success */
+static inline int pcm_mixer_init(pcm_mixer *m, size_t max_samples)
+{
+	m->cap = (max_samples + 7) & ~(size_t)7;
+	m->n = 0;
+	if (0 != posix_memalign((void**)&m->acc, 64, m->cap * sizeof(float)))
+		return -1;
+	return 0;
+}
+
+static inline void pcm_mixer_close(pcm_mixer *m)
+{
+	free(m->acc);
+	m->acc = NULL;
+}
+
+/** Start a new chunk of 'samples' (<= max_samples) silent samples */
+static inline void pcm_mix_begin(pcm_mixer *m, size_t samples)
+{
+	m->n = samples;
+	memset(m->acc, 0, samples * sizeof(float));
+}
+
+
+/* acc[i] += src[i] * gain */
+
+static inline __attribute__((always_inline)) void _pcm_mix_add_scalar(float *acc, const void *src, size_t i, size_t n, float gain, const unsigned fmt)
+{
+	if (fmt != PCM_F32)
+		gain *= 1.f / 2147483648.f;
+	for (;  i < n;  i++) {
+		float v = (fmt == PCM_F32) ? ((const float*)src)[i] : (float)_pcm_load_i32(src, i, fmt);
+		acc[i] += v * gain;
+	}
+}
+
+#ifdef PCM_X86
+
+static inline __attribute__((always_inline, target("sse2"))) __m128 _pcm_mix_load_sse2(const void *src, size_t i, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16: {
+		__m128i x = _mm_loadl_epi64((const __m128i*)((const int16_t*)src + i));
+		return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+	}
+	case PCM_S32:
+		return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)((const int32_t*)src + i)));
+	}
+	return _mm_loadu_ps((const float*)src + i);
+}
+
+static inline __attribute__((always_inline, target("sse2"))) void _pcm_mix_add_sse2(float *acc, const void *src, size_t n, float gain, const unsigned fmt)
+{
+	// int16 samples are loaded as is (not left-justified)
+	float scale = (fmt == PCM_S16) ? 1.f / 32768 : 1.f / 2147483648.f;
+	__m128 g = _mm_set1_ps((fmt == PCM_F32) ? gain : gain * scale);
+	size_t i = 0;
+	for (;  i + 8 <= n;  i += 8) {
+		__m128 a = _mm_load_ps(acc + i), b = _mm_load_ps(acc + i + 4);
+		a = _mm_add_ps(a, _mm_mul_ps(_pcm_mix_load_sse2(src, i, fmt), g));
+		b = _mm_add_ps(b, _mm_mul_ps(_pcm_mix_load_sse2(src, i + 4, fmt), g));
+		_mm_store_ps(acc + i, a);
+		_mm_store_ps(acc + i + 4, b);
+	}
+	_pcm_mix_add_scalar(acc, src, i, n, gain, fmt);
+}
+
+static inline __attribute__((always_inline, target("avx2,fma"))) __m256 _pcm_mix_load_avx2(const void *src, size_t i, const unsigned fmt)
+{
+	switch (fmt) {
+	case PCM_S16:
+		return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)((const int16_t*)src + i))));
+	case PCM_S32:
+		return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)((const int32_t*)src + i)));
+	}
+	return _mm256_loadu_ps((const float*)src + i);
+}
+
+static inline __attribute__((always_inline, target("avx2,fma"))) void _pcm_mix_add_avx2(float *acc, const void *src, size_t n, float gain, const unsigned fmt)
+{
+	float scale = (fmt == PCM_S16) ? 1.f / 32768 : 1.f / 2147483648.f;
+	__m256 g = _mm256_set1_ps((fmt == PCM_F32) ? gain : gain * scale);
+	size_t i = 0;
+	for (;  i + 16 <= n;  i += 16) {
+		__m256 a = _mm256_load_ps(acc + i), b = _mm256_load_ps(acc + i + 8);
+		a = _mm256_fmadd_ps(_pcm_mix_load_avx2(src, i, fmt), g, a);
+		b = _mm256_fmadd_ps(_pcm_mix_load_avx2(src, i + 8, fmt), g, b);
+		_mm256_store_ps(acc + i, a);
+		_mm256_store_ps(acc + i + 8, b);
+	}
+	_pcm_mix_add_scalar(acc, src, i, n, gain, fmt);
+}
+
+#endif
+
+typedef void (*_pcm_mix_func)(float *acc, const void *src, size_t n, float gain);
+
+#define _PCM_MIX_KERNEL(isa, target, fmt) \
+	static target void _pcm_mix_##isa##_##fmt(float *acc, const void *src, size_t n, float gain) \
+	{ \
+		_pcm_mix_add_##isa(acc, src, n, gain, fmt); \
+	}
+
+#ifdef PCM_X86
+_PCM_MIX_KERNEL(sse2, __attribute__((target("sse2"))), PCM_S16)
+_PCM_MIX_KERNEL(sse2, __attribute__((target("sse2"))), PCM_S32)
+_PCM_MIX_KERNEL(sse2, __attribute__((target("sse2"))), PCM_F32)
+_PCM_MIX_KERNEL(avx2, __attribute__((target("avx2,fma"))), PCM_S16)
+_PCM_MIX_KERNEL(avx2, __attribute__((target("avx2,fma"))), PCM_S32)
+_PCM_MIX_KERNEL(avx2, __attribute__((target("avx2,fma"))), PCM_F32)
+#endif
+
+/** Add input data to the current chunk.
+fmt: enum PCM_FMT
+samples: N of input samples;  an input shorter than the chunk is silent at the end
+gain: linear gain (1.0: no change) */
+static inline void pcm_mix_add(pcm_mixer *m, unsigned fmt, const void *src, size_t samples, float gain)
+{
+	if (samples > m->n)
+		samples = m->n;
+	if (_pcm_isa == PCM_ISA_AUTO)
+		pcm_convert_isa(PCM_ISA_AUTO);
+
+#ifdef PCM_X86
+	if (fmt != PCM_S24 && _pcm_isa >= PCM_ISA_SSE2) {
+		static const _pcm_mix_func sse2[] = { _pcm_mix_sse2_PCM_S16, NULL, _pcm_mix_sse2_PCM_S32, _pcm_mix_sse2_PCM_F32 };
+		static const _pcm_mix_func avx2[] = { _pcm_mix_avx2_PCM_S16, NULL, _pcm_mix_avx2_PCM_S32, _pcm_mix_avx2_PCM_F32 };
+		if (_pcm_isa == PCM_ISA_AVX2 && __builtin_cpu_supports("fma"))
+			avx2[fmt](m->acc, src, samples, gain);
+		else
+			sse2[fmt](m->acc, src, samples, gain);
+		return;
+	}
+#endif
+
+	switch (fmt) {
+	case PCM_S16:
+		_pcm_mix_add_scalar(m->acc, src, 0, samples, gain, PCM_S16); break;
+	case PCM_S24:
+		_pcm_mix_add_scalar(m->acc, src, 0, samples, gain, PCM_S24); break;
+	case PCM_S32:
+		_pcm_mix_add_scalar(m->acc, src, 0, samples, gain, PCM_S32); break;
+	case PCM_F32:
+		_pcm_mix_add_scalar(m->acc, src, 0, samples, gain, PCM_F32); break;
+	}
+}
+
+/** Convert the mixed chunk into the output buffer.
+Integer output saturates (and gets optional dither).
+Return 0 on success */
+static inline int pcm_mix_end(pcm_mixer *m, unsigned ofmt, void *dst, pcm_dither *dither)
+{
+	return pcm_convert(ofmt, dst, PCM_F32, m->acc, m->n, dither);
+}
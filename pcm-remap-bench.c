@@ -0,0 +1,112 @@
+/** Audio API Quick Start Guide: Channel remapping benchmark
+For every conversion compares the specialized kernel with the generic matrix code (scalar and SSE2)
+ and prints the cost per frame and the max difference from the scalar matrix result.
+Usage: pcm-remap-bench [FRAMES] [ITERATIONS]
+Link with -lm */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "pcm-remap.h"
+
+/** Return nanoseconds per frame */
+static double bench(const pcm_remapper *r, float *dst, const float *src, size_t frames, unsigned iterations)
+{
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned it = 0;  it < iterations;  it++) {
+		pcm_remap(r, dst, src, frames);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double ns = (t2.tv_sec - t1.tv_sec) * 1e9 + (t2.tv_nsec - t1.tv_nsec);
+	return ns / ((double)frames * iterations);
+}
+
+int main(int argc, char **argv)
+{
+	size_t frames = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1024;
+	unsigned iterations = (argc > 2) ? strtoul(argv[2], NULL, 10) : 10000;
+
+	float *src = malloc(frames * PCM_REMAP_MAXCH * sizeof(float));
+	float *ref = malloc(frames * PCM_REMAP_MAXCH * sizeof(float));
+	float *dst = malloc(frames * PCM_REMAP_MAXCH * sizeof(float));
+	for (size_t i = 0;  i < frames * PCM_REMAP_MAXCH;  i++) {
+		src[i] = (float)rand() / RAND_MAX - 0.5f;
+	}
+
+	struct {
+		unsigned ich, och;
+		int swap; // reorder: reverse the channels
+	} tests[] = {
+		{ 1, 2 },
+		{ 2, 1 },
+		{ 6, 2 },
+		{ 8, 2 },
+		{ 2, 2, 1 },
+		{ 6, 6, 1 },
+		{ 1, 8 },
+		{ 6, 8 },
+	};
+
+	unsigned best = pcm_convert_isa(PCM_ISA_AUTO);
+	printf("ns per frame, %zu frames x %u\n", frames, iterations);
+	printf("%-8s %-8s %10s %10s %10s %10s\n", "", "", "scalar", "scalar", "sse2", "sse2");
+	printf("%-8s %-8s %10s %10s %10s %10s %10s\n", "layout", "kernel", "matrix", "kernel", "matrix", "kernel", "max diff");
+
+	for (unsigned t = 0;  t < sizeof(tests) / sizeof(*tests);  t++) {
+		unsigned I = tests[t].ich, O = tests[t].och;
+		pcm_remapper rk, rm;
+		if (tests[t].swap) {
+			int map[PCM_REMAP_MAXCH];
+			for (unsigned o = 0;  o < O;  o++)
+				map[o] = O - 1 - o;
+			assert(0 == pcm_remap_init_map(&rk, I, O, map));
+		} else if (I == 6 && O == 8) {
+			// No specialized kernel: any dense matrix
+			float m[8 * 6];
+			for (unsigned i = 0;  i < 8 * 6;  i++)
+				m[i] = (float)rand() / RAND_MAX / 6;
+			assert(0 == pcm_remap_init_matrix(&rk, I, O, m));
+		} else {
+			assert(0 == pcm_remap_init(&rk, I, O));
+		}
+		// The same conversion with the generic kernel
+		float m[PCM_REMAP_MAXCH * PCM_REMAP_MAXCH];
+		for (unsigned o = 0;  o < O;  o++)
+			for (unsigned i = 0;  i < I;  i++)
+				m[o * I + i] = rk.m[o][i];
+		assert(0 == pcm_remap_init_matrix(&rm, I, O, m));
+
+		char name[16];
+		snprintf(name, sizeof(name), "%u->%u", I, O);
+		printf("%-8s %-8s", name, pcm_remap_name(&rk));
+
+		pcm_convert_isa(PCM_ISA_SCALAR);
+		pcm_remap(&rm, ref, src, frames);
+		printf(" %10.3f", bench(&rm, dst, src, frames, iterations));
+		printf(" %10.3f", bench(&rk, dst, src, frames, iterations));
+
+		float diff = 0;
+		for (unsigned isa = PCM_ISA_SSE2;  isa <= best;  isa++) {
+			if (isa == PCM_ISA_AVX2)
+				break; // no AVX2 code
+			pcm_convert_isa(isa);
+			printf(" %10.3f", bench(&rm, dst, src, frames, iterations));
+			printf(" %10.3f", bench(&rk, dst, src, frames, iterations));
+		}
+
+		pcm_remap(&rk, dst, src, frames);
+		for (size_t i = 0;  i < frames * O;  i++) {
+			float d = fabsf(dst[i] - ref[i]);
+			if (diff < d)
+				diff = d;
+		}
+		printf(" %10.2g\n", diff);
+		pcm_convert_isa(best);
+	}
+
+	free(src);
+	free(ref);
+	free(dst);
+	return 0;
+}
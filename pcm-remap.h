@@ -0,0 +1,393 @@
+/** Audio API Quick Start Guide: Channel remapping, downmix and upmix (for sample code only)
+Converts interleaved float32 data between channel layouts with a matrix of gain coefficients:
+ out[o] = sum(m[o][i] * in[i])
+The most common conversions have their own kernels which don't multiply by zeros:
+ 1 -> 2 (duplicate), 2 -> 1 (average), 5.1 -> 2 and 7.1 -> 2 (ITU downmix without LFE, normalized so that it never clips),
+ reorder/select channels (each output channel is a copy of one input channel or silence).
+Any other matrix uses the generic kernel.
+Surround channels are in WAV (SMPTE) order: FL FR FC LFE BL BR [SL SR].
+The kernels use SSE2 instructions when pcm_convert_isa() allows it;
+ reorder of 2, 6 or 8 channels is a plain copy with an unrolled loop. */
+
+#pragma once
+#include "pcm-convert.h"
+
+#define PCM_REMAP_MAXCH  16
+
+enum PCM_REMAP_KERNEL {
+	PCM_REMAP_COPY,
+	PCM_REMAP_MAP,
+	PCM_REMAP_1_2,
+	PCM_REMAP_2_1,
+	PCM_REMAP_51_2,
+	PCM_REMAP_71_2,
+	PCM_REMAP_MATRIX,
+};
+
+typedef struct {
+	unsigned ichannels, ochannels;
+	unsigned kernel; // enum PCM_REMAP_KERNEL
+	int map[PCM_REMAP_MAXCH]; // input channel for each output channel;  -1: silence
+	float m[PCM_REMAP_MAXCH][PCM_REMAP_MAXCH]; // [out][in]
+	float col[PCM_REMAP_MAXCH][PCM_REMAP_MAXCH] __attribute__((aligned(16))); // [in][out]: a column of output gains for each input channel
+} pcm_remapper;
+
+static inline const char* pcm_remap_name(const pcm_remapper *r)
+{
+	static const char names[][8] = { "copy", "reorder", "1->2", "2->1", "5.1->2", "7.1->2", "matrix" };
+	return names[r->kernel];
+}
+
+/** Set matrix coefficients and select the generic kernel.
+m: [ochannels][ichannels] coefficients
+Return 0 on success */
+static inline int pcm_remap_init_matrix(pcm_remapper *r, unsigned ichannels, unsigned ochannels, const float *m)
+{
+	if (ichannels == 0 || ichannels > PCM_REMAP_MAXCH
+		|| ochannels == 0 || ochannels > PCM_REMAP_MAXCH)
+		return -1;
+	memset(r, 0, sizeof(*r));
+	r->ichannels = ichannels;
+	r->ochannels = ochannels;
+	r->kernel = PCM_REMAP_MATRIX;
+	for (unsigned o = 0;  o < ochannels;  o++) {
+		r->map[o] = -1;
+		for (unsigned i = 0;  i < ichannels;  i++) {
+			r->m[o][i] = m[o * ichannels + i];
+			r->col[i][o] = r->m[o][i];
+		}
+	}
+	return 0;
+}
+
+/** Each output channel is a copy of one input channel.
+map: input channel for each output channel;  -1: silence
+Return 0 on success */
+static inline int pcm_remap_init_map(pcm_remapper *r, unsigned ichannels, unsigned ochannels, const int *map)
+{
+	// 'm' is filled with the stride 'ichannels': check the sizes before writing to it
+	if (ichannels == 0 || ichannels > PCM_REMAP_MAXCH
+		|| ochannels == 0 || ochannels > PCM_REMAP_MAXCH)
+		return -1;
+	float m[PCM_REMAP_MAXCH * PCM_REMAP_MAXCH] = {};
+	for (unsigned o = 0;  o < ochannels;  o++) {
+		if (map[o] >= (int)ichannels)
+			return -1;
+		if (map[o] >= 0)
+			m[o * ichannels + map[o]] = 1;
+	}
+	if (0 != pcm_remap_init_matrix(r, ichannels, ochannels, m))
+		return -1;
+
+	int identity = (ichannels == ochannels);
+	for (unsigned o = 0;  o < ochannels;  o++) {
+		r->map[o] = map[o];
+		if (map[o] != (int)o)
+			identity = 0;
+	}
+	r->kernel = (identity) ? PCM_REMAP_COPY : PCM_REMAP_MAP;
+	return 0;
+}
+
+/** Standard conversion between 2 layouts:
+ the same N of channels: copy;
+ mono -> stereo: duplicate;  stereo -> mono: average;
+ 5.1 or 7.1 -> stereo: downmix;
+ mono or stereo -> more channels: front left & right channels, the other channels are silent;
+ otherwise: the first channels are copied, the other channels are dropped or silent.
+Return 0 on success */
+static inline int pcm_remap_init(pcm_remapper *r, unsigned ichannels, unsigned ochannels)
+{
+	if (ochannels == 2 && (ichannels == 6 || ichannels == 8)) {
+		// L = FL + -3dB * (FC + BL [+ SL])
+		const float c = 0.70710678f;
+		float norm = 1 / (1 + c * (ichannels == 6 ? 2 : 3));
+		float m[2 * 8] = {};
+		for (unsigned o = 0;  o < 2;  o++) {
+			float *row = m + o * ichannels;
+			row[o] = norm; // FL or FR
+			row[2] = c * norm; // FC
+			row[4 + o] = c * norm; // BL or BR
+			if (ichannels == 8)
+				row[6 + o] = c * norm; // SL or SR
+		}
+		pcm_remap_init_matrix(r, ichannels, ochannels, m);
+		r->kernel = (ichannels == 6) ? PCM_REMAP_51_2 : PCM_REMAP_71_2;
+		return 0;
+	}
+
+	if (ichannels == 2 && ochannels == 1) {
+		const float m[] = { 0.5f, 0.5f };
+		pcm_remap_init_matrix(r, 2, 1, m);
+		r->kernel = PCM_REMAP_2_1;
+		return 0;
+	}
+
+	int map[PCM_REMAP_MAXCH];
+	for (unsigned o = 0;  o < ochannels && o < PCM_REMAP_MAXCH;  o++) {
+		map[o] = (o < ichannels) ? (int)o : -1;
+	}
+	if (ichannels == 1 && ochannels >= 2)
+		map[1] = 0;
+	if (0 != pcm_remap_init_map(r, ichannels, ochannels, map))
+		return -1;
+	if (ichannels == 1 && ochannels == 2)
+		r->kernel = PCM_REMAP_1_2;
+	return 0;
+}
+
+
+/* Scalar code */
+
+static inline __attribute__((always_inline)) void _pcm_remap_matrix_scalar(const pcm_remapper *r, float *dst, const float *src, size_t frames, const unsigned I, const unsigned O)
+{
+	for (size_t f = 0;  f < frames;  f++) {
+		for (unsigned o = 0;  o < O;  o++) {
+			float sum = 0;
+			for (unsigned i = 0;  i < I;  i++) {
+				sum += r->m[o][i] * src[f * I + i];
+			}
+			dst[f * O + o] = sum;
+		}
+	}
+}
+
+static inline __attribute__((always_inline)) void _pcm_remap_map_scalar(const pcm_remapper *r, float *dst, const float *src, size_t frames, const unsigned I, const unsigned O)
+{
+	for (size_t f = 0;  f < frames;  f++) {
+		for (unsigned o = 0;  o < O;  o++) {
+			int i = r->map[o];
+			dst[f * O + o] = (i >= 0) ? src[f * I + i] : 0;
+		}
+	}
+}
+
+/** 1 -> 2, 2 -> 1, 5.1 -> 2, 7.1 -> 2 starting at frame #i */
+static inline __attribute__((always_inline)) void _pcm_remap_fixed_scalar(const pcm_remapper *r, float *dst, const float *src, size_t i, size_t frames, const unsigned kernel)
+{
+	const float cf = r->m[0][0], cc = r->m[0][2 % r->ichannels], cb = r->m[0][4 % r->ichannels], cs = r->m[0][6 % r->ichannels];
+	for (;  i < frames;  i++) {
+		switch (kernel) {
+		case PCM_REMAP_1_2:
+			dst[i * 2] = dst[i * 2 + 1] = src[i];
+			break;
+
+		case PCM_REMAP_2_1:
+			dst[i] = (src[i * 2] + src[i * 2 + 1]) * 0.5f;
+			break;
+
+		case PCM_REMAP_51_2: {
+			const float *s = src + i * 6;
+			dst[i * 2] = s[0] * cf + s[2] * cc + s[4] * cb;
+			dst[i * 2 + 1] = s[1] * cf + s[2] * cc + s[5] * cb;
+			break;
+		}
+
+		case PCM_REMAP_71_2: {
+			const float *s = src + i * 8;
+			dst[i * 2] = s[0] * cf + s[2] * cc + s[4] * cb + s[6] * cs;
+			dst[i * 2 + 1] = s[1] * cf + s[2] * cc + s[5] * cb + s[7] * cs;
+			break;
+		}
+		}
+	}
+}
+
+
+#ifdef PCM_X86
+
+/* SSE2 code */
+
+#define _PCM_REMAP_SSE2  __attribute__((target("sse2")))
+
+/** V: N of vectors per output frame */
+static inline __attribute__((always_inline)) _PCM_REMAP_SSE2 void _pcm_remap_matrix_sse2(const pcm_remapper *r, float *dst, const float *src, size_t frames, const unsigned V)
+{
+	const unsigned I = r->ichannels, O = r->ochannels;
+	for (size_t f = 0;  f < frames;  f++) {
+		__m128 acc[PCM_REMAP_MAXCH / 4];
+		for (unsigned v = 0;  v < V;  v++)
+			acc[v] = _mm_setzero_ps();
+
+		for (unsigned i = 0;  i < I;  i++) {
+			__m128 s = _mm_set1_ps(src[f * I + i]);
+			for (unsigned v = 0;  v < V;  v++)
+				acc[v] = _mm_add_ps(acc[v], _mm_mul_ps(s, _mm_load_ps(&r->col[i][v * 4])));
+		}
+
+		// The last vector of a frame may overlap the next frame: it will be overwritten.
+		// The last frame is stored via a temporary buffer.
+		float *d = dst + f * O;
+		if (O % 4 == 0 || f + 1 != frames) {
+			for (unsigned v = 0;  v < V;  v++)
+				_mm_storeu_ps(d + v * 4, acc[v]);
+		} else {
+			float tmp[PCM_REMAP_MAXCH];
+			for (unsigned v = 0;  v < V;  v++)
+				_mm_storeu_ps(tmp + v * 4, acc[v]);
+			memcpy(d, tmp, O * sizeof(float));
+		}
+	}
+}
+
+/** Process whole blocks of frames.
+Return N of frames processed */
+static inline _PCM_REMAP_SSE2 size_t _pcm_remap_fixed_sse2(const pcm_remapper *r, float *dst, const float *src, size_t frames, const unsigned kernel)
+{
+	const __m128 cf = _mm_set1_ps(r->m[0][0]);
+	const __m128 cc = _mm_set1_ps(r->m[0][2 % r->ichannels]);
+	const __m128 cb = _mm_set1_ps(r->m[0][4 % r->ichannels]);
+	const __m128 cs = _mm_set1_ps(r->m[0][6 % r->ichannels]);
+	const __m128 z = _mm_setzero_ps();
+	size_t i = 0;
+
+	switch (kernel) {
+	case PCM_REMAP_1_2:
+		for (;  i + 4 <= frames;  i += 4) {
+			__m128 x = _mm_loadu_ps(src + i);
+			_mm_storeu_ps(dst + i * 2, _mm_unpacklo_ps(x, x));
+			_mm_storeu_ps(dst + i * 2 + 4, _mm_unpackhi_ps(x, x));
+		}
+		break;
+
+	case PCM_REMAP_2_1:
+		for (;  i + 4 <= frames;  i += 4) {
+			__m128 a = _mm_loadu_ps(src + i * 2), b = _mm_loadu_ps(src + i * 2 + 4);
+			__m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(left, right), _mm_set1_ps(0.5f)));
+		}
+		break;
+
+	case PCM_REMAP_51_2:
+		// 2 frames: [L0 R0 L1 R1]
+		for (;  i + 2 <= frames;  i += 2) {
+			const float *s = src + i * 6;
+			__m128 front = _mm_loadh_pi(_mm_loadl_pi(z, (const __m64*)s), (const __m64*)(s + 6));
+			__m128 center = _mm_loadh_pi(_mm_loadl_pi(z, (const __m64*)(s + 2)), (const __m64*)(s + 8));
+			center = _mm_shuffle_ps(center, center, _MM_SHUFFLE(2, 2, 0, 0));
+			__m128 back = _mm_loadh_pi(_mm_loadl_pi(z, (const __m64*)(s + 4)), (const __m64*)(s + 10));
+			__m128 v = _mm_mul_ps(front, cf);
+			v = _mm_add_ps(v, _mm_mul_ps(center, cc));
+			v = _mm_add_ps(v, _mm_mul_ps(back, cb));
+			_mm_storeu_ps(dst + i * 2, v);
+		}
+		break;
+
+	case PCM_REMAP_71_2:
+		for (;  i + 2 <= frames;  i += 2) {
+			const float *s = src + i * 8;
+			__m128 a0 = _mm_loadu_ps(s), b0 = _mm_loadu_ps(s + 4); // FL FR FC LFE, BL BR SL SR
+			__m128 a1 = _mm_loadu_ps(s + 8), b1 = _mm_loadu_ps(s + 12);
+			__m128 front = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(1, 0, 1, 0));
+			__m128 center = _mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 2, 2, 2));
+			__m128 back = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(1, 0, 1, 0));
+			__m128 side = _mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 2, 3, 2));
+			__m128 v = _mm_mul_ps(front, cf);
+			v = _mm_add_ps(v, _mm_mul_ps(center, cc));
+			v = _mm_add_ps(v, _mm_mul_ps(back, cb));
+			v = _mm_add_ps(v, _mm_mul_ps(side, cs));
+			_mm_storeu_ps(dst + i * 2, v);
+		}
+		break;
+	}
+	return i;
+}
+
+#define _PCM_REMAP_FIXED(kernel) \
+	static _PCM_REMAP_SSE2 void _pcm_remap_sse2_##kernel(const pcm_remapper *r, float *dst, const float *src, size_t frames) \
+	{ \
+		size_t i = _pcm_remap_fixed_sse2(r, dst, src, frames, kernel); \
+		_pcm_remap_fixed_scalar(r, dst, src, i, frames, kernel); \
+	}
+
+_PCM_REMAP_FIXED(PCM_REMAP_1_2)
+_PCM_REMAP_FIXED(PCM_REMAP_2_1)
+_PCM_REMAP_FIXED(PCM_REMAP_51_2)
+_PCM_REMAP_FIXED(PCM_REMAP_71_2)
+
+// The accumulators stay in registers only if their number is known at compile time
+#define _PCM_REMAP_MATRIX(V) \
+	static _PCM_REMAP_SSE2 void _pcm_remap_sse2_matrix##V(const pcm_remapper *r, float *dst, const float *src, size_t frames) \
+	{ \
+		_pcm_remap_matrix_sse2(r, dst, src, frames, V); \
+	}
+
+_PCM_REMAP_MATRIX(1)
+_PCM_REMAP_MATRIX(2)
+_PCM_REMAP_MATRIX(3)
+_PCM_REMAP_MATRIX(4)
+
+#endif // PCM_X86
+
+/** Copy channels for the most common layouts: the compiler unrolls the loop.
+Return 0 if the layout isn't handled */
+static inline int _pcm_remap_map(const pcm_remapper *r, float *dst, const float *src, size_t frames)
+{
+	const unsigned I = r->ichannels, O = r->ochannels;
+	if (I == 2 && O == 2)
+		_pcm_remap_map_scalar(r, dst, src, frames, 2, 2);
+	else if (I == 6 && O == 6)
+		_pcm_remap_map_scalar(r, dst, src, frames, 6, 6);
+	else if (I == 8 && O == 8)
+		_pcm_remap_map_scalar(r, dst, src, frames, 8, 8);
+	else
+		return 0;
+	return 1;
+}
+
+/** Convert interleaved float32 data to the output channel layout.
+dst: frames * ochannels samples;  must not overlap with 'src' */
+static inline void pcm_remap(const pcm_remapper *r, float *dst, const float *src, size_t frames)
+{
+	if (_pcm_isa == PCM_ISA_AUTO)
+		pcm_convert_isa(PCM_ISA_AUTO);
+
+	switch (r->kernel) {
+	case PCM_REMAP_COPY:
+		memcpy(dst, src, frames * r->ichannels * sizeof(float));
+		return;
+
+	case PCM_REMAP_MAP:
+		// Other layouts: the SIMD matrix code is faster than copying samples one by one
+		if (_pcm_remap_map(r, dst, src, frames))
+			return;
+		break;
+	}
+
+#ifdef PCM_X86
+	if (_pcm_isa >= PCM_ISA_SSE2) {
+		switch (r->kernel) {
+		case PCM_REMAP_1_2:
+			_pcm_remap_sse2_PCM_REMAP_1_2(r, dst, src, frames); break;
+		case PCM_REMAP_2_1:
+			_pcm_remap_sse2_PCM_REMAP_2_1(r, dst, src, frames); break;
+		case PCM_REMAP_51_2:
+			_pcm_remap_sse2_PCM_REMAP_51_2(r, dst, src, frames); break;
+		case PCM_REMAP_71_2:
+			_pcm_remap_sse2_PCM_REMAP_71_2(r, dst, src, frames); break;
+		default: {
+			typedef void (*matrix_func)(const pcm_remapper *r, float *dst, const float *src, size_t frames);
+			static const matrix_func matrix[] = { _pcm_remap_sse2_matrix1, _pcm_remap_sse2_matrix2, _pcm_remap_sse2_matrix3, _pcm_remap_sse2_matrix4 };
+			matrix[(r->ochannels - 1) / 4](r, dst, src, frames);
+		}
+		}
+		return;
+	}
+#endif
+
+	switch (r->kernel) {
+	case PCM_REMAP_1_2:
+		_pcm_remap_fixed_scalar(r, dst, src, 0, frames, PCM_REMAP_1_2); break;
+	case PCM_REMAP_2_1:
+		_pcm_remap_fixed_scalar(r, dst, src, 0, frames, PCM_REMAP_2_1); break;
+	case PCM_REMAP_51_2:
+		_pcm_remap_fixed_scalar(r, dst, src, 0, frames, PCM_REMAP_51_2); break;
+	case PCM_REMAP_71_2:
+		_pcm_remap_fixed_scalar(r, dst, src, 0, frames, PCM_REMAP_71_2); break;
+	case PCM_REMAP_MAP:
+		_pcm_remap_map_scalar(r, dst, src, frames, r->ichannels, r->ochannels); break;
+	default:
+		_pcm_remap_matrix_scalar(r, dst, src, frames, r->ichannels, r->ochannels);
+	}
+}
@@ -0,0 +1,139 @@
+/** Audio API Quick Start Guide: Sample rate conversion benchmark
+For every quality preset measures the error of a resampled 1kHz sine wave
+ and CPU load of converting one channel in real time.
+Usage: pcm-resample-bench [IN_RATE OUT_RATE] [SECONDS]
+Link with -lm */
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include "pcm-resample.h"
+
+static const char isa_names[][8] = { "", "scalar", "sse2", "avx2" };
+
+/** Resample the whole buffer in chunks, including the flushed tail.
+Return N of output frames */
+static size_t resample_all(pcm_resampler *r, const float *in, size_t in_frames, float *out, size_t out_cap)
+{
+	size_t i = 0, o = 0, flush = pcm_resample_delay(r);
+	while (i < in_frames || flush != 0) {
+		size_t nin = (i < in_frames) ? in_frames - i : flush;
+		if (nin > 480)
+			nin = 480; // 10ms chunks
+		size_t nout = out_cap - o;
+		pcm_resample(r, (i < in_frames) ? in + i * r->channels : NULL, &nin, out + o * r->channels, &nout);
+		if (i < in_frames)
+			i += nin;
+		else
+			flush -= nin;
+		o += nout;
+	}
+	return o;
+}
+
+/** Resample a sine wave and compare it with the ideal one.
+Return error level (dB) */
+static double sine_error(unsigned in_rate, unsigned out_rate, unsigned quality)
+{
+	double freq = 1000;
+	size_t in_frames = in_rate;
+	float *in = malloc(in_frames * sizeof(float));
+	for (size_t i = 0;  i < in_frames;  i++) {
+		in[i] = 0.5 * sin(2 * M_PI * freq * i / in_rate);
+	}
+
+	pcm_resampler *r = pcm_resample_create(in_rate, out_rate, 1, quality);
+	assert(r != NULL);
+	size_t cap = pcm_resample_out_frames(r, in_frames + pcm_resample_delay(r));
+	float *out = malloc(cap * sizeof(float));
+	size_t n = resample_all(r, in, in_frames, out, cap);
+	assert(n >= (size_t)out_rate);
+
+	// Skip the filter's transient at both ends
+	double err = 0, sig = 0;
+	size_t skip = out_rate / 10;
+	for (size_t i = skip;  i < (size_t)out_rate - skip;  i++) {
+		double ideal = 0.5 * sin(2 * M_PI * freq * i / out_rate);
+		err += (out[i] - ideal) * (out[i] - ideal);
+		sig += ideal * ideal;
+	}
+
+	pcm_resample_free(r);
+	free(in);
+	free(out);
+	return 10 * log10(err / sig);
+}
+
+/** Return CPU load (%) of converting 1 channel in real time */
+static double cpu_load(unsigned in_rate, unsigned out_rate, unsigned quality, unsigned seconds)
+{
+	size_t in_frames = in_rate;
+	float *in = malloc(in_frames * sizeof(float));
+	for (size_t i = 0;  i < in_frames;  i++) {
+		in[i] = (float)rand() / RAND_MAX - 0.5f;
+	}
+
+	pcm_resampler *r = pcm_resample_create(in_rate, out_rate, 1, quality);
+	size_t cap = pcm_resample_out_frames(r, in_frames + pcm_resample_delay(r));
+	float *out = malloc(cap * sizeof(float));
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (unsigned i = 0;  i < seconds;  i++) {
+		resample_all(r, in, in_frames, out, cap);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	pcm_resample_free(r);
+	free(in);
+	free(out);
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	return sec / seconds * 100;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned rates[][2] = {
+		{ 44100, 48000 },
+		{ 48000, 44100 },
+		{ 48000, 96000 },
+		{ 96000, 48000 },
+	};
+	unsigned nrates = sizeof(rates) / sizeof(*rates);
+	unsigned seconds = 10;
+	if (argc > 2) {
+		rates[0][0] = strtoul(argv[1], NULL, 10);
+		rates[0][1] = strtoul(argv[2], NULL, 10);
+		nrates = 1;
+	}
+	if (argc > 3)
+		seconds = strtoul(argv[3], NULL, 10);
+
+	unsigned best = pcm_convert_isa(PCM_ISA_AUTO);
+	printf("Error of 1kHz sine (dB), CPU load per channel (%%), %s\n", isa_names[best]);
+	for (unsigned k = 0;  k < nrates;  k++) {
+		printf("%u -> %u:\n", rates[k][0], rates[k][1]);
+		for (unsigned q = PCM_RS_FAST;  q <= PCM_RS_BEST;  q++) {
+			printf("  %-8s %7.1fdB  %6.3f%%\n"
+				, pcm_rs_quality_name(q)
+				, sine_error(rates[k][0], rates[k][1], q)
+				, cpu_load(rates[k][0], rates[k][1], q, seconds));
+		}
+	}
+
+	// The same with every instruction set
+	printf("\nCPU load per channel (%%), %u -> %u:\n%-10s", rates[0][0], rates[0][1], "");
+	for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+		printf("%10s", isa_names[isa]);
+	}
+	printf("\n");
+	for (unsigned q = PCM_RS_FAST;  q <= PCM_RS_BEST;  q++) {
+		printf("  %-8s", pcm_rs_quality_name(q));
+		for (unsigned isa = PCM_ISA_SCALAR;  isa <= best;  isa++) {
+			pcm_convert_isa(isa);
+			printf("%10.3f", cpu_load(rates[0][0], rates[0][1], q, seconds));
+		}
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,293 @@
+/** Audio API Quick Start Guide: Sample rate conversion (for sample code only)
+Polyphase FIR resampler for interleaved float32 data.
+The rate ratio is reduced to L/M (e.g. 44100 -> 48000 = 160/147) and one windowed-sinc filter is built for each of L phases,
+ so every output sample is a single dot product of the filter with the input history of its channel.
+The dot product uses AVX2+FMA or SSE2 instructions (selected by pcm_convert_isa()), non-x86 CPUs use the scalar code.
+Output sample #n corresponds to input time n*M/L, but the resampler needs
+ pcm_resample_delay() more input frames before it can produce it:
+ pass NULL input with that many frames to flush the remaining output at the end of stream. */
+
+#pragma once
+#include "pcm-convert.h"
+#include "pcm-interleave.h"
+#include <stdlib.h>
+
+enum PCM_RS_QUALITY {
+	PCM_RS_FAST, // 16 taps
+	PCM_RS_MEDIUM, // 32 taps
+	PCM_RS_HIGH, // 64 taps
+	PCM_RS_BEST, // 128 taps
+};
+
+static const char _pcm_rs_quality_names[][8] = { "fast", "medium", "high", "best" };
+
+static inline const char* pcm_rs_quality_name(unsigned q)
+{
+	return _pcm_rs_quality_names[q];
+}
+
+#define PCM_RS_MAXCH  32
+#define PCM_RS_MAXPHASES  4096
+#define PCM_RS_MAXTAPS  1024
+// Input frames buffered per channel
+#define _PCM_RS_CHUNK  1024
+
+typedef float (*_pcm_rs_dot_func)(const float *a, const float *b, unsigned n);
+
+typedef struct {
+	unsigned channels;
+	unsigned L, M; // output/input rate ratio
+	unsigned taps; // filter length, multiple of 8
+	float *coef; // [L][taps]
+	_pcm_rs_dot_func dot;
+
+	// Input history of each channel: window of the next output sample starts at 'w'
+	float *hist[PCM_RS_MAXCH];
+	size_t w, len, cap;
+	unsigned phase;
+} pcm_resampler;
+
+
+/* Filter */
+
+/** Modified Bessel function of the first kind, order 0 */
+static inline double _pcm_rs_bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	for (unsigned k = 1;  k < 50;  k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+/** Kaiser-windowed sinc: x is the distance from the center in input samples */
+static inline double _pcm_rs_kernel(double x, double cutoff, double half, double beta)
+{
+	if (fabs(x) >= half)
+		return 0;
+	double s = (x == 0) ? 1 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+	double r = x / half;
+	return cutoff * s * _pcm_rs_bessel_i0(beta * sqrt(1 - r * r)) / _pcm_rs_bessel_i0(beta);
+}
+
+
+/* Dot product */
+
+static inline float _pcm_rs_dot_scalar(const float *a, const float *b, unsigned n)
+{
+	float s0 = 0, s1 = 0;
+	for (unsigned i = 0;  i < n;  i += 2) {
+		s0 += a[i] * b[i];
+		s1 += a[i + 1] * b[i + 1];
+	}
+	return s0 + s1;
+}
+
+#ifdef PCM_X86
+
+static __attribute__((target("sse2"))) float _pcm_rs_dot_sse2(const float *a, const float *b, unsigned n)
+{
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	for (unsigned i = 0;  i < n;  i += 8) {
+		s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_load_ps(a + i), _mm_loadu_ps(b + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_load_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+	}
+	s0 = _mm_add_ps(s0, s1);
+	s0 = _mm_add_ps(s0, _mm_movehl_ps(s0, s0));
+	s0 = _mm_add_ss(s0, _mm_shuffle_ps(s0, s0, 1));
+	return _mm_cvtss_f32(s0);
+}
+
+static __attribute__((target("avx2,fma"))) float _pcm_rs_dot_avx2(const float *a, const float *b, unsigned n)
+{
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	unsigned i = 0;
+	for (;  i + 16 <= n;  i += 16) {
+		s0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), _mm256_loadu_ps(b + i), s0);
+		s1 = _mm256_fmadd_ps(_mm256_load_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+	}
+	if (i < n)
+		s0 = _mm256_fmadd_ps(_mm256_load_ps(a + i), _mm256_loadu_ps(b + i), s0);
+	s0 = _mm256_add_ps(s0, s1);
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+#endif
+
+
+static inline unsigned _pcm_rs_gcd(unsigned a, unsigned b)
+{
+	while (b != 0) {
+		unsigned t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static inline void pcm_resample_free(pcm_resampler *r)
+{
+	if (r == NULL)
+		return;
+	for (unsigned c = 0;  c < r->channels;  c++) {
+		free(r->hist[c]);
+	}
+	free(r->coef);
+	free(r);
+}
+
+/** Create resampler.
+quality: enum PCM_RS_QUALITY
+Return NULL if the parameters are not supported */
+static inline pcm_resampler* pcm_resample_create(unsigned in_rate, unsigned out_rate, unsigned channels, unsigned quality)
+{
+	static const struct {
+		unsigned taps;
+		double beta, cutoff; // Kaiser window parameter; passband edge relative to Nyquist frequency
+	} presets[] = {
+		{ 16, 5.0, 0.85 },
+		{ 32, 7.0, 0.90 },
+		{ 64, 9.0, 0.94 },
+		{ 128, 11.0, 0.96 },
+	};
+	if (in_rate == 0 || out_rate == 0 || channels == 0 || channels > PCM_RS_MAXCH || quality > PCM_RS_BEST)
+		return NULL;
+
+	unsigned g = _pcm_rs_gcd(in_rate, out_rate);
+	unsigned L = out_rate / g, M = in_rate / g;
+	if (L > PCM_RS_MAXPHASES)
+		return NULL;
+
+	// When downsampling, the cutoff frequency moves down to the output Nyquist frequency
+	//  and the filter becomes proportionally longer to keep the same transition band
+	double cutoff = presets[quality].cutoff;
+	unsigned taps = presets[quality].taps;
+	if (M > L) {
+		cutoff = cutoff * L / M;
+		taps = (unsigned)((double)taps * M / L + 7) & ~7U;
+		if (taps > PCM_RS_MAXTAPS)
+			return NULL;
+	}
+
+	pcm_resampler *r = calloc(1, sizeof(pcm_resampler));
+	if (r == NULL)
+		return NULL;
+	r->channels = channels;
+	r->L = L;
+	r->M = M;
+	r->taps = taps;
+
+	if (0 != posix_memalign((void**)&r->coef, 64, (size_t)L * taps * sizeof(float)))
+		goto fail;
+
+	// Phase #p is used for output samples located at p/L after an input sample:
+	//  tap #j is multiplied with input sample at distance (j - (taps/2 - 1) - p/L) from the output position
+	double half = taps / 2;
+	for (unsigned p = 0;  p < L;  p++) {
+		float *h = r->coef + (size_t)p * taps;
+		double sum = 0;
+		for (unsigned j = 0;  j < taps;  j++) {
+			double x = (double)j - (taps / 2 - 1) - (double)p / L;
+			h[j] = _pcm_rs_kernel(x, cutoff, half, presets[quality].beta);
+			sum += h[j];
+		}
+		// Unity gain at DC for every phase
+		for (unsigned j = 0;  j < taps;  j++) {
+			h[j] /= sum;
+		}
+	}
+
+	r->cap = taps + _PCM_RS_CHUNK;
+	for (unsigned c = 0;  c < channels;  c++) {
+		if (NULL == (r->hist[c] = calloc(r->cap, sizeof(float))))
+			goto fail;
+	}
+	// Silence before the first input sample
+	r->len = taps / 2 - 1;
+
+	if (_pcm_isa == PCM_ISA_AUTO)
+		pcm_convert_isa(PCM_ISA_AUTO);
+	r->dot = _pcm_rs_dot_scalar;
+#ifdef PCM_X86
+	if (_pcm_isa == PCM_ISA_AVX2 && __builtin_cpu_supports("fma"))
+		r->dot = _pcm_rs_dot_avx2;
+	else if (_pcm_isa >= PCM_ISA_SSE2)
+		r->dot = _pcm_rs_dot_sse2;
+#endif
+	return r;
+
+fail:
+	pcm_resample_free(r);
+	return NULL;
+}
+
+/** Number of input frames which must follow an input frame before the output corresponding to it can be produced */
+static inline unsigned pcm_resample_delay(const pcm_resampler *r)
+{
+	return r->taps / 2;
+}
+
+/** Maximum number of output frames produced from 'in_frames' of input */
+static inline size_t pcm_resample_out_frames(const pcm_resampler *r, size_t in_frames)
+{
+	return (in_frames + r->taps) * r->L / r->M + 1;
+}
+
+/** Convert interleaved float32 data.
+in: input data;  NULL: silence (to flush the output at the end of stream)
+in_frames: [in] N of input frames;  [out] N of input frames consumed
+out_frames: [in] output buffer capacity (frames);  [out] N of output frames produced */
+static inline void pcm_resample(pcm_resampler *r, const float *in, size_t *in_frames, float *out, size_t *out_frames)
+{
+	const unsigned C = r->channels, taps = r->taps;
+	size_t in_n = 0, out_n = 0;
+
+	for (;;) {
+		// Produce output while the input window is complete
+		while (out_n < *out_frames && r->w + taps <= r->len) {
+			const float *h = r->coef + (size_t)r->phase * taps;
+			for (unsigned c = 0;  c < C;  c++) {
+				out[out_n * C + c] = r->dot(h, r->hist[c] + r->w, taps);
+			}
+			out_n++;
+
+			r->phase += r->M;
+			r->w += r->phase / r->L;
+			r->phase %= r->L;
+		}
+
+		if (out_n == *out_frames || in_n == *in_frames)
+			break;
+
+		// Discard the history which is no longer needed
+		r->len -= r->w;
+		for (unsigned c = 0;  c < C;  c++) {
+			memmove(r->hist[c], r->hist[c] + r->w, r->len * sizeof(float));
+		}
+		r->w = 0;
+
+		// Append input
+		size_t n = *in_frames - in_n;
+		if (n > r->cap - r->len)
+			n = r->cap - r->len;
+		float *dst[PCM_RS_MAXCH];
+		for (unsigned c = 0;  c < C;  c++) {
+			dst[c] = r->hist[c] + r->len;
+			if (in == NULL)
+				memset(dst[c], 0, n * sizeof(float));
+		}
+		if (in != NULL)
+			pcm_deinterleave((void**)dst, in + in_n * C, C, n, sizeof(float));
+		r->len += n;
+		in_n += n;
+	}
+
+	*in_frames = in_n;
+	*out_frames = out_n;
+}
@@ -1,10 +1,19 @@
 /** Audio API Quick Start Guide: PulseAudio: Play audio from stdin
-Link with -lpulse */
+Usage: pulseaudio-play [-format int16|int24|int32|float32] [-rate HZ] [-channels N] [-buffer MSEC] [-period MSEC] [-lowlatency] [-device ID] [-rt PRIO] [-cpu LIST] [-mix FILE[:GAIN_DB]]...
+Link with -lpulse -lpthread -lm */
 #include <pulse/pulseaudio.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "ringbuffer.h"
+#include "mix-input.h"
+#include "audio-conf.h"
+#include "rt.h"
+#include "pcm-glitch.h"
 
 pa_threaded_mainloop *mloop;
 int quit;
@@ -70,31 +79,43 @@ void on_io_complete(pa_stream *s, size_t nbytes, void *udata)
 	pa_threaded_mainloop_signal(mloop, 0);
 }
 
-pa_stream* abuf_create(pa_context *ctx)
+/** Create the stream with the requested parameters
+conf: [in/out] the requested values;  the actual values on return */
+pa_stream* abuf_create(pa_context *ctx, struct audio_conf *conf)
 {
 	// Create an audio buffer
 	pa_stream *stm;
+	static const pa_sample_format_t formats[] = { PA_SAMPLE_S16LE, PA_SAMPLE_S24LE, PA_SAMPLE_S32LE, PA_SAMPLE_FLOAT32LE };
 	pa_sample_spec spec;
-	spec.format = PA_SAMPLE_S16LE;
-	spec.rate = 48000;
-	spec.channels = 2;
+	spec.format = formats[conf->format];
+	spec.rate = conf->rate;
+	spec.channels = conf->channels;
 	assert(NULL != (stm = pa_stream_new(ctx, "My App", &spec, NULL)));
 
-	fprintf(stderr, "Using format %u, sample rate %u, channels %u\n", spec.format, spec.rate, spec.channels);
-
 	// Initialize device property-set with default values
 	pa_buffer_attr attr;
 	memset(&attr, 0xff, sizeof(attr));
 
-	// Set the audio buffer size in bytes using buffer length in milliseconds (optional)
-	int buffer_length_msec = 500;
-	attr.tlength = spec.rate * 16/8 * spec.channels * buffer_length_msec / 1000;
+	// Set the audio buffer size (the amount of data the server requests from us),
+	//  how often the server requests more data,
+	//  and how much data must be buffered before the playback starts (the whole buffer).
+	// Low latency: the server raises the values to the minimum the device supports.
+	u_int period_usec = (conf->period_usec != 0) ? conf->period_usec : AUDIO_CONF_MIN_PERIOD_USEC;
+	u_int buffer_usec = (conf->buffer_usec != 0) ? conf->buffer_usec : period_usec * AUDIO_CONF_LL_PERIODS;
+	attr.tlength = pa_usec_to_bytes(buffer_usec, &spec);
+	attr.minreq = pa_usec_to_bytes(period_usec, &spec);
+	attr.prebuf = attr.tlength;
+
+	// ADJUST_LATENCY: tlength is the total latency, so the server configures the device latency accordingly
+	//  (otherwise the device may still use a large buffer of its own)
+	// INTERPOLATE_TIMING, AUTO_TIMING_UPDATE: keep the timing info up to date for pa_stream_get_latency()
+	int flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
 	// Attach audio buffer to device
 	void *udata = NULL;
 	pa_stream_set_write_callback(stm, on_io_complete, udata);
-	const char *device_id = NULL; // use default device
-	pa_stream_connect_playback(stm, device_id, &attr, 0, NULL, NULL);
+	const char *device_id = conf->device; // NULL: use default device
+	pa_stream_connect_playback(stm, device_id, &attr, flags, NULL, NULL);
 
 	// Wait until the attachment is complete
 	for (;;) {
@@ -108,6 +129,13 @@ pa_stream* abuf_create(pa_context *ctx)
 		pa_threaded_mainloop_wait(mloop);
 	}
 
+	// Get the actual buffer parameters
+	const pa_buffer_attr *a = pa_stream_get_buffer_attr(stm);
+	conf->buffer_usec = pa_bytes_to_usec(a->tlength, &spec);
+	conf->period_usec = pa_bytes_to_usec(a->minreq, &spec);
+	audio_conf_report(conf->format, spec.rate, spec.channels, conf->buffer_usec, conf->period_usec);
+	fprintf(stderr, "Prebuffer: %.2fms\n", pa_bytes_to_usec(a->prebuf, &spec) / 1000.0);
+
 	return stm;
 }
 
@@ -116,25 +144,95 @@ void on_sigint()
 	quit = 1;
 }
 
+// Called within mainloop thread when the server has run out of data to play
+void on_underflow(pa_stream *s, void *udata)
+{
+	u_int *underflows = udata;
+	(*underflows)++;
+	char ts[16];
+	fprintf(stderr, "%s: underrun\n", pcm_glitch_time(ts));
+}
+
+// Latency report: pa_stream_get_latency() is sampled after every write,
+//  the statistics are printed every second
+struct latency {
+	pa_usec_t start, min, max, sum;
+	u_int n;
+};
+
+void latency_update(struct latency *l, pa_stream *stm)
+{
+	pa_usec_t usec;
+	int negative;
+	if (0 != pa_stream_get_latency(stm, &usec, &negative))
+		return; // no timing info yet
+	if (negative)
+		usec = 0;
+
+	if (l->n == 0 || l->min > usec)
+		l->min = usec;
+	if (l->max < usec)
+		l->max = usec;
+	l->sum += usec;
+	l->n++;
+
+	pa_usec_t now = pa_rtclock_now();
+	if (l->start == 0)
+		l->start = now;
+	if (now - l->start < 1000000)
+		return;
+	fprintf(stderr, "Latency: %.1fms (min %.1fms, max %.1fms)\n"
+		, (double)l->sum / l->n / 1000, l->min / 1000.0, l->max / 1000.0);
+	memset(l, 0, sizeof(*l));
+	l->start = now;
+}
+
 // Called within mainloop thread after operation is complete
 void on_op_complete(pa_stream *s, int success, void *udata)
 {
 	pa_threaded_mainloop_signal(mloop, 0);
 }
 
-void main()
+void main(int argc, char **argv)
 {
+	// "-format", "-rate", "-channels": format of stdin data (see audio-conf.h)
+	// "-buffer", "-period", "-lowlatency", "-device", "-rt", "-cpu": audio buffer parameters (see audio-conf.h)
+	// "-mix": mix the files (raw data in the same format as stdin) instead of reading stdin
+	static struct mix mx;
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i)) {
+		} else if (!strcmp(argv[i], "-mix") && i + 1 < argc) {
+			mix_add(&mx, argv[++i]);
+		}
+	}
+	audio_conf_default(&conf, PCM_S16, 48000, 2, 500);
+
+	// Real-time mode for the device loop (see rt.h): the mainloop thread inherits it
+	rt_enter(conf.rt_prio, conf.cpus);
+
 	pa_context *ctx = sv_connect();
 
 	pa_threaded_mainloop_lock(mloop);
 
-	pa_stream *stm = abuf_create(ctx);
+	pa_stream *stm = abuf_create(ctx, &conf);
+
+	u_int underflows = 0;
+	pa_stream_set_underflow_callback(stm, on_underflow, &underflows);
+
+	const pa_sample_spec *spec = pa_stream_get_sample_spec(stm);
+	u_int frame_size = pa_frame_size(spec);
+	if (mx.n != 0)
+		mix_start(&mx, conf.format, spec->channels, frame_size);
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	struct latency lat = {};
+
 	// Read audio samples from stdin and pass them to audio buffer
 	while (!quit) {
 
@@ -151,11 +249,18 @@ void main()
 		assert(0 == pa_stream_begin_write(stm, &buf, &n));
 		assert(buf != NULL);
 
-		// Read data from stdin
-		n = read(0, buf, n);
+		if (mx.n != 0) {
+			// Mix the inputs directly into the audio buffer.
+			// We hold the mainloop lock here: don't wait for the inputs, or the mainloop thread would stall too.
+			n = mix_read(&mx, buf, n / frame_size, 0) * frame_size;
+		} else {
+			// Read data from stdin
+			n = read(0, buf, n);
+		}
 
 		// Mark the data chunk as complete
 		assert(0 == pa_stream_write(stm, buf, n, NULL, 0, PA_SEEK_RELATIVE));
+		latency_update(&lat, stm);
 
 		if (n == 0)
 			break; // stdin data is complete
@@ -181,4 +286,9 @@ void main()
 	pa_threaded_mainloop_unlock(mloop);
 
 	sv_disconnect(ctx);
+	if (mx.n != 0)
+		mix_close(&mx);
+
+	// Note: after the end of stdin the server may report an underrun while draining
+	fprintf(stderr, "Underruns: %u\n", underflows);
 }
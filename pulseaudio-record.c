@@ -1,10 +1,17 @@
 /** Audio API Quick Start Guide: PulseAudio: Record audio and pass to stdout
-Link with -lpulse */
+Usage: pulseaudio-record [-format int16|int24|int32|float32] [-rate HZ] [-channels N] [-buffer MSEC] [-period MSEC] [-lowlatency] [-device ID] [-rt PRIO] [-cpu LIST] [-timestamps FILE]
+Link with -lpulse -lpthread -lm */
 #include <pulse/pulseaudio.h>
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+#include "ringbuffer.h"
+#include "pcm-meter.h"
+#include "audio-conf.h"
+#include "rt.h"
+#include "pcm-glitch.h"
 
 pa_threaded_mainloop *mloop;
 int quit;
@@ -70,31 +77,42 @@ void on_io_complete(pa_stream *s, size_t nbytes, void *udata)
 	pa_threaded_mainloop_signal(mloop, 0);
 }
 
-pa_stream* abuf_create(pa_context *ctx)
+/** Create the stream with the requested parameters
+conf: [in/out] the requested values;  the actual values on return */
+pa_stream* abuf_create(pa_context *ctx, struct audio_conf *conf)
 {
 	// Create an audio buffer
 	pa_stream *stm;
+	static const pa_sample_format_t formats[] = { PA_SAMPLE_S16LE, PA_SAMPLE_S24LE, PA_SAMPLE_S32LE, PA_SAMPLE_FLOAT32LE };
 	pa_sample_spec spec;
-	spec.format = PA_SAMPLE_S16LE;
-	spec.rate = 48000;
-	spec.channels = 2;
+	spec.format = formats[conf->format];
+	spec.rate = conf->rate;
+	spec.channels = conf->channels;
 	assert(NULL != (stm = pa_stream_new(ctx, "My App", &spec, NULL)));
 
-	fprintf(stderr, "Using format %u, sample rate %u, channels %u\n", spec.format, spec.rate, spec.channels);
-
 	// Initialize device property-set with default values
 	pa_buffer_attr attr;
 	memset(&attr, 0xff, sizeof(attr));
 
-	// Set the audio buffer size in bytes using buffer length in milliseconds (optional)
-	int buffer_length_msec = 500;
-	attr.tlength = spec.rate * 16/8 * spec.channels * buffer_length_msec / 1000;
+	// Set the audio buffer size (the amount of data the server holds for us before an overrun)
+	//  and the size of the chunks we get the data in.
+	// (tlength, minreq and prebuf are for playback streams only.)
+	// Low latency: the server raises the values to the minimum the device supports.
+	u_int period_usec = (conf->period_usec != 0) ? conf->period_usec : AUDIO_CONF_MIN_PERIOD_USEC;
+	u_int buffer_usec = (conf->buffer_usec != 0) ? conf->buffer_usec : period_usec * AUDIO_CONF_LL_PERIODS;
+	attr.maxlength = pa_usec_to_bytes(buffer_usec, &spec);
+	attr.fragsize = pa_usec_to_bytes(period_usec, &spec);
+
+	// ADJUST_LATENCY: fragsize is the total latency, so the server configures the device latency accordingly
+	//  (otherwise we get the data in small chunks, but the device still delivers it in large ones)
+	// INTERPOLATE_TIMING, AUTO_TIMING_UPDATE: keep the timing info up to date for pa_stream_get_latency()
+	int flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
 	// Attach audio buffer to device
 	void *udata = NULL;
 	pa_stream_set_read_callback(stm, on_io_complete, udata);
-	const char *device_id = NULL; // use default device
-	pa_stream_connect_record(stm, device_id, &attr, 0);
+	const char *device_id = conf->device; // NULL: use default device
+	pa_stream_connect_record(stm, device_id, &attr, flags);
 
 	// Wait until the attachment is complete
 	for (;;) {
@@ -108,6 +126,12 @@ pa_stream* abuf_create(pa_context *ctx)
 		pa_threaded_mainloop_wait(mloop);
 	}
 
+	// Get the actual buffer parameters
+	const pa_buffer_attr *a = pa_stream_get_buffer_attr(stm);
+	conf->buffer_usec = pa_bytes_to_usec(a->maxlength, &spec);
+	conf->period_usec = pa_bytes_to_usec(a->fragsize, &spec);
+	audio_conf_report(conf->format, spec.rate, spec.channels, conf->buffer_usec, conf->period_usec);
+
 	return stm;
 }
 
@@ -116,19 +140,202 @@ void on_sigint()
 	quit = 1;
 }
 
-void main()
+// Called within mainloop thread when the server has dropped data because we didn't read it in time
+void on_overflow(pa_stream *s, void *udata)
+{
+	u_int *overflows = udata;
+	(*overflows)++;
+	char ts[16];
+	fprintf(stderr, "%s: overrun\n", pcm_glitch_time(ts));
+}
+
+// Latency report: pa_stream_get_latency() is sampled after every read,
+//  the statistics are printed every second
+struct latency {
+	pa_usec_t start, min, max, sum;
+	u_int n;
+};
+
+void latency_update(struct latency *l, pa_stream *stm)
+{
+	pa_usec_t usec;
+	int negative;
+	if (0 != pa_stream_get_latency(stm, &usec, &negative))
+		return; // no timing info yet
+	if (negative)
+		usec = 0;
+
+	if (l->n == 0 || l->min > usec)
+		l->min = usec;
+	if (l->max < usec)
+		l->max = usec;
+	l->sum += usec;
+	l->n++;
+
+	pa_usec_t now = pa_rtclock_now();
+	if (l->start == 0)
+		l->start = now;
+	if (now - l->start < 1000000)
+		return;
+	fprintf(stderr, "Latency: %.1fms (min %.1fms, max %.1fms)\n"
+		, (double)l->sum / l->n / 1000, l->min / 1000.0, l->max / 1000.0);
+	memset(l, 0, sizeof(*l));
+	l->start = now;
+}
+
+// Stdout writer: the mainloop lock is held only while we copy the data into the ring buffer;
+//  a separate thread writes it to stdout as soon as it arrives, so a slow consumer never blocks the mainloop thread
+#define WRITER_RING_MSEC  2000
+#define WRITER_CHUNK  (64*1024) // max. bytes per write(): larger writes only when there's a backlog
+
+struct writer {
+	ringbuffer *ring;
+	pthread_t thread;
+	_Atomic int stop;
+	pcm_meter meter;
+
+	// Overrun counters
+	u_int holes; // the server has lost some data: replaced with silence
+	size_t hole_bytes;
+	u_int drops; // stdout is too slow: the ring buffer is full and the data is lost
+	size_t drop_bytes;
+};
+
+// Writes the ring buffer contents to stdout
+void* stdout_writer(void *param)
+{
+	struct writer *w = param;
+	ringbuffer *ring = w->ring;
+	// Writing to stdout isn't time-critical: don't compete with the real-time threads (-rt)
+	rt_leave();
+	for (;;) {
+		int stop = atomic_load(&w->stop);
+		ringbuffer_chunk d;
+		size_t h = ringbuf_read_begin_frames(ring, WRITER_CHUNK / ring->frame_size, &d, NULL);
+		if (d.len == 0) {
+			if (stop)
+				break; // all data is written
+			// Wake up on the first frame: waiting for more data would add to the latency.
+			// The timeout is only for checking 'stop'.
+			ringbuf_wait_readable(ring, ring->frame_size, 100);
+			continue;
+		}
+
+		// The ring is mirrored: the region is contiguous, so a single write() does the job
+		size_t n = 0;
+		while (n < d.len) {
+			ssize_t r = write(1, d.ptr + n, d.len - n);
+			if (r <= 0)
+				break;
+			n += r;
+		}
+
+		// Measure signal level
+		if (pcm_meter_update(&w->meter, d.ptr, d.len / ring->frame_size))
+			pcm_meter_print(&w->meter, stderr);
+
+		ringbuf_read_finish(ring, h);
+	}
+	return NULL;
+}
+
+/** Copy the data (or silence if 'data' is NULL) into the ring buffer
+Return the number of bytes stored */
+size_t writer_put(struct writer *w, const void *data, size_t n)
+{
+	ringbuffer_chunk d;
+	size_t h = ringbuf_write_begin_frames(w->ring, n / w->ring->frame_size, &d, NULL);
+	if (data != NULL)
+		memcpy(d.ptr, data, d.len);
+	else
+		memset(d.ptr, 0, d.len); // silence in all our formats
+	ringbuf_write_finish(w->ring, h);
+
+	if (d.len < n) {
+		w->drops++;
+		w->drop_bytes += n - d.len;
+		char ts[16];
+		fprintf(stderr, "%s: stdout is too slow: %zu frames lost\n", pcm_glitch_time(ts), (n - d.len) / w->ring->frame_size);
+	}
+	return d.len;
+}
+
+// Timestamp sidecar: a text line for every chunk written to stdout:
+//  POSITION TSTAMP DELAY
+// The frame number POSITION of the output was captured at TSTAMP - DELAY/rate seconds (CLOCK_MONOTONIC).
+// PulseAudio doesn't give us the hardware timestamps:
+//  TSTAMP is the time we've got the chunk, DELAY is the stream latency (pa_stream_get_latency()) at that moment in frames.
+// The lines are buffered by stdio, and the latency is interpolated from the last timing update: no syscalls except reading the clock.
+FILE* tsfile_open(const char *fn, u_int rate)
+{
+	FILE *f = fopen(fn, "w");
+	assert(f != NULL);
+	fprintf(f, "# rate %u\n# position tstamp delay\n", rate);
+	return f;
+}
+
+void tsfile_add(FILE *f, uint64_t pos, pa_stream *stm, u_int rate)
 {
+	pa_usec_t usec;
+	int negative;
+	if (0 != pa_stream_get_latency(stm, &usec, &negative))
+		return; // no timing info yet
+	if (negative)
+		usec = 0;
+	pa_usec_t now = pa_rtclock_now();
+	fprintf(f, "%llu %llu.%06llu000 %llu\n"
+		, (unsigned long long)pos, (unsigned long long)(now / 1000000), (unsigned long long)(now % 1000000)
+		, (unsigned long long)(usec * rate / 1000000));
+}
+
+void main(int argc, char **argv)
+{
+	// "-format", "-rate", "-channels", "-buffer", "-period", "-lowlatency", "-device", "-rt", "-cpu": see audio-conf.h
+	// "-timestamps": write the capture time of every chunk to the file
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	const char *ts_fn = NULL;
+	for (int i = 1;  i < argc;  i++) {
+		if (audio_conf_arg(&conf, argc, argv, &i)) {
+		} else if (!strcmp(argv[i], "-timestamps") && i + 1 < argc) {
+			ts_fn = argv[++i];
+		}
+	}
+	audio_conf_default(&conf, PCM_S16, 48000, 2, 500);
+
+	// Real-time mode for the device loop (see rt.h): the mainloop thread inherits it
+	rt_enter(conf.rt_prio, conf.cpus);
+
 	pa_context *ctx = sv_connect();
 
 	pa_threaded_mainloop_lock(mloop);
 
-	pa_stream *stm = abuf_create(ctx);
+	pa_stream *stm = abuf_create(ctx, &conf);
+
+	u_int overflows = 0;
+	pa_stream_set_overflow_callback(stm, on_overflow, &overflows);
+
+	const pa_sample_spec *spec = pa_stream_get_sample_spec(stm);
+	u_int frame_size = pa_frame_size(spec);
+	static struct writer w;
+	assert(NULL != (w.ring = ringbuf_alloc_frames((size_t)spec->rate * WRITER_RING_MSEC / 1000, frame_size, RINGBUF_LOCK)));
+
+	// Report signal level every second
+	assert(0 == pcm_meter_init(&w.meter, conf.format, spec->channels, spec->rate));
+	assert(0 == pthread_create(&w.thread, NULL, stdout_writer, &w));
 
 	// Properly handle SIGINT from user
 	struct sigaction sa = {};
 	sa.sa_handler = on_sigint;
 	sigaction(SIGINT, &sa, NULL);
 
+	struct latency lat = {};
+
+	FILE *ts_file = NULL;
+	uint64_t pos = 0; // frames passed to the stdout writer
+	if (ts_fn != NULL)
+		ts_file = tsfile_open(ts_fn, spec->rate);
+
 	// Read audio samples from audio buffer and pass to stdout
 	while (!quit) {
 
@@ -141,16 +348,28 @@ void main()
 			// Buffer is empty. Process more events
 			pa_threaded_mainloop_wait(mloop);
 			continue;
+		}
+
+		if (ts_file != NULL)
+			tsfile_add(ts_file, pos, stm, spec->rate);
 
-		} else if (data == NULL && n != 0) {
-			// Buffer overrun occurred
+		size_t stored;
+		if (data == NULL) {
+			// Buffer overrun occurred: keep the timing by passing silence instead of the lost data
+			stored = writer_put(&w, NULL, n);
+			w.holes++;
+			w.hole_bytes += n;
+			char ts[16];
+			fprintf(stderr, "%s: hole: %zu frames of silence\n", pcm_glitch_time(ts), n / frame_size);
 
 		} else {
-			write(1, data, n);
+			stored = writer_put(&w, data, n);
 		}
+		pos += stored / frame_size;
 
 		// Mark the data chunk as read
 		pa_stream_drop(stm);
+		latency_update(&lat, stm);
 	}
 
 	pa_stream_disconnect(stm);
@@ -158,4 +377,14 @@ void main()
 	pa_threaded_mainloop_unlock(mloop);
 
 	sv_disconnect(ctx);
+
+	// Write the rest of the data
+	atomic_store(&w.stop, 1);
+	pthread_join(w.thread, NULL);
+	ringbuf_free(w.ring);
+
+	if (ts_file != NULL)
+		fclose(ts_file);
+	fprintf(stderr, "Overruns: server %u, holes %u (%zu frames of silence), stdout %u (%zu frames lost)\n"
+		, overflows, w.holes, w.hole_bytes / frame_size, w.drops, w.drop_bytes / frame_size);
 }
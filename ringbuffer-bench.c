@@ -0,0 +1,326 @@
+/** Audio API Quick Start Guide: Ring buffer contention benchmark
+Producer and consumer threads stream data through the ring buffer with small chunks
+ (like an audio callback does) and the throughput is compared against the previous ring buffer layout.
+Only one word per cache line is written and checked (the stream offset of the line),
+ so the time is spent on moving the lines and the indexes between the CPUs, not on copying bytes.
+ CHUNK_SIZE is rounded up to the cache line size.
+Then the multi-producer mode is measured with 1..MAX_PRODUCERS threads writing into one buffer.
+Usage: ringbuffer-bench [CHUNK_SIZE] [TOTAL_MB] [MAX_PRODUCERS]
+Link with -lpthread */
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "ringbuffer.h"
+
+// The previous layout: all indexes in one cache line, compiler-only barriers (valid on x86 only)
+typedef struct {
+	size_t cap;
+	size_t mask;
+	size_t whead, wtail;
+	size_t rhead, rtail;
+	char data[0];
+} legacy_ringbuffer;
+
+#define INT_READONCE(obj)  (*(volatile __typeof__(obj)*)&(obj))
+#define INT_WRITEONCE(obj, val)  (*(volatile __typeof__(obj)*)&(obj) = (val))
+#define compiler_barrier()  __asm volatile("" : : : "memory")
+
+static legacy_ringbuffer* legacy_alloc(size_t cap)
+{
+	legacy_ringbuffer *b = (legacy_ringbuffer*)malloc(sizeof(legacy_ringbuffer) + cap);
+	b->whead = b->wtail = 0;
+	b->rhead = b->rtail = 0;
+	b->cap = cap;
+	b->mask = cap - 1;
+	return b;
+}
+
+static size_t legacy_write_begin(legacy_ringbuffer *b, size_t n, ringbuffer_chunk *dst)
+{
+	size_t wh = b->whead;
+	size_t _free = b->cap + INT_READONCE(b->rtail) - wh;
+	compiler_barrier();
+	size_t i = wh & b->mask;
+	if (n > _free)
+		n = _free;
+	if (i + n > b->cap)
+		n = b->cap - i;
+	b->whead = wh + n;
+	dst->ptr = b->data + i;
+	dst->len = n;
+	return wh + n;
+}
+
+static void legacy_write_finish(legacy_ringbuffer *b, size_t nwh)
+{
+	compiler_barrier();
+	INT_WRITEONCE(b->wtail, nwh);
+}
+
+static size_t legacy_read_begin(legacy_ringbuffer *b, size_t n, ringbuffer_chunk *dst)
+{
+	size_t rh = b->rhead;
+	size_t _used = INT_READONCE(b->wtail) - rh;
+	compiler_barrier();
+	size_t i = rh & b->mask;
+	if (n > _used)
+		n = _used;
+	if (i + n > b->cap)
+		n = b->cap - i;
+	b->rhead = rh + n;
+	dst->ptr = b->data + i;
+	dst->len = n;
+	return rh + n;
+}
+
+static void legacy_read_finish(legacy_ringbuffer *b, size_t nrh)
+{
+	compiler_barrier();
+	INT_WRITEONCE(b->rtail, nrh);
+}
+
+#define LINE  RINGBUF_CACHELINE
+
+/** Write the stream offset into the first word of each cache line
+Return the sum of the written values */
+static uint64_t stamp(char *p, size_t n, uint64_t off)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0;  i < n;  i += LINE) {
+		uint64_t v = off + i;
+		memcpy(p + i, &v, sizeof(v));
+		sum += v;
+	}
+	return sum;
+}
+
+/** Read the words written by stamp()
+off: the expected stream offset;  -1: don't check
+Return the sum of the values */
+static uint64_t unstamp(const char *p, size_t n, uint64_t off)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0;  i < n;  i += LINE) {
+		uint64_t v;
+		memcpy(&v, p + i, sizeof(v));
+		if (off != (uint64_t)-1)
+			assert(v == off + i);
+		sum += v;
+	}
+	return sum;
+}
+
+struct bench {
+	int legacy;
+	void *ring;
+	size_t chunk;
+	uint64_t total; // bytes
+	uint64_t checksum_w, checksum_r;
+};
+
+static void* producer(void *param)
+{
+	struct bench *bn = param;
+	uint64_t off = 0, sum = 0;
+	while (off < bn->total) {
+		ringbuffer_chunk d;
+		size_t h;
+		if (bn->legacy)
+			h = legacy_write_begin(bn->ring, bn->chunk, &d);
+		else
+			h = ringbuf_write_begin(bn->ring, bn->chunk, &d, NULL);
+		if (d.len == 0) {
+			if (bn->legacy)
+				legacy_write_finish(bn->ring, h);
+			sched_yield();
+			continue;
+		}
+
+		sum += stamp(d.ptr, d.len, off);
+		off += d.len;
+
+		if (bn->legacy)
+			legacy_write_finish(bn->ring, h);
+		else
+			ringbuf_write_finish(bn->ring, h);
+	}
+	bn->checksum_w = sum;
+	return NULL;
+}
+
+static void* consumer(void *param)
+{
+	struct bench *bn = param;
+	uint64_t off = 0, sum = 0;
+	while (off < bn->total) {
+		ringbuffer_chunk d;
+		size_t h;
+		if (bn->legacy)
+			h = legacy_read_begin(bn->ring, bn->chunk, &d);
+		else
+			h = ringbuf_read_begin(bn->ring, bn->chunk, &d, NULL);
+		if (d.len == 0) {
+			sched_yield();
+			continue;
+		}
+
+		sum += unstamp(d.ptr, d.len, off);
+		off += d.len;
+
+		if (bn->legacy)
+			legacy_read_finish(bn->ring, h);
+		else
+			ringbuf_read_finish(bn->ring, h);
+	}
+	bn->checksum_r = sum;
+	return NULL;
+}
+
+static double run(int legacy, size_t cap, size_t chunk, uint64_t total)
+{
+	struct bench bn = {};
+	bn.legacy = legacy;
+	bn.chunk = chunk;
+	bn.total = total;
+	if (legacy)
+		bn.ring = legacy_alloc(cap);
+	else
+		bn.ring = ringbuf_alloc(cap);
+	assert(bn.ring != NULL);
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	pthread_t tp, tc;
+	assert(0 == pthread_create(&tp, NULL, producer, &bn));
+	assert(0 == pthread_create(&tc, NULL, consumer, &bn));
+	pthread_join(tp, NULL);
+	pthread_join(tc, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	assert(bn.checksum_w == bn.checksum_r);
+	if (legacy)
+		free(bn.ring);
+	else
+		ringbuf_free(bn.ring);
+
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	return total / sec / (1024*1024);
+}
+
+struct mp_bench {
+	ringbuffer *ring;
+	size_t chunk;
+	uint64_t total; // bytes per producer
+	_Atomic uint64_t checksum_w;
+	uint64_t checksum_r, total_r;
+};
+
+static void* mp_producer(void *param)
+{
+	struct mp_bench *bn = param;
+	uint64_t off = 0, sum = 0;
+	while (off < bn->total) {
+		size_t n = bn->chunk;
+		if (n > bn->total - off)
+			n = bn->total - off;
+
+		ringbuffer_chunk d;
+		size_t h = ringbuf_mp_write_begin(bn->ring, n, &d, NULL);
+		if (d.len == 0) {
+			sched_yield();
+			continue;
+		}
+
+		sum += stamp(d.ptr, d.len, off);
+		off += d.len;
+
+		ringbuf_mp_write_finish(bn->ring, h, d.len);
+	}
+	atomic_fetch_add(&bn->checksum_w, sum);
+	return NULL;
+}
+
+static void* mp_consumer(void *param)
+{
+	struct mp_bench *bn = param;
+	uint64_t off = 0, sum = 0;
+	while (off < bn->total_r) {
+		ringbuffer_chunk d;
+		size_t h = ringbuf_mc_read_begin(bn->ring, bn->chunk, &d, NULL);
+		if (d.len == 0) {
+			sched_yield();
+			continue;
+		}
+
+		// The regions of different producers are interleaved: only the checksum is verified
+		sum += unstamp(d.ptr, d.len, -1);
+		off += d.len;
+
+		ringbuf_mc_read_finish(bn->ring, h, d.len);
+	}
+	bn->checksum_r = sum;
+	return NULL;
+}
+
+static double run_mp(u_int producers, size_t cap, size_t chunk, uint64_t total)
+{
+	struct mp_bench bn = {};
+	bn.chunk = chunk;
+	bn.total = total / producers / LINE * LINE;
+	bn.total_r = bn.total * producers;
+	assert(NULL != (bn.ring = ringbuf_alloc(cap)));
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	pthread_t tp[producers], tc;
+	for (u_int i = 0;  i < producers;  i++) {
+		assert(0 == pthread_create(&tp[i], NULL, mp_producer, &bn));
+	}
+	assert(0 == pthread_create(&tc, NULL, mp_consumer, &bn));
+	for (u_int i = 0;  i < producers;  i++) {
+		pthread_join(tp[i], NULL);
+	}
+	pthread_join(tc, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	assert(bn.checksum_w == bn.checksum_r);
+	ringbuf_free(bn.ring);
+
+	double sec = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+	return bn.total_r / sec / (1024*1024);
+}
+
+int main(int argc, char **argv)
+{
+	size_t chunk = (argc > 1) ? strtoul(argv[1], NULL, 10) : 256;
+	chunk = (chunk + LINE - 1) / LINE * LINE;
+	if (chunk == 0)
+		chunk = LINE;
+	uint64_t total = ((argc > 2) ? strtoull(argv[2], NULL, 10) : 1024) * 1024*1024;
+	u_int max_producers = (argc > 3) ? strtoul(argv[3], NULL, 10) : 4;
+	size_t cap = 64*1024;
+
+	fprintf(stderr, "Ring buffer: capacity %zu, chunk %zu, total %lluMB\n"
+		, cap, chunk, (unsigned long long)(total / (1024*1024)));
+	if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+		fprintf(stderr, "Warning: 1 CPU: producer and consumer take turns instead of running in parallel,"
+			" so there's no contention on the indexes and the layouts can't be compared\n");
+
+	double legacy = run(1, cap, chunk, total);
+	double spsc = run(0, cap, chunk, total);
+	printf("legacy layout: %8.1f MB/s\n", legacy);
+	printf("spsc layout:   %8.1f MB/s  (x%.2f)\n", spsc, spsc / legacy);
+
+	for (u_int i = 1;  i <= max_producers;  i++) {
+		double mp = run_mp(i, cap, chunk, total);
+		printf("mp, %2u producers: %8.1f MB/s\n", i, mp);
+	}
+	return 0;
+}
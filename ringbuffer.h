@@ -1,20 +1,210 @@
-/** Audio API Quick Start Guide: Ring buffer (for sample code only) */
+/** Audio API Quick Start Guide: Ring buffer (for sample code only)
+Lock-free single-producer single-consumer ring buffer.
+Producer and consumer each own a separate cache line and keep a cached copy of the other side's index,
+ so the shared line is touched only when the cached value isn't enough to satisfy the request.
+A mirrored buffer maps the same memory pages twice, back to back,
+ so that any region of up to 'cap' bytes is contiguous and never needs to be split at the wrap point.
+ringbuf_mp_*() and ringbuf_mc_*() functions allow several producer or consumer threads to use the same buffer:
+ regions are reserved with CAS and committed in order of reservation.
+ringbuf_alloc_mem() allocates data region in virtual memory:
+ it may be mirrored, backed by huge pages, pre-faulted and locked in RAM so that a real-time thread never takes a page fault.
+Frame buffer (ringbuf_alloc_frames()) is a mirrored buffer that reserves and commits whole audio frames only,
+ so a frame is never split at the wrap point and its capacity is a multiple of frame size.
+ringbuf_wait_writable() and ringbuf_wait_readable() block the thread until the other side moves its index far enough.
+ On Linux they sleep on a futex; the other side issues a wake-up syscall only when a waiter is actually parked.
+Compile with RINGBUF_STATS to count fill level watermarks, short reads and full events (see ringbuf_stats()).
+ Without it the counters don't exist at all. */
 
+#pragma once
+#include <stdatomic.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+	#include <sys/syscall.h>
+	#include <linux/memfd.h>
+	#include <linux/futex.h>
+#endif
 
-#define INT_READONCE(obj)  (*(volatile __typeof__(obj)*)&(obj))
-#define INT_WRITEONCE(obj, val)  (*(volatile __typeof__(obj)*)&(obj) = (val))
+#ifndef RINGBUF_CACHELINE
+	#define RINGBUF_CACHELINE  64
+#endif
 
-#define fence_release()  __asm volatile("" : : : "memory")
-#define fence_acquire()  __asm volatile("" : : : "memory")
+#define _ringbuf_aligned  _Alignas(RINGBUF_CACHELINE)
 
+#if defined __x86_64__ || defined __i386__
+	#define _ringbuf_cpu_relax()  __builtin_ia32_pause()
+#elif defined __aarch64__ || defined __arm__
+	#define _ringbuf_cpu_relax()  __asm volatile("yield" : : : "memory")
+#else
+	#define _ringbuf_cpu_relax()
+#endif
+
+/** Wait until 'tail' reaches 'pos'.
+Spin for a short time, then yield the CPU in case the thread we're waiting for has been preempted. */
+static inline void _ringbuf_wait_tail(_Atomic size_t *tail, size_t pos)
+{
+	for (unsigned i = 0;  atomic_load_explicit(tail, memory_order_acquire) != pos;  i++) {
+		if (i < 64)
+			_ringbuf_cpu_relax();
+		else
+			sched_yield();
+	}
+}
+
+#ifdef __linux__
+/** Futex operates on a 32-bit word: use the lower half of the index */
+static inline uint32_t* _ringbuf_futex_word(_Atomic size_t *index)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ && __SIZEOF_SIZE_T__ == 8
+	return (uint32_t*)index + 1;
+#else
+	return (uint32_t*)index;
+#endif
+}
+#endif
+
+/** The threads waiting until an index reaches some position.
+The indexes wrap around (and the futex sees only the lower 32 bits), so the positions are compared by their difference.
+With several waiters (e.g. the consumers of ringbuf_mc_*()) 'target' holds only one of their positions:
+ then every update wakes them all, and each one checks its own position again. */
 typedef struct {
-	size_t cap;
-	size_t mask;
-	size_t whead, wtail;
-	size_t rhead, rtail;
-	char data[0];
+	_Atomic size_t target; // position the single waiter waits for
+	_Atomic unsigned n; // N of waiting threads
+} _ringbuf_waiter;
+
+/** Wake the threads waiting until 'index' reaches some position.
+Called after 'index' is updated.  No syscall is performed unless there's a waiter whose position is reached. */
+static inline void _ringbuf_notify(_Atomic size_t *index, _ringbuf_waiter *w, size_t pos)
+{
+#ifdef __linux__
+	// Pairs with the fence in _ringbuf_wait(): either we see the waiter, or the waiter sees the new index
+	atomic_thread_fence(memory_order_seq_cst);
+	unsigned n = atomic_load_explicit(&w->n, memory_order_relaxed);
+	if (n > 1
+		|| (n == 1 && (ptrdiff_t)(pos - atomic_load_explicit(&w->target, memory_order_relaxed)) >= 0))
+		syscall(SYS_futex, _ringbuf_futex_word(index), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/** Block until 'index' reaches 'target' position.
+timeout_ms: -1: infinite
+Return 0 on success;
+ -1 on timeout (errno = ETIMEDOUT) or signal (errno = EINTR) */
+static inline int _ringbuf_wait(_Atomic size_t *index, _ringbuf_waiter *w, size_t target, int timeout_ms)
+{
+	struct timespec now, end;
+	if (timeout_ms >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout_ms / 1000;
+		end.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (end.tv_nsec >= 1000000000) {
+			end.tv_sec++;
+			end.tv_nsec -= 1000000000;
+		}
+	}
+
+	int r = 0;
+	atomic_fetch_add_explicit(&w->n, 1, memory_order_relaxed);
+	for (;;) {
+		atomic_store_explicit(&w->target, target, memory_order_relaxed);
+		atomic_thread_fence(memory_order_seq_cst);
+		size_t pos = atomic_load_explicit(index, memory_order_acquire);
+		if ((ptrdiff_t)(pos - target) >= 0)
+			break;
+
+		struct timespec ts, *pts = NULL;
+		if (timeout_ms >= 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ts.tv_sec = end.tv_sec - now.tv_sec;
+			ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+			if (ts.tv_nsec < 0) {
+				ts.tv_sec--;
+				ts.tv_nsec += 1000000000;
+			}
+			if (ts.tv_sec < 0) {
+				errno = ETIMEDOUT;
+				r = -1;
+				break;
+			}
+			pts = &ts;
+		}
+
+#ifdef __linux__
+		// Sleep until the index is changed (the call returns immediately if it has changed already)
+		if (0 != syscall(SYS_futex, _ringbuf_futex_word(index), FUTEX_WAIT_PRIVATE, (uint32_t)pos, pts, NULL, 0)
+			&& errno == EINTR) {
+			r = -1;
+			break;
+		}
+#else
+		// No futex: poll with a short interval
+		(void)pts;
+		if (0 != usleep(1000) && errno == EINTR) {
+			r = -1;
+			break;
+		}
+#endif
+	}
+
+	// Another waiter may have overwritten 'target' with its position:
+	// leave a position that is already reached, so the next update wakes the remaining waiter and it sets its own
+	atomic_store_explicit(&w->target, atomic_load_explicit(index, memory_order_relaxed), memory_order_relaxed);
+	atomic_fetch_sub_explicit(&w->n, 1, memory_order_release);
+	return r;
+}
+
+#ifdef RINGBUF_STATS
+	#define _RINGBUF_STAT(expr)  expr
+#else
+	#define _RINGBUF_STAT(expr)
+#endif
+
+typedef struct {
+	size_t written, read; // total bytes
+	size_t full; // N of write requests that didn't fit into free space
+	size_t short_reads; // N of read requests for which there wasn't enough data
+	size_t high, low; // watermarks: max/min amount of data (bytes) seen in buffer
+} ringbuffer_stats;
+
+typedef struct {
+	// Read-only after allocation
+	_ringbuf_aligned
+	size_t cap; // usable capacity
+	size_t mask; // storage size - 1
+	size_t span; // max. contiguous region end: storage size or 2*storage size for a mirrored buffer
+	size_t frame_size; // 1 for a byte buffer
+	unsigned flags; // enum RINGBUF_F: flags applied at allocation
+	size_t mapped; // size of virtual memory region; 0 if allocated on heap
+	char *data;
+
+	// Producer
+	_ringbuf_aligned
+	_Atomic size_t whead; // reserved by ringbuf_write_begin()
+	_Atomic size_t wtail; // committed by ringbuf_write_finish()
+	size_t rtail_cache; // producer's copy of 'rtail'
+	_ringbuf_waiter rwait; // consumers waiting for 'wtail'
+#ifdef RINGBUF_STATS
+	_Atomic size_t st_written, st_full, st_high;
+#endif
+
+	// Consumer
+	_ringbuf_aligned
+	_Atomic size_t rhead; // locked by ringbuf_read_begin()
+	_Atomic size_t rtail; // released by ringbuf_read_finish()
+	size_t wtail_cache; // consumer's copy of 'wtail'
+	_ringbuf_waiter wwait; // producers waiting for 'rtail'
+#ifdef RINGBUF_STATS
+	_Atomic size_t st_read, st_short, st_low;
+#endif
 } ringbuffer;
 
 typedef struct {
@@ -22,61 +212,351 @@ typedef struct {
 	size_t len;
 } ringbuffer_chunk;
 
+#ifdef RINGBUF_STATS
+
+static inline void _ringbuf_stat_add(_Atomic size_t *c, size_t n, int shared)
+{
+	if (shared)
+		atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+	else
+		atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+/** Producer: account a reservation.
+shared: multi-producer mode
+used: amount of data in buffer after the reservation (from producer's point of view) */
+static inline void _ringbuf_stat_write(ringbuffer *b, int shared, int full, size_t n, size_t used)
+{
+	_ringbuf_stat_add(&b->st_written, n, shared);
+	if (full)
+		_ringbuf_stat_add(&b->st_full, 1, shared);
+	if (used > atomic_load_explicit(&b->st_high, memory_order_relaxed))
+		atomic_store_explicit(&b->st_high, used, memory_order_relaxed);
+}
+
+/** Consumer: account a read.
+shared: multi-consumer mode
+used: amount of data in buffer before the read (from consumer's point of view) */
+static inline void _ringbuf_stat_read(ringbuffer *b, int shared, int short_read, size_t n, size_t used)
+{
+	_ringbuf_stat_add(&b->st_read, n, shared);
+	if (short_read)
+		_ringbuf_stat_add(&b->st_short, 1, shared);
+	if (used < atomic_load_explicit(&b->st_low, memory_order_relaxed))
+		atomic_store_explicit(&b->st_low, used, memory_order_relaxed);
+}
+
+/** Get a snapshot of buffer statistics.
+May be called from any thread.
+Watermarks are approximate: each side uses its cached copy of the other side's position. */
+static inline void ringbuf_stats(ringbuffer *b, ringbuffer_stats *st)
+{
+	st->written = atomic_load_explicit(&b->st_written, memory_order_relaxed);
+	st->full = atomic_load_explicit(&b->st_full, memory_order_relaxed);
+	st->high = atomic_load_explicit(&b->st_high, memory_order_relaxed);
+	st->read = atomic_load_explicit(&b->st_read, memory_order_relaxed);
+	st->short_reads = atomic_load_explicit(&b->st_short, memory_order_relaxed);
+	st->low = atomic_load_explicit(&b->st_low, memory_order_relaxed);
+	if (st->low == SIZE_MAX)
+		st->low = 0;
+}
+
+#endif
+
+enum RINGBUF_F {
+	RINGBUF_MIRROR = 1, // map data region twice in virtual memory
+	RINGBUF_HUGEPAGE = 2, // use huge pages: MAP_HUGETLB if reserved by the system, otherwise ask for transparent huge pages (Linux)
+		// In 'flags' field: set only if MAP_HUGETLB has succeeded;  transparent huge pages are only a hint to the kernel
+	RINGBUF_LOCK = 4, // pre-fault all pages and lock them in RAM
+};
+
+#ifndef RINGBUF_HUGEPAGE_SIZE
+	#define RINGBUF_HUGEPAGE_SIZE  (2*1024*1024)
+#endif
+
+/** Round up to the power of 2
+Return 0 if the result doesn't fit into size_t */
+static inline size_t _ringbuf_pow2(size_t n)
+{
+	if (n <= 1 || !(n & (n - 1)))
+		return n;
+	unsigned bits = 8 * sizeof(unsigned long long) - __builtin_clzll((unsigned long long)n - 1);
+	if (bits >= 8 * sizeof(size_t))
+		return 0;
+	return (size_t)1 << bits;
+}
+
+static inline void _ringbuf_init(ringbuffer *b, size_t cap, char *data, size_t span)
+{
+	b->cap = cap;
+	b->mask = cap - 1;
+	b->span = span;
+	b->frame_size = 1;
+	b->flags = 0;
+	b->mapped = 0;
+	b->data = data;
+	b->rtail_cache = b->wtail_cache = 0;
+	atomic_init(&b->whead, 0);
+	atomic_init(&b->wtail, 0);
+	atomic_init(&b->rhead, 0);
+	atomic_init(&b->rtail, 0);
+	atomic_init(&b->rwait.target, 0);
+	atomic_init(&b->rwait.n, 0);
+	atomic_init(&b->wwait.target, 0);
+	atomic_init(&b->wwait.n, 0);
+#ifdef RINGBUF_STATS
+	atomic_init(&b->st_written, 0);
+	atomic_init(&b->st_full, 0);
+	atomic_init(&b->st_high, 0);
+	atomic_init(&b->st_read, 0);
+	atomic_init(&b->st_short, 0);
+	atomic_init(&b->st_low, SIZE_MAX);
+#endif
+}
+
 /** Allocate buffer
 cap: max size; automatically aligned to the power of 2
 Return NULL on error */
 static inline ringbuffer* ringbuf_alloc(size_t cap)
 {
-	int one = __builtin_clz(cap - 1) + 1;
-	cap = 1U << (64 - one + 1);
-	ringbuffer *b = (ringbuffer*)malloc(sizeof(ringbuffer) + cap);
+	cap = _ringbuf_pow2(cap);
+	if (cap == 0)
+		return NULL;
+	ringbuffer *b;
+	if (0 != posix_memalign((void**)&b, RINGBUF_CACHELINE, sizeof(ringbuffer) + cap))
+		return NULL;
+	_ringbuf_init(b, cap, (char*)(b + 1), cap);
+	return b;
+}
+
+/** Create an anonymous shared memory object for a mirrored buffer */
+static inline int _ringbuf_shm(size_t size, unsigned hugepage)
+{
+	int fd;
+#ifdef __linux__
+	fd = syscall(SYS_memfd_create, "ringbuffer", MFD_CLOEXEC | ((hugepage) ? MFD_HUGETLB : 0));
+#else
+	if (hugepage)
+		return -1;
+	// The name is short: macOS limits it to 31 characters (PSHMNAMLEN).
+	// The object is unlinked right away, so the name is only needed to be unique for a moment.
+	static _Atomic unsigned counter;
+	char name[32];
+	for (int i = 0;  ;  i++) {
+		snprintf(name, sizeof(name), "/rb%x.%x", (unsigned)getpid(), atomic_fetch_add(&counter, 1));
+		if (0 <= (fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600))) {
+			shm_unlink(name);
+			break;
+		}
+		if (errno != EEXIST || i == 100)
+			break;
+	}
+#endif
+	if (fd >= 0 && 0 != ftruncate(fd, size)) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/** Map shared memory object twice
+Return NULL on error */
+static inline char* _ringbuf_map_mirror(size_t size, unsigned hugepage)
+{
+	int fd = _ringbuf_shm(size, hugepage);
+	if (fd < 0)
+		return NULL;
+
+	// Reserve address space for 2 copies, then map the object to both halves.
+	// Huge pages can be mapped only at an address aligned to the huge page size:
+	//  reserve more and cut off the unaligned head and the rest of the tail.
+	size_t align = (hugepage) ? RINGBUF_HUGEPAGE_SIZE : 1;
+	char *r = mmap(NULL, 2 * size + align - 1, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	char *p = r;
+	if (r != MAP_FAILED && align != 1) {
+		p = (char*)(((uintptr_t)r + align - 1) & ~(uintptr_t)(align - 1));
+		if (p != r)
+			munmap(r, p - r);
+		if (p + 2 * size != r + 2 * size + align - 1)
+			munmap(p + 2 * size, (r + 2 * size + align - 1) - (p + 2 * size));
+	}
+	if (p != MAP_FAILED
+		&& (MAP_FAILED == mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0)
+			|| MAP_FAILED == mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0))) {
+		munmap(p, 2 * size);
+		p = MAP_FAILED;
+	}
+	close(fd);
+	return (p != MAP_FAILED) ? p : NULL;
+}
+
+/** Map data region: once or twice (RINGBUF_MIRROR).
+Set 'flags' field to the actually applied flags.
+Return 0 on success */
+static inline int _ringbuf_map(ringbuffer *b, size_t size, unsigned flags)
+{
+	unsigned applied = 0;
+	char *p = MAP_FAILED;
+	size_t span = size;
+
+	if (flags & RINGBUF_MIRROR) {
+		span = 2 * size;
+		p = NULL;
+		if (flags & RINGBUF_HUGEPAGE) {
+			// Fails if the system has no huge pages reserved
+			if (NULL != (p = _ringbuf_map_mirror(size, 1)))
+				applied |= RINGBUF_HUGEPAGE;
+		}
+		if (p == NULL
+			&& NULL == (p = _ringbuf_map_mirror(size, 0)))
+			return -1;
+		applied |= RINGBUF_MIRROR;
+
+	} else {
+#ifdef MAP_HUGETLB
+		if (flags & RINGBUF_HUGEPAGE) {
+			p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED)
+				applied |= RINGBUF_HUGEPAGE;
+		}
+#endif
+		if (p == MAP_FAILED) {
+			p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p == MAP_FAILED)
+				return -1;
+		}
+	}
+
+#ifdef MADV_HUGEPAGE
+	// Ask for transparent huge pages if they weren't reserved explicitly.
+	// It's only a hint: the kernel may still use normal pages, so RINGBUF_HUGEPAGE isn't reported as applied.
+	if ((flags & RINGBUF_HUGEPAGE) && !(applied & RINGBUF_HUGEPAGE))
+		madvise(p, span, MADV_HUGEPAGE);
+#endif
+
+	if (flags & RINGBUF_LOCK) {
+		// Touch every page now so the audio callback never takes a page fault,
+		//  then lock both halves in RAM
+		long page = sysconf(_SC_PAGESIZE);
+		for (size_t i = 0;  i < size;  i += page) {
+			((volatile char*)p)[i] = 0;
+		}
+		if (0 == mlock(p, span))
+			applied |= RINGBUF_LOCK;
+	}
+
+	b->data = p;
+	b->span = span;
+	b->mapped = span;
+	b->flags = applied;
+	return 0;
+}
+
+/** Allocate buffer in virtual memory.
+cap: max size; automatically aligned to the power of 2 and to the page size
+  (or to the huge page size with RINGBUF_HUGEPAGE)
+flags: enum RINGBUF_F
+  Failure to apply RINGBUF_HUGEPAGE or RINGBUF_LOCK isn't an error: check 'flags' field for the applied flags.
+Return NULL on error */
+static inline ringbuffer* ringbuf_alloc_mem(size_t cap, unsigned flags)
+{
+	size_t page = (flags & RINGBUF_HUGEPAGE) ? RINGBUF_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+	if (cap < page)
+		cap = page;
+	cap = _ringbuf_pow2(cap);
+	if (cap == 0)
+		return NULL;
+
+	ringbuffer *b;
+	if (0 != posix_memalign((void**)&b, RINGBUF_CACHELINE, sizeof(ringbuffer)))
+		return NULL;
+	_ringbuf_init(b, cap, NULL, cap);
+
+	if (0 != _ringbuf_map(b, cap, flags)) {
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+/** Allocate mirrored buffer: data region is mapped twice in virtual memory.
+Every region returned by ringbuf_write_begin()/ringbuf_read_begin() is contiguous up to 'cap' bytes.
+cap: max size; automatically aligned to the power of 2 and to the page size
+Return NULL on error */
+static inline ringbuffer* ringbuf_alloc_mirrored(size_t cap)
+{
+	return ringbuf_alloc_mem(cap, RINGBUF_MIRROR);
+}
+
+/** Allocate mirrored buffer for audio frames.
+Use ringbuf_*_frames() functions or always request a multiple of 'frame_size' bytes.
+frames: max number of frames
+frame_size: size of 1 audio frame (sample size * channels)
+flags: enum RINGBUF_F; RINGBUF_MIRROR is always set
+Return NULL on error */
+static inline ringbuffer* ringbuf_alloc_frames(size_t frames, size_t frame_size, unsigned flags)
+{
+	ringbuffer *b = ringbuf_alloc_mem(frames * frame_size, flags | RINGBUF_MIRROR);
 	if (b == NULL)
 		return NULL;
-	b->whead = b->wtail = 0;
-	b->rhead = b->rtail = 0;
-	b->cap = cap;
-	b->mask = cap - 1;
+	b->frame_size = frame_size;
+	b->cap -= b->cap % frame_size;
 	return b;
 }
 
 static inline void ringbuf_free(ringbuffer *b)
 {
+	if (b == NULL)
+		return;
+	if (b->mapped != 0) {
+		if (b->flags & RINGBUF_LOCK)
+			munlock(b->data, b->mapped);
+		munmap(b->data, b->mapped);
+	}
 	free(b);
 }
 
 /** Reserve contiguous free space region with the maximum size of 'n' bytes.
-free: (output) amount of free space after the operation
+free: (optional, output) amount of free space after the operation.
+  When set, the consumer's position is always re-read, so the value is exact at the time of the call.
 Return value for ringbuf_write_finish() */
 static inline size_t ringbuf_write_begin(ringbuffer *b, size_t n, ringbuffer_chunk *dst, size_t *free)
 {
-	size_t wh, nwh;
-	wh = b->whead;
-	size_t _free = b->cap + INT_READONCE(b->rtail) - wh;
-	fence_acquire();
+	size_t wh = atomic_load_explicit(&b->whead, memory_order_relaxed);
+	size_t _free = b->cap + b->rtail_cache - wh;
+	if (n > _free || free != NULL) {
+		// Not enough space according to the cached position: synchronize with consumer
+		b->rtail_cache = atomic_load_explicit(&b->rtail, memory_order_acquire);
+		_free = b->cap + b->rtail_cache - wh;
+	}
 
 	size_t i = wh & b->mask;
+	_RINGBUF_STAT(int full = (n > _free));
 	if (n > _free)
 		n = _free;
-	if (i + n > b->cap)
-		n = b->cap - i;
+	if (i + n > b->span)
+		n = b->span - i;
+	_RINGBUF_STAT(_ringbuf_stat_write(b, 0, full, n, b->cap - _free + n));
 
-	nwh = wh + n;
-	b->whead = nwh;
+	size_t nwh = wh + n;
+	atomic_store_explicit(&b->whead, nwh, memory_order_relaxed);
 
 	dst->ptr = b->data + i;
 	dst->len = n;
 
 	if (free != NULL)
 		*free = _free - n;
-	return wh;
+	return nwh;
 }
 
 /** Commit data reserved by ringbuf_write_begin().
-nwh: return value from ringbuf_write_begin() */
+nwh: return value from ringbuf_write_begin();
+  or less (but not less than the start of the region): the rest of the region is returned to free space */
 static inline void ringbuf_write_finish(ringbuffer *b, size_t nwh)
 {
-	fence_release();
-	INT_WRITEONCE(b->wtail, nwh);
+	atomic_store_explicit(&b->whead, nwh, memory_order_relaxed);
+	atomic_store_explicit(&b->wtail, nwh, memory_order_release);
+	_ringbuf_notify(&b->wtail, &b->rwait, nwh);
 }
 
 /** Write some data
@@ -94,36 +574,177 @@ static inline size_t ringbuf_write(ringbuffer *b, const void *src, size_t n)
 }
 
 /** Lock contiguous data region with the maximum size of 'n' bytes.
-used: (output) amount of used space after the operation
+used: (optional, output) amount of used space after the operation.
+  When set, the producer's position is always re-read, so the value is exact at the time of the call.
 Return value for ringbuf_read_finish() */
 static inline size_t ringbuf_read_begin(ringbuffer *b, size_t n, ringbuffer_chunk *dst, size_t *used)
 {
-	size_t rh, nrh;
-	rh = b->rhead;
-	size_t _used = INT_READONCE(b->wtail) - rh;
-	fence_acquire();
+	size_t rh = atomic_load_explicit(&b->rhead, memory_order_relaxed);
+	size_t _used = b->wtail_cache - rh;
+	if (n > _used || used != NULL) {
+		// Not enough data according to the cached position: synchronize with producer
+		b->wtail_cache = atomic_load_explicit(&b->wtail, memory_order_acquire);
+		_used = b->wtail_cache - rh;
+	}
 
 	size_t i = rh & b->mask;
+	_RINGBUF_STAT(int short_read = (n > _used));
 	if (n > _used)
 		n = _used;
-	if (i + n > b->cap)
-		n = b->cap - i;
+	if (i + n > b->span)
+		n = b->span - i;
+	_RINGBUF_STAT(_ringbuf_stat_read(b, 0, short_read, n, _used));
 
-	nrh = rh + n;
-	b->rhead = nrh;
+	size_t nrh = rh + n;
+	atomic_store_explicit(&b->rhead, nrh, memory_order_relaxed);
 
 	dst->ptr = b->data + i;
 	dst->len = n;
 
 	if (used != NULL)
 		*used = _used - n;
-	return rh;
+	return nrh;
 }
 
 /** Discard the locked data region.
 nrh: return value from ringbuf_read_begin() */
 static inline void ringbuf_read_finish(ringbuffer *b, size_t nrh)
 {
-	fence_release();
-	INT_WRITEONCE(b->rtail, nrh);
+	atomic_store_explicit(&b->rtail, nrh, memory_order_release);
+	_ringbuf_notify(&b->rtail, &b->wwait, nrh);
+}
+
+/** Reserve contiguous free space region for up to 'frames' whole frames.
+dst: (output) region; 'len' is a multiple of frame size
+free_frames: (optional, output) N of free frames after the operation
+Return value for ringbuf_write_finish() */
+static inline size_t ringbuf_write_begin_frames(ringbuffer *b, size_t frames, ringbuffer_chunk *dst, size_t *free_frames)
+{
+	size_t n = (frames < b->cap) ? frames * b->frame_size : b->cap;
+	size_t free;
+	size_t h = ringbuf_write_begin(b, n, dst, (free_frames != NULL) ? &free : NULL);
+	if (free_frames != NULL)
+		*free_frames = free / b->frame_size;
+	return h;
+}
+
+/** Lock contiguous data region with up to 'frames' whole frames.
+dst: (output) region; 'len' is a multiple of frame size
+used_frames: (optional, output) N of frames left in buffer after the operation
+Return value for ringbuf_read_finish() */
+static inline size_t ringbuf_read_begin_frames(ringbuffer *b, size_t frames, ringbuffer_chunk *dst, size_t *used_frames)
+{
+	size_t n = (frames < b->cap) ? frames * b->frame_size : b->cap;
+	size_t used;
+	size_t h = ringbuf_read_begin(b, n, dst, (used_frames != NULL) ? &used : NULL);
+	if (used_frames != NULL)
+		*used_frames = used / b->frame_size;
+	return h;
+}
+
+/** Multi-producer version of ringbuf_write_begin(): may be called from several threads concurrently.
+Return value for ringbuf_mp_write_finish() */
+static inline size_t ringbuf_mp_write_begin(ringbuffer *b, size_t n, ringbuffer_chunk *dst, size_t *free)
+{
+	size_t wh = atomic_load_explicit(&b->whead, memory_order_relaxed);
+	size_t _free, nwh, i, nn;
+	do {
+		_free = b->cap + atomic_load_explicit(&b->rtail, memory_order_acquire) - wh;
+		i = wh & b->mask;
+		nn = n;
+		if (nn > _free)
+			nn = _free;
+		if (i + nn > b->span)
+			nn = b->span - i;
+		nwh = wh + nn;
+	} while (nn != 0
+		&& !atomic_compare_exchange_weak_explicit(&b->whead, &wh, nwh, memory_order_relaxed, memory_order_relaxed));
+
+	_RINGBUF_STAT(_ringbuf_stat_write(b, 1, n > _free, nn, b->cap - _free + nn));
+	dst->ptr = b->data + i;
+	dst->len = nn;
+
+	if (free != NULL)
+		*free = _free - nn;
+	return nwh;
+}
+
+/** Commit data reserved by ringbuf_mp_write_begin().
+Regions are committed in the order they were reserved:
+ the function waits until all producers that reserved earlier regions commit them.
+nwh: return value from ringbuf_mp_write_begin()
+n: region length */
+static inline void ringbuf_mp_write_finish(ringbuffer *b, size_t nwh, size_t n)
+{
+	if (n == 0)
+		return;
+	_ringbuf_wait_tail(&b->wtail, nwh - n);
+	atomic_store_explicit(&b->wtail, nwh, memory_order_release);
+	_ringbuf_notify(&b->wtail, &b->rwait, nwh);
+}
+
+/** Multi-consumer version of ringbuf_read_begin(): may be called from several threads concurrently.
+Return value for ringbuf_mc_read_finish() */
+static inline size_t ringbuf_mc_read_begin(ringbuffer *b, size_t n, ringbuffer_chunk *dst, size_t *used)
+{
+	size_t rh = atomic_load_explicit(&b->rhead, memory_order_relaxed);
+	size_t _used, nrh, i, nn;
+	do {
+		_used = atomic_load_explicit(&b->wtail, memory_order_acquire) - rh;
+		i = rh & b->mask;
+		nn = n;
+		if (nn > _used)
+			nn = _used;
+		if (i + nn > b->span)
+			nn = b->span - i;
+		nrh = rh + nn;
+	} while (nn != 0
+		&& !atomic_compare_exchange_weak_explicit(&b->rhead, &rh, nrh, memory_order_relaxed, memory_order_relaxed));
+
+	_RINGBUF_STAT(_ringbuf_stat_read(b, 1, n > _used, nn, _used));
+	dst->ptr = b->data + i;
+	dst->len = nn;
+
+	if (used != NULL)
+		*used = _used - nn;
+	return nrh;
+}
+
+/** Release data locked by ringbuf_mc_read_begin().
+Regions are released in the order they were locked.
+nrh: return value from ringbuf_mc_read_begin()
+n: region length */
+static inline void ringbuf_mc_read_finish(ringbuffer *b, size_t nrh, size_t n)
+{
+	if (n == 0)
+		return;
+	_ringbuf_wait_tail(&b->rtail, nrh - n);
+	atomic_store_explicit(&b->rtail, nrh, memory_order_release);
+	_ringbuf_notify(&b->rtail, &b->wwait, nrh);
+}
+
+/** Block the producer until at least 'min_bytes' of free space is available.
+min_bytes: limited by 'cap'
+timeout_ms: -1: infinite
+Return 0 on success;
+ -1 on timeout (errno = ETIMEDOUT) or signal (errno = EINTR) */
+static inline int ringbuf_wait_writable(ringbuffer *b, size_t min_bytes, int timeout_ms)
+{
+	if (min_bytes > b->cap)
+		min_bytes = b->cap;
+	size_t wh = atomic_load_explicit(&b->whead, memory_order_relaxed);
+	return _ringbuf_wait(&b->rtail, &b->wwait, wh + min_bytes - b->cap, timeout_ms);
+}
+
+/** Block the consumer until at least 'min_bytes' of data is available.
+min_bytes: limited by 'cap'
+timeout_ms: -1: infinite
+Return 0 on success;
+ -1 on timeout (errno = ETIMEDOUT) or signal (errno = EINTR) */
+static inline int ringbuf_wait_readable(ringbuffer *b, size_t min_bytes, int timeout_ms)
+{
+	if (min_bytes > b->cap)
+		min_bytes = b->cap;
+	size_t rh = atomic_load_explicit(&b->rhead, memory_order_relaxed);
+	return _ringbuf_wait(&b->wtail, &b->rwait, rh + min_bytes, timeout_ms);
 }
@@ -0,0 +1,146 @@
+/** Audio API Quick Start Guide: Real-time mode for the thread that services the audio device (for sample code only)
+With small buffers the thread must wake up in time on every period,
+ even when the other processes load all CPUs or the system is low on memory:
+ * SCHED_FIFO: the thread preempts all normal threads as soon as it's ready to run.
+   A normal user needs the permission: 'rtprio' in /etc/security/limits.conf (RLIMIT_RTPRIO);
+   we raise the soft limit up to the hard limit ourselves.
+ * mlockall(): our memory is never swapped out, so we never wait for a page fault on disk.
+ * The stack we're going to use is touched in advance, so it's already mapped (and locked).
+ * CPU affinity: the thread stays on the CPUs we choose, e.g. the ones not used by other heavy tasks.
+Every step is logged to stderr.  A failure isn't fatal: the tool continues in normal mode.
+Link with -lpthread */
+
+#pragma once
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __linux__
+	#include <sys/syscall.h>
+#endif
+
+#define RT_STACK_PRETOUCH  (256*1024)
+#define RT_MAX_CPUS  1024
+
+typedef unsigned long _rt_cpu_mask[RT_MAX_CPUS / (8 * sizeof(unsigned long))];
+static _rt_cpu_mask _rt_mask_orig;
+static int _rt_mask_saved;
+
+/** Parse CPU list, e.g. "2,3" or "0-3,6"
+Return the number of CPUs in the set;  -1 on error */
+static inline int _rt_cpus_parse(const char *s, _rt_cpu_mask mask)
+{
+	memset(mask, 0, sizeof(_rt_cpu_mask));
+	int n = 0;
+	while (*s != '\0') {
+		char *end;
+		unsigned long lo = strtoul(s, &end, 10), hi = lo;
+		if (end == s)
+			return -1;
+		s = end;
+		if (*s == '-') {
+			s++;
+			hi = strtoul(s, &end, 10);
+			if (end == s || hi < lo)
+				return -1;
+			s = end;
+		}
+		if (*s == ',')
+			s++;
+		else if (*s != '\0')
+			return -1;
+
+		for (unsigned long i = lo;  i <= hi && i < RT_MAX_CPUS;  i++) {
+			mask[i / (8 * sizeof(unsigned long))] |= 1UL << (i % (8 * sizeof(unsigned long)));
+			n++;
+		}
+	}
+	return n;
+}
+
+static __attribute__((noinline)) void _rt_stack_pretouch()
+{
+	volatile char stack[RT_STACK_PRETOUCH];
+	for (size_t i = 0;  i < sizeof(stack);  i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+/** Switch the calling thread to real-time mode.
+The threads it creates afterwards inherit the scheduling and the affinity.
+prio: SCHED_FIFO priority (1..99);  0: don't change the scheduling
+cpus: CPU list, e.g. "2,3" or "0-3";  NULL: don't change the affinity */
+static inline void rt_enter(int prio, const char *cpus)
+{
+	if (prio > 0) {
+		// Lock the memory
+		if (0 == mlockall(MCL_CURRENT | MCL_FUTURE))
+			fprintf(stderr, "RT: memory locked\n");
+		else
+			fprintf(stderr, "RT: mlockall: %s (check RLIMIT_MEMLOCK: ulimit -l)\n", strerror(errno));
+
+		_rt_stack_pretouch();
+
+		// Allow ourselves to use the priority, if the hard limit allows it
+#ifdef RLIMIT_RTPRIO
+		struct rlimit rl;
+		if (0 == getrlimit(RLIMIT_RTPRIO, &rl)
+			&& rl.rlim_cur < (rlim_t)prio && rl.rlim_max >= (rlim_t)prio) {
+			rl.rlim_cur = prio;
+			setrlimit(RLIMIT_RTPRIO, &rl);
+		}
+#endif
+
+		struct sched_param sp = {};
+		sp.sched_priority = prio;
+		int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (r == 0) {
+			fprintf(stderr, "RT: SCHED_FIFO priority %d\n", prio);
+		} else {
+			fprintf(stderr, "RT: can't set SCHED_FIFO priority %d: %s;  running at normal priority"
+				, prio, strerror(r));
+#ifdef RLIMIT_RTPRIO
+			if (0 == getrlimit(RLIMIT_RTPRIO, &rl))
+				fprintf(stderr, " (RLIMIT_RTPRIO is %lu: add '@audio - rtprio %d' to /etc/security/limits.conf)"
+					, (unsigned long)rl.rlim_cur, prio);
+#endif
+			fprintf(stderr, "\n");
+		}
+	}
+
+	if (cpus != NULL) {
+#ifdef __linux__
+		// pid 0: the calling thread
+		_rt_cpu_mask mask;
+		if (0 >= _rt_cpus_parse(cpus, mask)) {
+			fprintf(stderr, "RT: bad CPU list '%s'\n", cpus);
+		} else {
+			if (!_rt_mask_saved && 0 < syscall(SYS_sched_getaffinity, 0, sizeof(_rt_mask_orig), _rt_mask_orig))
+				_rt_mask_saved = 1;
+			if (0 == syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask))
+				fprintf(stderr, "RT: CPU affinity %s\n", cpus);
+			else
+				fprintf(stderr, "RT: can't set CPU affinity %s: %s\n", cpus, strerror(errno));
+		}
+#else
+		fprintf(stderr, "RT: CPU affinity isn't supported on this OS\n");
+#endif
+	}
+}
+
+/** Return the calling thread to normal mode:
+ for the helper threads created by a real-time thread (e.g. reading files), which must not compete with it. */
+static inline void rt_leave()
+{
+	struct sched_param sp = {};
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+#ifdef __linux__
+	if (_rt_mask_saved)
+		syscall(SYS_sched_setaffinity, 0, sizeof(_rt_mask_orig), _rt_mask_orig);
+#endif
+}
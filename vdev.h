@@ -0,0 +1,654 @@
+/** Audio API Quick Start Guide: Virtual audio device (for sample code only)
+The subset of ALSA PCM API that alsa-play and alsa-record use, implemented without any sound hardware:
+ the hardware pointer moves by 1 period on every tick of a timerfd at the stream's rate,
+ so the tools' loops (mmap begin/commit, poll, xrun recovery, draining) run exactly as with a real device.
+Build the ALSA tools with -DUSE_VDEV to use it instead of libasound.
+The device ID is a comma-separated list of options:
+ jitter=USEC: every tick is late by a random time 0..USEC
+ stall=N:MSEC: on every N-th tick the clock stops for MSEC, then the missed periods arrive at once
+ xrun=N: force an underrun (playback) or overrun (capture) on every N-th tick
+ suspend=N:MSEC: on every N-th tick the device is suspended for MSEC (-ESTRPIPE)
+ speed=X: the clock runs X times faster;
+  0: as fast as the application can go, to measure the throughput (jitter and stalls are ignored)
+ seed=N: random seed for the jitter
+ out=FILE: playback: write the played data to the file (and silence for the time the stream is stopped)
+Capture produces the glitch detector's test signal (see pcm-glitch.h) for int16 format with 2+ channels, silence otherwise;
+ the signal continues while the stream is stopped, so the data for this time is lost, as with real hardware.
+The injected events depend on the tick number and the random seed only,
+ so the same options produce the same sequence of events. */
+
+#pragma once
+#include "pcm-glitch.h"
+#include <alloca.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+typedef unsigned long snd_pcm_uframes_t;
+typedef long snd_pcm_sframes_t;
+typedef struct timespec snd_htimestamp_t;
+typedef struct {
+	void *addr;
+	unsigned first, step; // in bits
+} snd_pcm_channel_area_t;
+
+typedef enum { SND_PCM_STREAM_PLAYBACK, SND_PCM_STREAM_CAPTURE } snd_pcm_stream_t;
+typedef enum { SND_PCM_ACCESS_MMAP_INTERLEAVED = 0 } snd_pcm_access_t;
+typedef enum {
+	SND_PCM_FORMAT_S16_LE = 2,
+	SND_PCM_FORMAT_S32_LE = 10,
+	SND_PCM_FORMAT_FLOAT_LE = 14,
+	SND_PCM_FORMAT_S24_3LE = 32,
+} snd_pcm_format_t;
+typedef enum {
+	SND_PCM_STATE_OPEN,
+	SND_PCM_STATE_SETUP,
+	SND_PCM_STATE_PREPARED,
+	SND_PCM_STATE_RUNNING,
+	SND_PCM_STATE_XRUN,
+	SND_PCM_STATE_DRAINING,
+	SND_PCM_STATE_PAUSED,
+	SND_PCM_STATE_SUSPENDED,
+} snd_pcm_state_t;
+typedef enum { SND_PCM_TSTAMP_NONE, SND_PCM_TSTAMP_ENABLE } snd_pcm_tstamp_t;
+typedef enum { SND_PCM_TSTAMP_TYPE_GETTIMEOFDAY, SND_PCM_TSTAMP_TYPE_MONOTONIC } snd_pcm_tstamp_type_t;
+#define SND_PCM_NO_AUTO_CHANNELS  0x00020000
+
+typedef struct {
+	unsigned format, rate, channels;
+	snd_pcm_uframes_t period_frames, buf_frames;
+} snd_pcm_hw_params_t;
+
+typedef struct {
+	snd_pcm_uframes_t avail_min, start_threshold;
+} snd_pcm_sw_params_t;
+
+#define snd_pcm_hw_params_alloca(p)  (*(p) = alloca(sizeof(snd_pcm_hw_params_t)))
+#define snd_pcm_sw_params_alloca(p)  (*(p) = alloca(sizeof(snd_pcm_sw_params_t)))
+
+#define VDEV_PERIOD_MIN  16 // frames
+#define VDEV_CHANNELS_MAX  32
+
+typedef struct {
+	snd_pcm_stream_t stream;
+	snd_pcm_state_t state;
+	snd_pcm_hw_params_t hw;
+	snd_pcm_sw_params_t sw;
+	unsigned frame_size;
+	void *buf;
+	snd_pcm_channel_area_t area;
+	uint64_t hw_ptr, appl_ptr; // frames since the stream has been prepared
+	snd_htimestamp_t tstamp; // when hw_ptr has moved the last time
+
+	// Clock
+	int timer;
+	uint64_t period_ns; // the tick interval
+	uint64_t start_ns; // when the stream has been started
+	uint64_t tick; // ticks since the start
+	uint64_t due_ns; // when the next tick fires
+	uint64_t stall_until_ns, suspend_until_ns;
+	uint64_t stop_ns; // when the stream has been stopped;  0: it has never been running
+
+	// Options
+	unsigned jitter_usec, stall_every, stall_msec, xrun_every, suspend_every, suspend_msec;
+	double speed;
+	uint32_t rand;
+	FILE *out;
+
+	uint32_t counter; // capture: the test signal
+	uint64_t ticks; // total number of ticks
+	unsigned xruns, stalls, suspends;
+} snd_pcm_t;
+
+static inline uint64_t _vdev_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint32_t _vdev_rand(snd_pcm_t *p)
+{
+	// xorshift32
+	uint32_t x = p->rand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return p->rand = x;
+}
+
+static inline void _vdev_log(const char *msg, uint64_t ticks)
+{
+	char ts[16];
+	fprintf(stderr, "%s: vdev: tick %llu: %s\n", pcm_glitch_time(ts), (unsigned long long)ticks, msg);
+}
+
+static inline void _vdev_parse(snd_pcm_t *p, const char *id)
+{
+	p->speed = 1;
+	p->rand = 1;
+
+	char *s = strdup(id), *saveptr;
+	for (char *opt = strtok_r(s, ",", &saveptr);  opt != NULL;  opt = strtok_r(NULL, ",", &saveptr)) {
+		if (!strncmp(opt, "jitter=", 7))
+			p->jitter_usec = strtoul(opt + 7, NULL, 10);
+		else if (!strncmp(opt, "stall=", 6))
+			sscanf(opt + 6, "%u:%u", &p->stall_every, &p->stall_msec);
+		else if (!strncmp(opt, "xrun=", 5))
+			p->xrun_every = strtoul(opt + 5, NULL, 10);
+		else if (!strncmp(opt, "suspend=", 8))
+			sscanf(opt + 8, "%u:%u", &p->suspend_every, &p->suspend_msec);
+		else if (!strncmp(opt, "speed=", 6))
+			p->speed = strtod(opt + 6, NULL);
+		else if (!strncmp(opt, "seed=", 5))
+			p->rand = strtoul(opt + 5, NULL, 10) | 1;
+		else if (!strncmp(opt, "out=", 4))
+			p->out = fopen(opt + 4, "wb");
+		// The other values (e.g. the tools' default "plughw:0,0") are ignored
+	}
+	free(s);
+}
+
+static inline int snd_pcm_open(snd_pcm_t **pcm, const char *id, snd_pcm_stream_t stream, int mode)
+{
+	*pcm = NULL;
+	snd_pcm_t *p = calloc(1, sizeof(snd_pcm_t));
+	if (p == NULL)
+		return -ENOMEM;
+	p->stream = stream;
+	p->state = SND_PCM_STATE_OPEN;
+	if (-1 == (p->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+		int e = errno;
+		free(p);
+		return -e;
+	}
+	_vdev_parse(p, id);
+	*pcm = p;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_any(snd_pcm_t *p, snd_pcm_hw_params_t *h)
+{
+	h->format = SND_PCM_FORMAT_S16_LE;
+	h->rate = 48000;
+	h->channels = 2;
+	h->period_frames = 1024;
+	h->buf_frames = 4096;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_access(snd_pcm_t *p, snd_pcm_hw_params_t *h, snd_pcm_access_t access)
+{
+	return (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) ? 0 : -EINVAL;
+}
+
+static inline int snd_pcm_hw_params_set_format(snd_pcm_t *p, snd_pcm_hw_params_t *h, snd_pcm_format_t format)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S16_LE:
+	case SND_PCM_FORMAT_S24_3LE:
+	case SND_PCM_FORMAT_S32_LE:
+	case SND_PCM_FORMAT_FLOAT_LE:
+		h->format = format;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+static inline int snd_pcm_hw_params_set_channels_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, unsigned *channels)
+{
+	if (*channels == 0)
+		*channels = 1;
+	else if (*channels > VDEV_CHANNELS_MAX)
+		*channels = VDEV_CHANNELS_MAX;
+	h->channels = *channels;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_rate_resample(snd_pcm_t *p, snd_pcm_hw_params_t *h, unsigned val)
+{
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_rate_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, unsigned *rate, int *dir)
+{
+	if (*rate == 0)
+		*rate = 48000;
+	h->rate = *rate;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_period_size_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, snd_pcm_uframes_t *frames, int *dir)
+{
+	if (*frames < VDEV_PERIOD_MIN)
+		*frames = VDEV_PERIOD_MIN;
+	h->period_frames = *frames;
+	if (h->buf_frames < h->period_frames)
+		h->buf_frames = h->period_frames;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_period_time_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, unsigned *usec, int *dir)
+{
+	snd_pcm_uframes_t frames = (uint64_t)*usec * h->rate / 1000000;
+	snd_pcm_hw_params_set_period_size_near(p, h, &frames, dir);
+	*usec = (uint64_t)frames * 1000000 / h->rate;
+	return 0;
+}
+
+/** The buffer holds at least 1 period */
+static inline int snd_pcm_hw_params_set_buffer_size_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, snd_pcm_uframes_t *frames)
+{
+	if (*frames < h->period_frames)
+		*frames = h->period_frames;
+	h->buf_frames = *frames;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_set_buffer_time_near(snd_pcm_t *p, snd_pcm_hw_params_t *h, unsigned *usec, int *dir)
+{
+	snd_pcm_uframes_t frames = (uint64_t)*usec * h->rate / 1000000;
+	snd_pcm_hw_params_set_buffer_size_near(p, h, &frames);
+	*usec = (uint64_t)frames * 1000000 / h->rate;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_get_period_size_min(const snd_pcm_hw_params_t *h, snd_pcm_uframes_t *frames, int *dir)
+{
+	*frames = VDEV_PERIOD_MIN;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_get_period_size(const snd_pcm_hw_params_t *h, snd_pcm_uframes_t *frames, int *dir)
+{
+	*frames = h->period_frames;
+	return 0;
+}
+
+static inline int snd_pcm_hw_params_get_buffer_size(const snd_pcm_hw_params_t *h, snd_pcm_uframes_t *frames)
+{
+	*frames = h->buf_frames;
+	return 0;
+}
+
+/** Apply the configuration and allocate the buffer */
+static inline int snd_pcm_hw_params(snd_pcm_t *p, snd_pcm_hw_params_t *h)
+{
+	unsigned sample_size = 4;
+	if (h->format == SND_PCM_FORMAT_S16_LE)
+		sample_size = 2;
+	else if (h->format == SND_PCM_FORMAT_S24_3LE)
+		sample_size = 3;
+
+	p->hw = *h;
+	p->frame_size = sample_size * h->channels;
+	free(p->buf);
+	if (NULL == (p->buf = calloc(h->buf_frames, p->frame_size)))
+		return -ENOMEM;
+	p->area.addr = p->buf;
+	p->area.first = 0;
+	p->area.step = p->frame_size * 8;
+
+	p->period_ns = 0;
+	if (p->speed != 0)
+		p->period_ns = (uint64_t)((double)h->period_frames * 1000000000 / h->rate / p->speed);
+
+	p->sw.avail_min = h->period_frames;
+	p->sw.start_threshold = 1;
+	p->state = SND_PCM_STATE_PREPARED;
+	return 0;
+}
+
+static inline int snd_pcm_sw_params_current(snd_pcm_t *p, snd_pcm_sw_params_t *s)
+{
+	*s = p->sw;
+	return 0;
+}
+
+static inline int snd_pcm_sw_params_set_avail_min(snd_pcm_t *p, snd_pcm_sw_params_t *s, snd_pcm_uframes_t frames)
+{
+	s->avail_min = frames;
+	return 0;
+}
+
+static inline int snd_pcm_sw_params_set_start_threshold(snd_pcm_t *p, snd_pcm_sw_params_t *s, snd_pcm_uframes_t frames)
+{
+	s->start_threshold = frames;
+	return 0;
+}
+
+// Timestamps are always enabled and monotonic
+static inline int snd_pcm_sw_params_set_tstamp_mode(snd_pcm_t *p, snd_pcm_sw_params_t *s, snd_pcm_tstamp_t mode)
+{
+	return 0;
+}
+
+static inline int snd_pcm_sw_params_set_tstamp_type(snd_pcm_t *p, snd_pcm_sw_params_t *s, snd_pcm_tstamp_type_t type)
+{
+	return 0;
+}
+
+static inline int snd_pcm_sw_params(snd_pcm_t *p, snd_pcm_sw_params_t *s)
+{
+	p->sw = *s;
+	return 0;
+}
+
+/** Free space (playback) or captured data (capture) in the buffer */
+static inline snd_pcm_uframes_t _vdev_avail(const snd_pcm_t *p)
+{
+	if (p->stream == SND_PCM_STREAM_PLAYBACK)
+		return p->hw.buf_frames - (p->appl_ptr - p->hw_ptr);
+	return p->hw_ptr - p->appl_ptr;
+}
+
+/** Set the timer to the next tick, or disarm it if the stream isn't running */
+static inline void _vdev_arm(snd_pcm_t *p)
+{
+	struct itimerspec its = {};
+	if (p->state == SND_PCM_STATE_RUNNING || p->state == SND_PCM_STATE_DRAINING) {
+		if (p->speed == 0) {
+			its.it_value.tv_nsec = 1; // fire immediately
+		} else {
+			its.it_value.tv_sec = p->due_ns / 1000000000;
+			its.it_value.tv_nsec = p->due_ns % 1000000000;
+		}
+	}
+	timerfd_settime(p->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/** Compute when the next tick fires */
+static inline void _vdev_next(snd_pcm_t *p)
+{
+	uint64_t due = p->start_ns + (p->tick + 1) * p->period_ns;
+	if (p->jitter_usec != 0)
+		due += (uint64_t)(_vdev_rand(p) % p->jitter_usec) * 1000;
+	if (due < p->stall_until_ns)
+		due = p->stall_until_ns;
+	if (due < p->due_ns)
+		due = p->due_ns; // a late tick can't overtake the previous one
+	p->due_ns = due;
+}
+
+static inline void _vdev_stop(snd_pcm_t *p, snd_pcm_state_t state, uint64_t now)
+{
+	p->state = state;
+	p->stop_ns = now;
+	_vdev_arm(p);
+}
+
+static inline void _vdev_start(snd_pcm_t *p, uint64_t now)
+{
+	// The time while the stream was stopped: capture loses the signal, playback outputs silence
+	if (p->stop_ns != 0 && p->speed != 0) {
+		uint64_t lost = (double)(now - p->stop_ns) * p->hw.rate * p->speed / 1000000000;
+		if (p->stream == SND_PCM_STREAM_CAPTURE) {
+			p->counter += lost;
+		} else if (p->out != NULL) {
+			char silence[4096] = {};
+			for (uint64_t n = lost * p->frame_size;  n != 0; ) {
+				size_t k = (n < sizeof(silence)) ? n : sizeof(silence);
+				fwrite(silence, 1, k, p->out);
+				n -= k;
+			}
+		}
+	}
+
+	p->state = SND_PCM_STATE_RUNNING;
+	p->start_ns = now;
+	p->tick = 0;
+	p->due_ns = 0;
+	p->stall_until_ns = 0;
+	_vdev_next(p);
+	_vdev_arm(p);
+}
+
+/** Output the played data [hw_ptr..hw_ptr+n) */
+static inline void _vdev_play(snd_pcm_t *p, snd_pcm_uframes_t n)
+{
+	if (p->out == NULL)
+		return;
+	snd_pcm_uframes_t off = p->hw_ptr % p->hw.buf_frames;
+	snd_pcm_uframes_t n1 = (n < p->hw.buf_frames - off) ? n : p->hw.buf_frames - off;
+	fwrite((char*)p->buf + off * p->frame_size, p->frame_size, n1, p->out);
+	fwrite(p->buf, p->frame_size, n - n1, p->out);
+}
+
+/** Produce the captured data [hw_ptr..hw_ptr+n) */
+static inline void _vdev_capture(snd_pcm_t *p, snd_pcm_uframes_t n)
+{
+	snd_pcm_uframes_t off = p->hw_ptr % p->hw.buf_frames;
+	snd_pcm_uframes_t n1 = (n < p->hw.buf_frames - off) ? n : p->hw.buf_frames - off;
+	void *d = (char*)p->buf + off * p->frame_size;
+	if (p->hw.format == SND_PCM_FORMAT_S16_LE && p->hw.channels >= 2) {
+		p->counter = pcm_glitch_fill(d, n1, p->hw.channels, p->counter);
+		p->counter = pcm_glitch_fill(p->buf, n - n1, p->hw.channels, p->counter);
+	} else {
+		memset(d, 0, n1 * p->frame_size);
+		memset(p->buf, 0, (n - n1) * p->frame_size);
+	}
+}
+
+/** The hardware processes 1 period */
+static inline void _vdev_tick(snd_pcm_t *p, uint64_t now)
+{
+	snd_pcm_uframes_t n = p->hw.period_frames;
+	p->tick++;
+	p->ticks++;
+
+	if (p->stream == SND_PCM_STREAM_CAPTURE) {
+		if (p->hw_ptr + n - p->appl_ptr > p->hw.buf_frames) {
+			_vdev_stop(p, SND_PCM_STATE_XRUN, now); // overrun
+			return;
+		}
+		_vdev_capture(p, n);
+		p->hw_ptr += n;
+
+	} else {
+		snd_pcm_uframes_t queued = p->appl_ptr - p->hw_ptr;
+		if (queued < n) {
+			_vdev_play(p, queued);
+			p->hw_ptr += queued;
+			if (p->state == SND_PCM_STATE_DRAINING)
+				_vdev_stop(p, SND_PCM_STATE_SETUP, now); // all data is played
+			else
+				_vdev_stop(p, SND_PCM_STATE_XRUN, now); // underrun
+			return;
+		}
+		_vdev_play(p, n);
+		p->hw_ptr += n;
+	}
+
+	p->tstamp.tv_sec = now / 1000000000;
+	p->tstamp.tv_nsec = now % 1000000000;
+
+	// Injected events
+	if (p->xrun_every != 0 && p->ticks % p->xrun_every == 0) {
+		_vdev_log("forced xrun", p->ticks);
+		_vdev_stop(p, SND_PCM_STATE_XRUN, now);
+		p->xruns++;
+	} else if (p->suspend_every != 0 && p->ticks % p->suspend_every == 0) {
+		_vdev_log("suspended", p->ticks);
+		p->suspend_until_ns = now + (uint64_t)p->suspend_msec * 1000000;
+		_vdev_stop(p, SND_PCM_STATE_SUSPENDED, now);
+		p->suspends++;
+	} else if (p->stall_every != 0 && p->ticks % p->stall_every == 0 && p->speed != 0) {
+		_vdev_log("stall", p->ticks);
+		p->stall_until_ns = now + (uint64_t)p->stall_msec * 1000000;
+		p->stalls++;
+	}
+}
+
+/** Process the ticks that are due */
+static inline void _vdev_update(snd_pcm_t *p)
+{
+	if (p->state != SND_PCM_STATE_RUNNING && p->state != SND_PCM_STATE_DRAINING)
+		return;
+
+	uint64_t expirations;
+	read(p->timer, &expirations, sizeof(expirations));
+
+	uint64_t now = _vdev_now();
+	while (p->state == SND_PCM_STATE_RUNNING || p->state == SND_PCM_STATE_DRAINING) {
+		if (p->speed != 0) {
+			if (now < p->due_ns)
+				break;
+		} else {
+			// No clock: process the data as soon as there's a period of it (or of free space)
+			snd_pcm_uframes_t avail = _vdev_avail(p);
+			if (p->stream == SND_PCM_STREAM_CAPTURE && p->hw.buf_frames - avail < p->hw.period_frames)
+				break;
+			if (p->stream == SND_PCM_STREAM_PLAYBACK && p->state != SND_PCM_STATE_DRAINING
+				&& p->hw.buf_frames - avail < p->hw.period_frames)
+				break;
+		}
+		_vdev_tick(p, now);
+		_vdev_next(p);
+	}
+	_vdev_arm(p);
+}
+
+static inline snd_pcm_sframes_t snd_pcm_avail_update(snd_pcm_t *p)
+{
+	_vdev_update(p);
+	if (p->state == SND_PCM_STATE_XRUN)
+		return -EPIPE;
+	if (p->state == SND_PCM_STATE_SUSPENDED)
+		return -ESTRPIPE;
+	return _vdev_avail(p);
+}
+
+static inline int snd_pcm_mmap_begin(snd_pcm_t *p, const snd_pcm_channel_area_t **areas, snd_pcm_uframes_t *offset, snd_pcm_uframes_t *frames)
+{
+	snd_pcm_uframes_t off = p->appl_ptr % p->hw.buf_frames;
+	snd_pcm_uframes_t n = _vdev_avail(p);
+	if (n > p->hw.buf_frames - off)
+		n = p->hw.buf_frames - off;
+	if (*frames > n)
+		*frames = n;
+	*offset = off;
+	*areas = &p->area;
+	return 0;
+}
+
+static inline snd_pcm_sframes_t snd_pcm_mmap_commit(snd_pcm_t *p, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+	if (p->state == SND_PCM_STATE_XRUN)
+		return -EPIPE;
+	if (p->state == SND_PCM_STATE_SUSPENDED)
+		return -ESTRPIPE;
+	p->appl_ptr += frames;
+
+	// Start the playback automatically as soon as there's enough data
+	if (p->stream == SND_PCM_STREAM_PLAYBACK && p->state == SND_PCM_STATE_PREPARED
+		&& p->appl_ptr - p->hw_ptr >= p->sw.start_threshold)
+		_vdev_start(p, _vdev_now());
+	else if (p->speed == 0)
+		_vdev_arm(p); // there may be more data to process now
+	return frames;
+}
+
+static inline snd_pcm_state_t snd_pcm_state(snd_pcm_t *p)
+{
+	_vdev_update(p);
+	return p->state;
+}
+
+static inline int snd_pcm_start(snd_pcm_t *p)
+{
+	if (p->state != SND_PCM_STATE_PREPARED)
+		return -EBADFD;
+	_vdev_start(p, _vdev_now());
+	return 0;
+}
+
+/** Reset the buffer after an xrun */
+static inline int snd_pcm_prepare(snd_pcm_t *p)
+{
+	if (p->state == SND_PCM_STATE_RUNNING || p->state == SND_PCM_STATE_DRAINING)
+		p->stop_ns = _vdev_now();
+	p->hw_ptr = p->appl_ptr = 0;
+	p->state = SND_PCM_STATE_PREPARED;
+	_vdev_arm(p);
+	return 0;
+}
+
+/** Continue the stream after the suspend time */
+static inline int snd_pcm_resume(snd_pcm_t *p)
+{
+	if (p->state != SND_PCM_STATE_SUSPENDED)
+		return -EBADFD;
+	uint64_t now = _vdev_now();
+	if (now < p->suspend_until_ns)
+		return -EAGAIN;
+	_vdev_start(p, now);
+	return 0;
+}
+
+/** Playback: wait until all data is played */
+static inline int snd_pcm_drain(snd_pcm_t *p)
+{
+	if (p->stream == SND_PCM_STREAM_PLAYBACK) {
+		if (p->state == SND_PCM_STATE_PREPARED && p->appl_ptr != p->hw_ptr)
+			_vdev_start(p, _vdev_now());
+		if (p->state == SND_PCM_STATE_RUNNING)
+			p->state = SND_PCM_STATE_DRAINING;
+
+		while (p->state == SND_PCM_STATE_DRAINING) {
+			struct pollfd pfd = { p->timer, POLLIN, 0 };
+			poll(&pfd, 1, 1000);
+			_vdev_update(p);
+		}
+	}
+
+	p->state = SND_PCM_STATE_SETUP;
+	_vdev_arm(p);
+	return 0;
+}
+
+static inline int snd_pcm_close(snd_pcm_t *p)
+{
+	fprintf(stderr, "vdev: %llu ticks;  injected: %u xruns, %u stalls, %u suspends\n"
+		, (unsigned long long)p->ticks, p->xruns, p->stalls, p->suspends);
+	close(p->timer);
+	if (p->out != NULL)
+		fclose(p->out);
+	free(p->buf);
+	free(p);
+	return 0;
+}
+
+static inline int snd_pcm_poll_descriptors(snd_pcm_t *p, struct pollfd *fds, unsigned space)
+{
+	if (space < 1)
+		return 0;
+	fds[0].fd = p->timer;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+	return 1;
+}
+
+/** Translate the timer events to the stream's state */
+static inline int snd_pcm_poll_descriptors_revents(snd_pcm_t *p, struct pollfd *fds, unsigned nfds, unsigned short *revents)
+{
+	_vdev_update(p);
+	*revents = 0;
+	if (p->state == SND_PCM_STATE_XRUN || p->state == SND_PCM_STATE_SUSPENDED)
+		*revents = POLLERR;
+	else if (_vdev_avail(p) >= p->sw.avail_min)
+		*revents = (p->stream == SND_PCM_STREAM_PLAYBACK) ? POLLOUT : POLLIN;
+	return 0;
+}
+
+static inline int snd_pcm_htimestamp(snd_pcm_t *p, snd_pcm_uframes_t *avail, snd_htimestamp_t *tstamp)
+{
+	*avail = _vdev_avail(p);
+	*tstamp = p->tstamp;
+	return 0;
+}
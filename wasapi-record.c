@@ -1,19 +1,52 @@
 /** Audio API Quick Start Guide: WASAPI: Record audio and pass to stdout
+Usage: wasapi-record [-format int16|int24|int32|float32] [-rate HZ] [-channels N] [-buffer MSEC] [-lowlatency]
 Link with -lole32 */
 #define COBJMACROS
 #include <mmdeviceapi.h>
 #include <audioclient.h>
+#include <mmreg.h>
 #include <assert.h>
 #include <stdio.h>
+#include "audio-conf.h"
+
+// Let the audio engine convert our format to the mix format (Windows 7+)
+#ifndef AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM
+	#define AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM  0x80000000
+#endif
+#ifndef AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY
+	#define AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY  0x08000000
+#endif
+#ifndef WAVE_FORMAT_EXTENSIBLE
+	#define WAVE_FORMAT_EXTENSIBLE  0xfffe
+#endif
 
 int quit;
 
 const GUID _CLSID_MMDeviceEnumerator = {0xbcde0395, 0xe52f, 0x467c, {0x8e,0x3d, 0xc4,0x57,0x92,0x91,0x69,0x2e}};
 const GUID _IID_IMMDeviceEnumerator = {0xa95664d2, 0x9614, 0x4f35, {0xa7,0x46, 0xde,0x8d,0xb6,0x36,0x17,0xe6}};
+const GUID _KSDATAFORMAT_SUBTYPE_PCM = {0x00000001, 0x0000, 0x0010, {0x80,0x00, 0x00,0xaa,0x00,0x38,0x9b,0x71}};
+const GUID _KSDATAFORMAT_SUBTYPE_IEEE_FLOAT = {0x00000003, 0x0000, 0x0010, {0x80,0x00, 0x00,0xaa,0x00,0x38,0x9b,0x71}};
 const GUID _IID_IAudioClient = {0x1cb9ad4c, 0xdbfa, 0x4c32, {0xb1,0x78, 0xc2,0xf5,0x68,0xa7,0x03,0xb2}};
 const GUID _IID_IAudioCaptureClient = {0xc8adbd64, 0xe71e, 0x48a0, {0xa4,0xde, 0x18,0x5c,0x39,0x5c,0xd3,0x17}};
 
-IAudioClient* abuf_create(int playback, int loopback_mode, u_int *buf_frames, int *frame_size)
+/** Speaker positions for the channels in WAV order: FL FR FC LFE BL BR SL SR
+Return 0 (no positions) for an unusual number of channels */
+DWORD channel_mask(u_int channels)
+{
+	switch (channels) {
+	case 1: return 0x4; // FC
+	case 2: return 0x3; // FL FR
+	case 4: return 0x33; // FL FR BL BR
+	case 6: return 0x3f; // 5.1
+	case 8: return 0x63f; // 7.1
+	}
+	return 0;
+}
+
+/** Open the device with the requested stream parameters
+conf: [in/out] the requested values (rate, channels: 0 - use the mix format);  the actual values on return.
+  In shared mode the period is the audio engine's: we can't set it. */
+IAudioClient* abuf_create(int playback, int loopback_mode, struct audio_conf *conf, u_int *buf_frames, int *frame_size)
 {
 	// Create device enumerator object
 	IMMDeviceEnumerator *enu = NULL;
@@ -33,23 +66,52 @@ IAudioClient* abuf_create(int playback, int loopback_mode, u_int *buf_frames, in
 	IAudioClient *client = NULL;
 	assert(0 == IMMDevice_Activate(dev, &_IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&client));
 
-	// Get audio format for WASAPI shared mode
+	// Get audio format for WASAPI shared mode (float32)
 	WAVEFORMATEX *wf = NULL;
 	assert(0 == IAudioClient_GetMixFormat(client, &wf));
-	fprintf(stderr, "Using format float32, sample rate %u, channels %u\n", (int)wf->nSamplesPerSec, (int)wf->nChannels);
+	WAVEFORMATEX *f = wf;
+	int aflags = (loopback_mode) ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0;
 
-	// Set buffer parameters
-	int buffer_length_msec = 500;
-	REFERENCE_TIME dur = buffer_length_msec * 1000 * 10;
+	// Any other format: the audio engine converts the data for us.
+	// Plain WAVEFORMATEX describes only int16 mono or stereo:
+	//  any other format needs WAVEFORMATEXTENSIBLE with the sample type and the speaker positions.
+	WAVEFORMATEXTENSIBLE wfx = {};
+	if (conf->format != PCM_F32 || conf->rate != 0 || conf->channels != 0) {
+		u_int channels = (conf->channels != 0) ? conf->channels : wf->nChannels;
+		wfx.Format.wFormatTag = WAVE_FORMAT_PCM;
+		wfx.Format.nChannels = channels;
+		wfx.Format.nSamplesPerSec = (conf->rate != 0) ? conf->rate : wf->nSamplesPerSec;
+		wfx.Format.wBitsPerSample = pcm_fmt_size(conf->format) * 8;
+		wfx.Format.nBlockAlign = pcm_fmt_size(conf->format) * channels;
+		wfx.Format.nAvgBytesPerSec = wfx.Format.nSamplesPerSec * wfx.Format.nBlockAlign;
+		if (!(conf->format == PCM_S16 && channels <= 2)) {
+			wfx.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+			wfx.Format.cbSize = sizeof(wfx) - sizeof(wfx.Format);
+			wfx.Samples.wValidBitsPerSample = wfx.Format.wBitsPerSample;
+			wfx.dwChannelMask = channel_mask(channels);
+			wfx.SubFormat = (conf->format == PCM_F32) ? _KSDATAFORMAT_SUBTYPE_IEEE_FLOAT : _KSDATAFORMAT_SUBTYPE_PCM;
+		}
+		f = &wfx.Format;
+		aflags |= AUDCLNT_STREAMFLAGS_AUTOCONVERTPCM | AUDCLNT_STREAMFLAGS_SRC_DEFAULT_QUALITY;
+	}
+
+	// Set buffer parameters.
+	// Low latency: 0 means the smallest buffer the audio engine supports.
+	REFERENCE_TIME dur = (REFERENCE_TIME)conf->buffer_usec * 10;
 	int mode = AUDCLNT_SHAREMODE_SHARED;
-	int aflags = (loopback_mode) ? AUDCLNT_STREAMFLAGS_LOOPBACK : 0;
-	assert(0 == IAudioClient_Initialize(client, mode, aflags, dur, dur, (void*)wf, NULL));
+	assert(0 == IAudioClient_Initialize(client, mode, aflags, dur, 0, (void*)f, NULL));
 
-	// Get the actual buffer length
+	// Get the actual buffer length and the audio engine's period
 	assert(0 == IAudioClient_GetBufferSize(client, buf_frames));
-	buffer_length_msec = *buf_frames * 1000 / wf->nSamplesPerSec;
+	REFERENCE_TIME period;
+	assert(0 == IAudioClient_GetDevicePeriod(client, &period, NULL));
+	conf->rate = f->nSamplesPerSec;
+	conf->channels = f->nChannels;
+	conf->buffer_usec = (uint64_t)*buf_frames * 1000000 / f->nSamplesPerSec;
+	conf->period_usec = period / 10;
+	audio_conf_report(conf->format, conf->rate, conf->channels, conf->buffer_usec, conf->period_usec);
 
-	*frame_size = wf->nBlockAlign;
+	*frame_size = f->nBlockAlign;
 
 	CoTaskMemFree(wf);
 	IMMDevice_Release(dev);
@@ -67,13 +129,22 @@ static BOOL WINAPI on_ctrl(DWORD ctrl)
 	return 0;
 }
 
-void main()
+void main(int argc, char **argv)
 {
+	// "-format", "-rate", "-channels", "-buffer", "-lowlatency": see audio-conf.h
+	struct audio_conf conf;
+	audio_conf_init(&conf);
+	for (int i = 1;  i < argc;  i++) {
+		audio_conf_arg(&conf, argc, argv, &i);
+	}
+	// Rate and channels stay 0: the mix format's values
+	audio_conf_default(&conf, PCM_F32, 0, 0, 500);
+
 	CoInitializeEx(NULL, 0);
 
 	u_int buf_frames;
 	int frame_size;
-	IAudioClient *client = abuf_create(0, 0, &buf_frames, &frame_size);
+	IAudioClient *client = abuf_create(0, 0, &conf, &buf_frames, &frame_size);
 
 	// Get interface for an audio capture object
 	IAudioCaptureClient *capt;
@@ -95,7 +166,7 @@ void main()
 
 		if (r == AUDCLNT_S_BUFFER_EMPTY) {
 			// Buffer is empty. Wait for more data.
-			int period_ms = 100;
+			int period_ms = conf.period_usec / 1000;
 			Sleep(period_ms);
 			continue;
 		}